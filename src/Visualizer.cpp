@@ -1,38 +1,51 @@
 #include "Visualizer.h"
+#include "VisualizerJournal.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <limits>
+#include <numeric>
 #include <ctime>
 #include <chrono>
+#include <cmath>
+#include <cstring>
 #include <sstream>
+#include <thread>
 
 #include <boost/filesystem.hpp>
-
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <pcl/common/io.h>
 #include <pcl/io/pcd_io.h>
 
-using namespace pcv;
+#include <vtkActor.h>
+#include <vtkCellArray.h>
+#include <vtkCellData.h>
+#include <vtkFloatArray.h>
+#include <vtkIdTypeArray.h>
+#include <vtkPNGWriter.h>
+#include <vtkPolyData.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkWindowToImageFilter.h>
 
-struct PointLine
-{
-    float x;
-    float y;
-    float z;
-    float x2;
-    float y2;
-    float z2;
-    uint32_t rgb;
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW   // make sure new allocators are aligned
-} EIGEN_ALIGN16;                      // enforce SSE padding for correct memory alignment
+using namespace pcv;
 
-POINT_CLOUD_REGISTER_POINT_STRUCT(PointLine,
-(float, x, x)
-(float, y, y)
-(float, z, z)
-(float, x2, x2)
-(float, y2, y2)
-(float, z2, z2)
-(uint32_t, rgb, rgb))
+const std::string Visualizer::sHeaderIndexFileName = ".visualizer-index";
 
 struct PointPlane
 {
@@ -111,24 +124,50 @@ POINT_CLOUD_REGISTER_POINT_STRUCT(PointCylinder,
 (float, length, length)
 (uint32_t, rgb, rgb))
 
-Visualizer::Visualizer(const FileName& fileName)
+Visualizer::Visualizer(const FileName& fileName, const Options& options) :
+    mOptions(options)
 {
+    mLoader.setMemoryBudget(getCacheLevelBudget());
+
+    for (const auto& definition : mOptions.mFeatureExpressions)
+        addFeatureExpression(definition);
+
+    mUsePercentileRange = (mOptions.mColormapPercentile > 0.0f);
+
     mBundleSwitchInfo.mCamParams.fovy = -1.0; // put invalid value to detect that it is uninitialized
 
     generateBundles(fileName);
 
+    // Live: nothing saved yet, wait for the first clouds of the publishing process.
+    if ((getNbBundles() == 0) && !mOptions.mLiveRingName.empty() && !isBatchMode())
+    {
+        std::cout << "[Visualizer] Waiting for live clouds from '" << mOptions.mLiveRingName << "'..." << std::endl;
+        while (getNbBundles() == 0)
+        {
+            receiveLiveClouds();
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
     if (getNbBundles() > 0)
     {
+        if (isBatchMode())
+        {
+            renderBatch();
+            return;
+        }
+
         while (mBundleSwitchInfo.mSwitchToBundleIdx >= 0)
         {
             switchBundle();
-            render(getCurrentBundle());
+            render();
         }
     }
     else
     {
         std::cout << "[Visualizer] No valid visualizer PCD file was found with input '" + fileName + "'.";
-        getchar();
+        if (!isBatchMode())
+            getchar();
     }
 }
 
@@ -140,164 +179,1048 @@ void Visualizer::generateBundles(const FileName& inputFileOrFolder)
     const bool isInputDir = fs::is_directory(fileOrFolderPath);
 
     mPath = isInputDir ? fileOrFolderPath : fs::path(fileOrFolderPath).parent_path();
-    const auto filesIt = boost::make_iterator_range(fs::directory_iterator(mPath), {});
 
-    std::string currentBundleName = "";
+    // Clouds of a crashed process only exist in journals; turn them into regular files first.
+    Journal::recoverFolder(mPath.string());
+
+    const auto paths = listNewFiles();
 
-    for (auto& it : filesIt)
+    // On a file, only its bundle is needed to display it; the other files are parsed in background.
+    if (!isInputDir && !isBatchMode() && generateFileBundle(fileOrFolderPath, paths))
+    {
+        mBundleSwitchInfo.mSwitchToBundleIdx = 0;
+    }
+    else
     {
-        Cloud newCloud;
+        // Headers of files that did not change since the last time come from the index. Forget removed files.
+        mHeaderIndex = loadHeaderIndex(mPath);
+        const size_t nbIndexed = mHeaderIndex.size();
+        for (auto it = mHeaderIndex.begin(); it != mHeaderIndex.end();)
+            it = (mKnownFiles.count(it->first) == 0) ? mHeaderIndex.erase(it) : std::next(it);
 
-        newCloud.mFullName = it.path().string();
+        if (addFiles(paths) || (mHeaderIndex.size() != nbIndexed))
+            saveHeaderIndex(mPath, mHeaderIndex);
 
-        const auto ext = fs::path(newCloud.mFullName).extension().string();
+        mBundleSwitchInfo.mSwitchToBundleIdx = getNbBundles() - 1; // start with most recent
 
-        const bool isPcd = (ext == ".pcd");
-        const bool isCpcd = (ext == ".cpcd");
+        // Override start bundle with the bundle of the input file, if possible.
+        if (!isInputDir)
+        {
+            auto it = std::find_if(mBundles.begin(), mBundles.end(), [&](const Bundle& bundle)
+            {
+                for (const Cloud& cloud : bundle.mClouds)
+                    if (cloud.mFileName == fileOrFolderPath.stem().string())
+                        return true;
+                return false;
+            });
+
+            if (it != mBundles.end())
+                mBundleSwitchInfo.mSwitchToBundleIdx = std::distance(mBundles.begin(), it);
+        }
+    }
 
-        if (!isPcd && !isCpcd)
-            continue;
+    // Override rendering properties with clouds of first bundle to be rendered.
+    if (mBundleSwitchInfo.mSwitchToBundleIdx >= 0)
+        for (const auto& cloud : mBundles[mBundleSwitchInfo.mSwitchToBundleIdx].mClouds)
+            mProperties[getCloudRenderingPropertiesKey(cloud)] = cloud.mRenderingProperties;
+}
+
+bool Visualizer::generateFileBundle(const boost::filesystem::path& file, const std::vector<boost::filesystem::path>& paths)
+{
+    const auto siblings = getBundleSiblings(file, paths);
+    if (siblings.empty())
+        return false;
 
-        newCloud.mFileName = fs::path(newCloud.mFullName).stem().string();
+    addFiles(siblings); // headers read from the files, the index is loaded in background
+    if (getNbBundles() != 1) // not expected, the siblings make one bundle
+    {
+        mBundles.clear();
+        mLastBundleIdxByName.clear();
+        mLastBundleIdxBySuffix.clear();
+        mHeaderIndex.clear();
+        return false;
+    }
 
-        std::stringstream ss(newCloud.mFileName);
-        std::string substr;
+    mCatalog.start(mPath, paths);
+    return true;
+}
+
+Visualizer::CatalogLoader::~CatalogLoader()
+{
+    mIsStopped = true;
+    if (mThread.joinable())
+        mThread.join();
+}
+
+void Visualizer::CatalogLoader::start(const boost::filesystem::path& folder, const std::vector<boost::filesystem::path>& paths)
+{
+    mThread = std::thread([this, folder, paths]()
+    {
+        mCatalog.mHeaderIndex = loadHeaderIndex(folder);
+        mCatalog.mEntries = parseFiles(paths, mCatalog.mHeaderIndex, &mIsStopped);
+        mIsReady = true;
+    });
+}
+
+Visualizer::Catalog Visualizer::CatalogLoader::take()
+{
+    mThread.join(); // not pending anymore
+    return std::move(mCatalog);
+}
+
+std::vector<boost::filesystem::path> Visualizer::getBundleSiblings(const boost::filesystem::path& file, const std::vector<boost::filesystem::path>& paths)
+{
+    // Named as parsed by addFiles; compare bundles depend on the other bundles of the folder.
+    struct Name
+    {
+        size_t mPathIdx{ 0 };
+        FileEntry mEntry;
+    };
+
+    auto parseName = [](const boost::filesystem::path& path, Name& name)
+    {
+        return (path.extension() == ".pcd") && parseFileName(path, name.mEntry) && !name.mEntry.mIsCompare;
+    };
 
-        auto getTokenFromDelim = [&](char c)
+    Name fileName;
+    if (!parseName(file, fileName))
+        return {};
+    const auto& fileCloud = fileName.mEntry.mCloud;
+
+    // Files of the same bundle name, in the order in which they are added to bundles.
+    std::vector<Name> names;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        Name name;
+        name.mPathIdx = i;
+        if (parseName(paths[i], name) && (name.mEntry.mCloud.mBundleName == fileCloud.mBundleName))
+            names.push_back(std::move(name));
+    }
+
+    std::sort(names.begin(), names.end(), [](const Name& a, const Name& b)
+    {
+        const auto& cloudA = a.mEntry.mCloud;
+        const auto& cloudB = b.mEntry.mCloud;
+        if (cloudA.mTimeStamp != cloudB.mTimeStamp)
+            return cloudA.mTimeStamp < cloudB.mTimeStamp;
+        return cloudA.mFileName < cloudB.mFileName;
+    });
+
+    // Same grouping as addCloudToBundle: a bundle of that name gets the next clouds until one of its cloud names comes again.
+    std::vector<boost::filesystem::path> siblings;
+    std::unordered_set<std::string> cloudNames;
+    bool hasFile = false;
+    for (const auto& name : names)
+    {
+        const auto& cloud = name.mEntry.mCloud;
+        if (!cloudNames.insert(cloud.mCloudName).second) // new bundle
         {
-            getline( ss, substr, c );
-            return substr;
-        };
+            if (hasFile)
+                break;
+            siblings.clear();
+            cloudNames = { cloud.mCloudName };
+        }
+
+        siblings.push_back(paths[name.mPathIdx]);
+        hasFile = hasFile || (cloud.mFileName == fileCloud.mFileName);
+    }
+
+    return hasFile ? siblings : std::vector<boost::filesystem::path>();
+}
+
+void Visualizer::mergeCatalog()
+{
+    auto catalog = mCatalog.take();
+
+    // The current bundle keeps its loaded clouds and their state; the others are assembled from all the files.
+    Bundle current = std::move(getCurrentBundle());
+    mBundles.clear();
+    mLastBundleIdxByName.clear();
+    mLastBundleIdxBySuffix.clear();
+
+    // Headers of files that did not change since the last time come from the index. Forget removed files.
+    mHeaderIndex = std::move(catalog.mHeaderIndex);
+    const size_t nbIndexed = mHeaderIndex.size();
+    for (auto it = mHeaderIndex.begin(); it != mHeaderIndex.end();)
+        it = (mKnownFiles.count(it->first) == 0) ? mHeaderIndex.erase(it) : std::next(it);
+
+    if (assembleFiles(catalog.mEntries) || (mHeaderIndex.size() != nbIndexed))
+        saveHeaderIndex(mPath, mHeaderIndex);
+
+    auto it = std::find_if(mBundles.begin(), mBundles.end(), [&](const Bundle& bundle)
+    {
+        return (bundle.mName == current.mName) && !bundle.mClouds.empty() && (bundle.mClouds.front().mFullName == current.mClouds.front().mFullName);
+    });
+
+    if (it != mBundles.end())
+    {
+        mCurrentBundleIdx = std::distance(mBundles.begin(), it);
+        *it = std::move(current);
+    }
+    else // not expected, the current bundle was assembled from the same files
+    {
+        logWarning("[mergeCatalog] The current bundle was not found in the folder. Adding it last.");
+        pushBundle(current);
+        mCurrentBundleIdx = getNbBundles() - 1;
+    }
+
+    if (mustSwitchBundle()) // requested before the other bundles were known
+        mBundleSwitchInfo.mSwitchToBundleIdx = mCurrentBundleIdx;
+
+    std::cout << "[Visualizer] Folder indexed: " << catalog.mEntries.size() << " files, " << getNbBundles() << " bundles." << std::endl;
+
+    prefetchBundles(); // the neighbours are known now
+    printBundleStack();
+    mIsRenderDirty = true;
+}
+
+std::vector<boost::filesystem::path> Visualizer::listNewFiles(std::vector<boost::filesystem::path>* changedPaths)
+{
+    namespace fs = boost::filesystem;
 
-        auto getToken = [&]()
+    std::vector<fs::path> paths;
+    boost::system::error_code ec;
+    if (!fs::is_directory(mPath, ec))
+        return paths; // live clouds may come before the folder is created
+
+    for (const auto& it : boost::make_iterator_range(fs::directory_iterator(mPath), {}))
+    {
+        const auto ext = it.path().extension().string();
+        if (ext != ".pcd" && ext != ".cpcd")
+            continue;
+
+        const auto version = FileVersion::get(it.path());
+
+        auto known = mKnownFiles.emplace(it.path().filename().string(), version);
+        if (known.second)
         {
-            return getTokenFromDelim('.');
-        };
+            paths.push_back(it.path());
+        }
+        else if (known.first->second != version)
+        {
+            // Rewritten (e.g. saved again by its process); live clouds are known before their file is listed.
+            const bool isRewritten = (known.first->second != FileVersion()) && (ext == ".pcd");
+            known.first->second = version;
+            if (isRewritten && changedPaths)
+                changedPaths->push_back(it.path());
+        }
+    }
+
+    return paths;
+}
+
+void Visualizer::updateChangedFiles(const std::vector<boost::filesystem::path>& paths)
+{
+    namespace fs = boost::filesystem;
+
+    auto entries = parseFiles(paths, mHeaderIndex);
 
-        auto assertValidFile = [&](bool test)
+    bool isCurrentChanged = false;
+    for (auto& entry : entries)
+    {
+        if (!entry.mIsValid || entry.mIsCompare)
+            continue;
+
+        // In all its bundles (e.g. compare bundles), keeping the properties of the cloud: only the content is new.
+        const auto& updated = entry.mCloud;
+        for (int idx = 0; idx < getNbBundles(); ++idx)
         {
-            if (!test)
-                logWarning("[Visualizer] file " + newCloud.mFileName + " is not a valid visualizer file name. Skipping.");
+            for (auto& cloud : mBundles[idx].mClouds)
+            {
+                if (cloud.mFullName != updated.mFullName)
+                    continue;
+
+                cloud.mType = updated.mType;
+                cloud.mFileVersion = updated.mFileVersion;
+                cloud.mEncodings = updated.mEncodings;
+                cloud.mSpaces = updated.mSpaces;
+                cloud.mFeatureStats = updated.mFeatureStats;
+                cloud.mHistograms.clear();
+                if (idx != mCurrentBundleIdx) // the current one is displayed until it is switched again
+                    cloud.mPointCloudMessage.reset();
+                if (cloud.mLiveMessage)
+                {
+                    mLiveBytes -= std::min(mLiveBytes, cloud.mLiveMessage->data.size());
+                    cloud.mLiveMessage.reset();
+                }
 
-            return test;
-        };
+                isCurrentChanged |= (idx == mCurrentBundleIdx);
+            }
+        }
 
-        if (!assertValidFile(getToken() == "visualizer")) continue;
+        mHeaderIndex[fs::path(updated.mFullName).filename().string()] = std::move(entry.mHeader);
+    }
 
-        const std::string date = getToken();
-        if (!assertValidFile(date.size() == 8)) continue;
+    saveHeaderIndex(mPath, mHeaderIndex);
 
-        const std::string time = getToken();
-        if (!assertValidFile(time.size() == 6)) continue;
+    std::cout << "[Visualizer] " << paths.size() << " changed files." << std::endl;
 
-        const std::string ms = getToken();
-        if (!assertValidFile(ms.size() == 3)) continue;
+    if (isCurrentChanged && !mustSwitchBundle())
+        mBundleSwitchInfo.mSwitchToBundleIdx = mCurrentBundleIdx; // display the new content
+}
 
-        newCloud.mTimeStamp = date + "." + time + "." + ms;
+bool Visualizer::addFiles(const std::vector<boost::filesystem::path>& paths)
+{
+    // Adding is done in 2 phases: parse names and headers in parallel (this is where the time
+    // goes, since each file must be opened), then assemble the bundles serially.
+    auto entries = parseFiles(paths, mHeaderIndex);
+    return assembleFiles(entries);
+}
 
-        if (isPcd)
-        {
-            newCloud.mBundleName = getToken();
-            newCloud.mCloudName = getToken();
+bool Visualizer::parseFileName(const boost::filesystem::path& path, FileEntry& entry)
+{
+    auto& newCloud = entry.mCloud;
 
+    newCloud.mFullName = path.string();
+    newCloud.mFileName = path.stem().string();
+    entry.mIsCompare = (path.extension() == ".cpcd");
+
+    // Tokens separated by '.': visualizer.yyyymmdd.hhmmss.sss.<bundle>.<cloud>
+    size_t pos = 0;
+    auto getToken = [&]()
+    {
+        if (pos > newCloud.mFileName.size()) return std::string();
+        const size_t end = std::min(newCloud.mFileName.find('.', pos), newCloud.mFileName.size());
+        const auto token = newCloud.mFileName.substr(pos, end - pos);
+        pos = end + 1;
+        return token;
+    };
+
+    if (getToken() != "visualizer") return false;
+
+    const std::string date = getToken();
+    if (date.size() != 8) return false;
+
+    const std::string time = getToken();
+    if (time.size() != 6) return false;
+
+    const std::string ms = getToken();
+    if (ms.size() != 3) return false;
+
+    newCloud.mTimeStamp = date + "." + time + "." + ms;
+
+    if (entry.mIsCompare)
+    {
+        for (int j = 0; j < 5; ++j)
+            entry.mCompareTokens.push_back(getToken());
+    }
+    else
+    {
+        newCloud.mBundleName = getToken();
+        newCloud.mCloudName = getToken();
+    }
+
+    return true;
+}
+
+std::vector<Visualizer::FileEntry> Visualizer::parseFiles(const std::vector<boost::filesystem::path>& paths, const HeaderIndex& index, const std::atomic<bool>* isStopped)
+{
+    namespace fs = boost::filesystem;
+
+    std::vector<FileEntry> entries(paths.size());
+
+    auto parseEntry = [&](size_t i)
+    {
+        auto& entry = entries[i];
+        auto& newCloud = entry.mCloud;
+
+        if (!parseFileName(paths[i], entry))
+            return;
+
+        if (!entry.mIsCompare)
+        {
             // Load additionnal data from file header.
-            newCloud.parseFileHeader();
+            auto& header = entry.mHeader;
+            header.mVersion = FileVersion::get(paths[i]);
+            newCloud.mFileVersion = header.mVersion;
+
+            auto indexIt = index.find(paths[i].filename().string());
+            entry.mIsIndexed = (indexIt != index.end()) && (indexIt->second.mVersion == header.mVersion);
+            header.mLines = entry.mIsIndexed ? indexIt->second.mLines : Cloud::readFileHeader(newCloud.mFullName);
+
+            for (const auto& line : header.mLines)
+                newCloud.parseHeaderLine(line);
+        }
 
-            setCloudRenderingProperties(newCloud);
+        entry.mIsValid = true;
+    };
+
+    std::atomic<size_t> nextEntry{ 0 };
+    auto parseEntries = [&]()
+    {
+        for (size_t i = nextEntry++; (i < entries.size()) && !(isStopped && *isStopped); i = nextEntry++)
+            parseEntry(i);
+    };
+
+    const size_t nbThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), entries.size() / 16 + 1);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nbThreads; ++i)
+        threads.emplace_back(parseEntries);
+    parseEntries();
+    for (auto& thread : threads)
+        thread.join();
+
+    return entries;
+}
+
+bool Visualizer::assembleFiles(std::vector<FileEntry>& entries)
+{
+    namespace fs = boost::filesystem;
+
+    // Assemble bundles in chronological order (the directory order is not sorted on every file system),
+    // using the file name to order clouds having the same timestamp.
+    std::vector<FileEntry*> sortedEntries;
+    sortedEntries.reserve(entries.size());
+    for (auto& entry : entries)
+    {
+        if (entry.mIsValid)
+            sortedEntries.push_back(&entry);
+        else
+            logWarning("[Visualizer] file " + entry.mCloud.mFileName + " is not a valid visualizer file name. Skipping.");
+    }
+
+    std::sort(sortedEntries.begin(), sortedEntries.end(), [](const FileEntry* a, const FileEntry* b)
+    {
+        if (a->mCloud.mTimeStamp != b->mCloud.mTimeStamp)
+            return a->mCloud.mTimeStamp < b->mCloud.mTimeStamp;
+        return a->mCloud.mFileName < b->mCloud.mFileName;
+    });
+
+    for (auto* pEntry : sortedEntries)
+    {
+        auto& entry = *pEntry;
+        if (entry.mIsCompare)
+        {
+            const auto& tokens = entry.mCompareTokens;
+            if (tokens[1] == "compare")
+                createCompareBundle(tokens[0], tokens[3], tokens[2], tokens[4]);
+        }
+        else
+        {
+            setCloudRenderingProperties(entry.mCloud);
 
             // Add this cloud to the bundle array.
-            addCloudToBundle(newCloud);
+            addCloudToBundle(entry.mCloud);
         }
-        else if (isCpcd) 
+    }
+
+    // Add new and changed headers to the index.
+    bool isIndexChanged = false;
+    for (auto& entry : entries)
+    {
+        if (entry.mIsValid && !entry.mIsCompare && !entry.mIsIndexed)
         {
-            const std::string bundleScope = getToken();
-            const std::string command = getToken();
+            mHeaderIndex[fs::path(entry.mCloud.mFullName).filename().string()] = std::move(entry.mHeader);
+            isIndexChanged = true;
+        }
+    }
+
+    return isIndexChanged;
+}
+
+void Visualizer::followFolder()
+{
+    // The files added while the folder is parsed in background would be lost when merging its bundles.
+    if (mCatalog.isPending())
+        return;
+
+    // Key events make the render loop iterate more often; no need to list the folder each time.
+    const auto now = std::chrono::steady_clock::now();
+    if (now - mLastFollowTime < std::chrono::seconds(1))
+        return;
+    mLastFollowTime = now;
+
+    std::vector<boost::filesystem::path> changedPaths;
+    const auto paths = listNewFiles(&changedPaths);
+    if (!changedPaths.empty())
+        updateChangedFiles(changedPaths);
+
+    if (paths.empty())
+        return;
 
-            if (command == "compare")
+    const int nbBundles = getNbBundles();
+    const size_t nbCurrentClouds = getCurrentBundle().mClouds.size();
+
+    if (addFiles(paths))
+        saveHeaderIndex(mPath, mHeaderIndex);
+
+    std::cout << "[Visualizer] " << paths.size() << " new files, " << (getNbBundles() - nbBundles) << " new bundles." << std::endl;
+
+    onBundlesAdded(nbBundles, nbCurrentClouds);
+}
+
+void Visualizer::onBundlesAdded(int nbBundlesBefore, size_t nbCurrentCloudsBefore)
+{
+    if (nbBundlesBefore == 0) // was waiting for the first bundle
+        mBundleSwitchInfo.mSwitchToBundleIdx = getNbBundles() - 1;
+    else if (mOptions.mFollowNewest && (getNbBundles() > nbBundlesBefore))
+        mBundleSwitchInfo.mSwitchToBundleIdx = getNbBundles() - 1;
+    else if (getCurrentBundle().mClouds.size() != nbCurrentCloudsBefore) // display the clouds added to the current bundle
+        mBundleSwitchInfo.mSwitchToBundleIdx = mCurrentBundleIdx;
+    else
+        prefetchBundles(); // the new bundles may be neighbours
+}
+
+void Visualizer::receiveLiveClouds()
+{
+    // Like when following the folder, clouds added while the folder is parsed in background would be lost.
+    if (mOptions.mLiveRingName.empty() || mCatalog.isPending())
+        return;
+
+    if (!mLiveRing) // the publishing process may not be started yet
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - mLastLiveAttachTime < std::chrono::seconds(1))
+            return;
+        mLastLiveAttachTime = now;
+
+        mLiveRing = LiveRing::open(mOptions.mLiveRingName);
+        if (!mLiveRing)
+            return;
+
+        std::cout << "[Visualizer] Receiving live clouds from '" << mOptions.mLiveRingName << "' (" << mLiveRing->getCapacity() / (1024 * 1024) << " MB)." << std::endl;
+    }
+
+    std::vector<FileEntry> entries;
+    LiveRing::Record record;
+    while (mLiveRing->next(record))
+    {
+        FileEntry entry;
+        if (!parseFileName(record.mName, entry) || entry.mIsCompare)
+            continue; // compare files are only read from the folder
+
+        // Where the file is saved (unless files are disabled), to reload the cloud once its message is dropped.
+        auto& cloud = entry.mCloud;
+        cloud.mFullName = (mPath / record.mName).string();
+
+        const char* pBegin = record.mData;
+        const char* pEnd = pBegin + record.mSize;
+        for (const auto& line : Cloud::readFileHeader(pBegin, pEnd))
+            cloud.parseHeaderLine(line);
+
+        // Read in place, then check that the publisher did not overwrite the record meanwhile.
+        pcl::PCLPointCloud2::Ptr message(new pcl::PCLPointCloud2());
+        const bool isParsed = cloud.parseMessage(pBegin, pEnd, *message);
+        if (!mLiveRing->isIntact(record))
+        {
+            logWarning("[receiveLiveClouds] Live cloud " + record.mName + " was overwritten while reading it. Skipping.");
+            continue;
+        }
+
+        if (!isParsed)
+        {
+            logWarning("[receiveLiveClouds] Live cloud " + record.mName + " is not a valid PCD. Skipping.");
+            continue;
+        }
+
+        if (!mKnownFiles.emplace(record.mName, FileVersion()).second)
+            continue; // already added from the folder
+
+        cloud.mLiveMessage = message;
+        entry.mIsValid = true;
+        entry.mIsIndexed = true; // its header is in memory, the file is indexed when the folder is
+        entries.push_back(std::move(entry));
+    }
+
+    const size_t nbMissed = mLiveRing->takeNbMissed();
+    if (nbMissed > 0)
+        logWarning("[receiveLiveClouds] " + std::to_string(nbMissed) + " live clouds were overwritten before being received (their files are still read when following the folder).");
+
+    // A publisher replaces a corrupted ring: nothing is published to this one anymore, once read.
+    const auto now = std::chrono::steady_clock::now();
+    if (now - mLastLiveAttachTime >= std::chrono::seconds(1))
+    {
+        mLastLiveAttachTime = now;
+        if (mLiveRing->isReplaced())
+        {
+            std::cout << "[Visualizer] Live ring '" << mOptions.mLiveRingName << "' was replaced, attaching to the new one." << std::endl;
+            mLiveRing.reset(); // attached again at the next call
+        }
+    }
+
+    if (entries.empty())
+        return;
+
+    const int nbBundles = getNbBundles();
+    const size_t nbCurrentClouds = (nbBundles > 0) ? getCurrentBundle().mClouds.size() : 0;
+
+    assembleFiles(entries);
+
+    // Bundles are only appended to: the clouds are found from the last bundles.
+    for (const auto& entry : entries)
+    {
+        for (int idx = getNbBundles() - 1; idx >= 0; --idx)
+        {
+            const auto& clouds = mBundles[idx].mClouds;
+            if (std::any_of(clouds.begin(), clouds.end(), [&](const Cloud& cloud) { return cloud.mFullName == entry.mCloud.mFullName; }))
             {
-                const std::string bundleCompareStr = getToken();
-                const std::string bundleSearchStr = getToken();
-                const std::string compareCloudName = getToken();
-                createCompareBundle(bundleScope, bundleSearchStr, bundleCompareStr, compareCloudName);
+                mLiveClouds.emplace_back(idx, entry.mCloud.mCloudName);
+                mLiveBytes += entry.mCloud.mLiveMessage->data.size();
+                break;
             }
         }
     }
 
-    mBundleSwitchInfo.mSwitchToBundleIdx = getNbBundles() - 1; // start with most recent
+    dropLiveMessages();
 
-    // Override start bundle with the bundle of the input file, if possible.
-    if (!isInputDir)
+    std::cout << "[Visualizer] " << entries.size() << " live clouds, " << (getNbBundles() - nbBundles) << " new bundles." << std::endl;
+
+    onBundlesAdded(nbBundles, nbCurrentClouds);
+}
+
+void Visualizer::dropLiveMessages()
+{
+    while ((mLiveBytes > getCacheLevelBudget()) && !mLiveClouds.empty())
     {
-        auto it = std::find_if(mBundles.begin(), mBundles.end(), [&](const Bundle& bundle)
+        const auto& live = mLiveClouds.front();
+        auto& clouds = mBundles[live.first].mClouds;
+        auto it = std::find_if(clouds.begin(), clouds.end(), [&](const Cloud& cloud) { return cloud.mCloudName == live.second; });
+        if ((it != clouds.end()) && it->mLiveMessage)
         {
-            for (const Cloud& cloud : bundle.mClouds)
-                if (cloud.mFileName == fileOrFolderPath.stem().string())
-                    return true;
-            return false;
-        });
+            mLiveBytes -= std::min(mLiveBytes, it->mLiveMessage->data.size());
+
+            // Without its file (e.g. files disabled by the publisher), the cloud could not be displayed anymore.
+            boost::system::error_code ec;
+            if (boost::filesystem::exists(it->mFullName, ec))
+                it->mLiveMessage.reset(); // the loader may still have it in its cache
+            else
+                logWarning("[dropLiveMessages] Live cloud " + it->mCloudName + " has no file, keeping it in memory over the budget.");
+        }
 
-        if (it != mBundles.end())
-            mBundleSwitchInfo.mSwitchToBundleIdx = std::distance(mBundles.begin(), it);
+        mLiveClouds.pop_front();
     }
+}
 
-    // Override rendering properties with clouds of first bundle to be rendered.
-    if (mBundleSwitchInfo.mSwitchToBundleIdx >= 0)
-        for (const auto& cloud : mBundles[mBundleSwitchInfo.mSwitchToBundleIdx].mClouds)
-            mProperties[getCloudRenderingPropertiesKey(cloud)] = cloud.mRenderingProperties;
+Visualizer::FileVersion Visualizer::FileVersion::get(const boost::filesystem::path& path)
+{
+    FileVersion version;
+#ifdef _WIN32
+    // Only the attributes: the file may be open by its process.
+    const HANDLE file = CreateFileW(path.wstring().c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return version;
+
+    BY_HANDLE_FILE_INFORMATION info;
+    if (GetFileInformationByHandle(file, &info))
+    {
+        const int64_t time = (static_cast<int64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime; // 100 ns since 1601
+        version.mSize = (static_cast<uintmax_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+        version.mTimeNs = (time - 116444736000000000LL) * 100;
+        version.mFileId = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    }
+    CloseHandle(file);
+#else
+    struct stat status;
+    if (::stat(path.c_str(), &status) != 0)
+        return version;
+
+#ifdef __APPLE__
+    const auto& time = status.st_mtimespec;
+#else
+    const auto& time = status.st_mtim;
+#endif
+    version.mSize = static_cast<uintmax_t>(status.st_size);
+    version.mTimeNs = static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+    version.mFileId = static_cast<uint64_t>(status.st_ino);
+#endif
+    return version;
+}
+
+Visualizer::HeaderIndex Visualizer::loadHeaderIndex(const boost::filesystem::path& folder)
+{
+    HeaderIndex index;
+
+    std::ifstream file((folder / sHeaderIndexFileName).string(), std::ios::binary);
+    std::string line;
+    if (!std::getline(file, line) || line != "visualizer-index 2")
+        return index; // no index, or other version
+
+    // For each file: "<number of lines> <size> <time in ns> <file id> <file name>", followed by its header lines.
+    while (std::getline(file, line))
+    {
+        std::istringstream iss(line);
+        size_t nbLines;
+        HeaderIndexEntry entry;
+        std::string name;
+        if (!(iss >> nbLines >> entry.mVersion.mSize >> entry.mVersion.mTimeNs >> entry.mVersion.mFileId) || !std::getline(iss >> std::ws, name))
+            return HeaderIndex(); // corrupted, will be rebuilt
+
+        entry.mLines.resize(nbLines);
+        for (auto& headerLine : entry.mLines)
+            if (!std::getline(file, headerLine))
+                return HeaderIndex();
+
+        index[name] = std::move(entry);
+    }
+
+    return index;
+}
+
+void Visualizer::saveHeaderIndex(const boost::filesystem::path& folder, const HeaderIndex& index)
+{
+    namespace fs = boost::filesystem;
+
+    // Write a temporary file then rename it, so that a concurrent launch never reads a partial index.
+    const auto filename = folder / sHeaderIndexFileName;
+    const auto tmpFilename = fs::path(filename.string() + fs::unique_path(".%%%%%%.tmp").string()); // unique, batch workers may write it together
+    {
+        std::ofstream file(tmpFilename.string(), std::ios::binary | std::ios::trunc);
+        if (!file)
+            return; // read-only folder, no index
+
+        file << "visualizer-index 2\n";
+        for (const auto& pair : index)
+        {
+            const auto& entry = pair.second;
+            const auto& version = entry.mVersion;
+            file << entry.mLines.size() << " " << version.mSize << " " << version.mTimeNs << " " << version.mFileId << " " << pair.first << "\n";
+            for (const auto& line : entry.mLines)
+                file << line << "\n";
+        }
+    }
+
+    boost::system::error_code ec;
+    fs::rename(tmpFilename, filename, ec);
+    if (ec)
+        fs::remove(tmpFilename, ec);
 }
 
 void Visualizer::Cloud::parseFileHeader()
 {
-    auto isVisualizerProperty = [](const std::string& line)
+    for (const auto& line : readFileHeader(mFullName))
+        parseHeaderLine(line);
+}
+
+std::vector<std::string> Visualizer::Cloud::readFileHeader(const std::string& filename)
+{
+    // Comments are at the beginning of the file: read a page at a time (one is usually enough)
+    // until the first line that is not a comment.
+    const size_t pageSize = 4096;
+
+    std::vector<std::string> lines;
+    std::ifstream infile(filename, std::ios::binary);
+
+    std::string buffer;
+    size_t pos = 0;
+    while (infile || pos < buffer.size())
+    {
+        const size_t eol = buffer.find('\n', pos);
+        if (eol == std::string::npos)
+        {
+            if (!infile)
+                break; // end of file in the middle of the comments, ignore the last partial line
+
+            buffer.erase(0, pos);
+            pos = 0;
+
+            const size_t size = buffer.size();
+            buffer.resize(size + pageSize);
+            infile.read(&buffer[size], pageSize);
+            buffer.resize(size + static_cast<size_t>(infile.gcount()));
+            continue;
+        }
+
+        if (buffer[pos] != '#')
+            break;
+
+        size_t end = eol;
+        if (end > pos && buffer[end - 1] == '\r')
+            --end;
+
+        lines.push_back(buffer.substr(pos, end - pos));
+        pos = eol + 1;
+    }
+
+    return lines;
+}
+
+std::vector<std::string> Visualizer::Cloud::readFileHeader(const char* pBegin, const char* pEnd)
+{
+    std::vector<std::string> lines;
+    for (const char* pLine = pBegin; (pLine < pEnd) && (*pLine == '#');)
+    {
+        const char* pLineEnd = std::find(pLine, pEnd, '\n');
+        if (pLineEnd == pEnd)
+            break; // partial line, like in a file
+
+        lines.emplace_back(pLine, (pLineEnd > pLine && pLineEnd[-1] == '\r') ? pLineEnd - 1 : pLineEnd);
+        pLine = pLineEnd + 1;
+    }
+
+    return lines;
+}
+
+void Visualizer::Cloud::parseHeaderLine(const std::string& line)
+{
+    auto hasPrefix = [](const std::string& line, const std::string& prefix)
     {
-        const std::string prefix = "# visualizer cloud ";
         if (line.size() <= prefix.size()) return false;
-        if (line.substr(0, prefix.size()) != prefix) return false;
-        return true;
+        return line.compare(0, prefix.size(), prefix) == 0;
     };
 
-    std::ifstream infile(mFullName);
+    if (hasPrefix(line, "# visualizer cloud "))
+    {
+        std::istringstream iss(line);
+        std::string word;
+        iss >> word >> word >> word >> word; // # visualizer cloud <property>
+
+        if (word == "size")
+            iss >> mRenderingProperties.mSize;
+        else if (word == "opacity")
+            iss >> mRenderingProperties.mOpacity;
+        else if (word == "viewport")
+            iss >> mViewport;
+        else if (word == "type")
+        {
+            std::string type;
+            iss >> type;
+            if (type == "lines")
+                mType = EType::eLines;
+            else if (type == "plane")
+                mType = EType::ePlane;
+            else if (type == "sphere")
+                mType = EType::eSphere;
+            else if (type == "cylinder")
+                mType = EType::eCylinder;
+            else
+                mType = EType::ePoints;
+        }
+        else if (word == "colormap")
+        {
+            iss >> word;
+            if (word == "range")
+            {
+                double min, max;
+                iss >> min;
+                iss >> max;
+                mRenderingProperties.mColormapRange = { min, max };
+            }
+        }
+    }
+    else if (hasPrefix(line, "# visualizer space "))
+    {
+        std::istringstream iss(line);
+        std::string word;
+        std::array<FeatureName, 3> space;
+        if ((iss >> word >> word >> word >> space[0] >> space[1] >> space[2]) && (std::find(mSpaces.begin(), mSpaces.end(), space) == mSpaces.end()))
+            mSpaces.push_back(space);
+    }
+    else if (hasPrefix(line, "# visualizer feature "))
+    {
+        std::istringstream iss(line);
+        std::string word, name;
+        iss >> word >> word >> word >> name >> word; // # visualizer feature <name> <property>
+
+        if (word == "encoding")
+        {
+            FeatureEncoding encoding;
+            iss >> word;
+            encoding.mType = toEncoding(word);
+            if (encoding.mType == EEncoding::eFixed16)
+                iss >> encoding.mScale >> encoding.mOffset;
+            mEncodings[name] = encoding;
+        }
+        else if (word == "stats")
+        {
+            auto& stats = mFeatureStats[name];
+            iss >> stats.mMin >> stats.mMax >> stats.mMean >> stats.mCount;
+        }
+        else if (word == "histogram")
+        {
+            auto& stats = mFeatureStats[name];
+            stats.mHistogram.clear();
+            size_t count;
+            while (iss >> count)
+                stats.mHistogram.push_back(count);
+        }
+    }
+}
+
+void Visualizer::Cloud::load()
+{
+    mPointCloudMessage = loadMessage();
+}
+
+pcl::PCLPointCloud2::Ptr Visualizer::Cloud::loadMessage() const
+{
+    if (mLiveMessage)
+        return mLiveMessage;
+
+    namespace bip = boost::interprocess;
+
+    // The PCL reader on the mapped file: the points are copied once, from the page cache to the message,
+    // and encoded features are expanded from the mapping rather than from a message holding the file content.
+    pcl::PCLPointCloud2::Ptr message(new pcl::PCLPointCloud2());
+    try
+    {
+        bip::file_mapping mapping(mFullName.c_str(), bip::read_only);
+        bip::mapped_region region(mapping, bip::read_only);
+        region.advise(bip::mapped_region::advice_sequential);
+
+        const char* pBegin = static_cast<const char*>(region.get_address());
+        if (parseMessage(pBegin, pBegin + region.get_size(), *message))
+            return message;
+    }
+    catch (const bip::interprocess_exception&) {} // e.g. empty file
+
+    // Let the PCL file reader report what is wrong with the file.
+    *message = pcl::PCLPointCloud2();
+    pcl::io::loadPCDFile(mFullName, *message);
+    expandEncodedFields(*message);
+
+    return message;
+}
+
+namespace
+{
+    // Memory read as a stream, in place.
+    class MemoryBuffer : public std::streambuf
+    {
+    public:
+        MemoryBuffer(const char* pBegin, const char* pEnd)
+        {
+            char* p = const_cast<char*>(pBegin); // only read
+            setg(p, p, p + (pEnd - pBegin));
+        }
+
+    protected:
+        virtual pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode) override
+        {
+            char* p = (dir == std::ios_base::beg) ? eback() : (dir == std::ios_base::cur) ? gptr() : egptr();
+            if ((p + offset < eback()) || (p + offset > egptr()))
+                return pos_type(off_type(-1));
+
+            setg(eback(), p + offset, egptr());
+            return pos_type(gptr() - eback());
+        }
+
+        virtual pos_type seekpos(pos_type pos, std::ios_base::openmode mode) override
+        {
+            return seekoff(off_type(pos), std::ios_base::beg, mode);
+        }
+    };
+}
 
-    std::string line = "#";
-    while (std::getline(infile, line) && line[0] == '#')
+bool Visualizer::Cloud::parseMessage(const char* pBegin, const char* pEnd, pcl::PCLPointCloud2& message) const
+{
+    // The PCL reader, on the memory instead of a file (a mapped file or a live record).
+    MemoryBuffer buffer(pBegin, pEnd);
+    std::istream stream(&buffer);
+
+    pcl::PCDReader reader;
+    Eigen::Vector4f origin;
+    Eigen::Quaternionf orientation;
+    int version = 0, dataType = 0;
+    unsigned int dataIdx = 0;
+    if (reader.readHeader(stream, message, origin, orientation, version, dataType, dataIdx) < 0)
+        return false;
+
+    // Same checks as the PCL reader of a file: the body reader trusts the sizes.
+    const size_t size = pEnd - pBegin;
+    const auto* pData = reinterpret_cast<const unsigned char*>(pBegin);
+    int result = -1;
+    if (dataType == 0) // ascii
+    {
+        stream.clear();
+        stream.seekg(dataIdx);
+        result = reader.readBodyASCII(stream, message, version);
+    }
+    else if (dataType == 2) // binary compressed, after its compressed and uncompressed sizes
+    {
+        uint32_t compressedSize = 0;
+        if (dataIdx + 8 <= size)
+            std::memcpy(&compressedSize, pBegin + dataIdx, sizeof(compressedSize));
+        if ((dataIdx + 8 <= size) && (dataIdx + 8 + static_cast<size_t>(compressedSize) <= size))
+            result = reader.readBodyBinary(pData, message, version, true, dataIdx);
+    }
+    else if (dataIdx + message.data.size() <= size) // binary
     {
-        if (isVisualizerProperty(line))
+        if (hasEncodedFields(message))
         {
-            std::istringstream iss(line);
-            std::string word;
-            iss >> word >> word >> word >> word; // # visualizer cloud <property>
+            expandEncodedFields(message, pData + dataIdx); // straight from the memory
+            return true;
+        }
+        result = reader.readBodyBinary(pData, message, version, false, dataIdx);
+    }
 
-            if (word == "size")
-                iss >> mRenderingProperties.mSize;
-            else if (word == "opacity")
-                iss >> mRenderingProperties.mOpacity;
-            else if (word == "viewport")
-                iss >> mViewport;
-            else if (word == "type")
+    if (result < 0)
+        return false; // truncated
+
+    expandEncodedFields(message);
+    return true;
+}
+
+bool Visualizer::Cloud::hasEncodedFields(const pcl::PCLPointCloud2& message) const
+{
+    return std::any_of(message.fields.begin(), message.fields.end(), [&](const pcl::PCLPointField& field)
+    {
+        return (mEncodings.count(field.name) > 0) && (field.datatype == pcl::PCLPointField::UINT16) && (field.count == 1);
+    });
+}
+
+void Visualizer::Cloud::expandEncodedFields(pcl::PCLPointCloud2& message, const uint8_t* pData) const
+{
+    const size_t nbPoints = static_cast<size_t>(message.width) * message.height;
+    if (!hasEncodedFields(message))
+    {
+        if (pData)
+            message.data.assign(pData, pData + nbPoints * message.point_step);
+        return;
+    }
+
+    // The points as laid out in the file: those of the message, unless they are read from elsewhere.
+    std::vector<uint8_t> srcData;
+    if (!pData)
+    {
+        if (message.data.size() < nbPoints * message.point_step)
+            return; // not loaded, left as is
+        srcData.swap(message.data);
+        pData = srcData.data();
+    }
+    else
+    {
+        std::vector<uint8_t>().swap(message.data); // sized by the header reader, released before the expanded points are allocated
+    }
+
+    // Expand encoded fields (16 bit unsigned) to float, so that the handlers see regular float features.
+    const auto srcFields = message.fields;
+    const uint32_t srcStep = message.point_step;
+
+    std::vector<const FeatureEncoding*> encodings;
+    uint32_t offset = 0;
+    for (auto& field : message.fields)
+    {
+        auto it = mEncodings.find(field.name);
+        const bool isEncoded = (it != mEncodings.end()) && (field.datatype == pcl::PCLPointField::UINT16) && (field.count == 1);
+        encodings.push_back(isEncoded ? &it->second : nullptr);
+
+        field.offset = offset;
+        if (isEncoded) field.datatype = pcl::PCLPointField::FLOAT32;
+
+        offset += pcl::getFieldSize(field.datatype) * field.count;
+    }
+
+    message.point_step = offset;
+    message.row_step = message.point_step * message.width;
+
+    message.data.resize(nbPoints * message.point_step);
+    for (size_t i = 0; i < nbPoints; ++i)
+    {
+        const auto* pSrc = pData + i * srcStep;
+        auto* pDst = &message.data[i * message.point_step];
+        for (size_t j = 0; j < srcFields.size(); ++j)
+        {
+            const auto& field = srcFields[j];
+            if (encodings[j])
             {
-                std::string type;
-                iss >> type;
-                if (type == "lines")
-                    mType = EType::eLines;
-                else if (type == "plane")
-                    mType = EType::ePlane;
-                else if (type == "sphere")
-                    mType = EType::eSphere;
-                else if (type == "cylinder")
-                    mType = EType::eCylinder;
-                else
-                    mType = EType::ePoints;
+                uint16_t code;
+                std::memcpy(&code, pSrc + field.offset, sizeof(code));
+                const float v = decodeValue(code, *encodings[j]);
+                std::memcpy(pDst + message.fields[j].offset, &v, sizeof(v));
             }
-            else if (word == "colormap")
+            else
             {
-                iss >> word;
-                if (word == "range")
-                {
-                    double min, max;
-                    iss >> min;
-                    iss >> max;
-                    mRenderingProperties.mColormapRange = { min, max };
-                }
+                std::memcpy(pDst + message.fields[j].offset, pSrc + field.offset, pcl::getFieldSize(field.datatype) * field.count);
             }
         }
     }
@@ -337,29 +1260,49 @@ std::string Visualizer::getBundleLocalScopeName(const std::string& bundleName, i
 
 bool Visualizer::hasCloudNameInBundle(const Bundle& bundle, const std::string& cloudName)
 {
-    int count = std::count_if(bundle.mClouds.begin(), bundle.mClouds.end(),
-        [&cloudName](const Cloud& c) { return c.mCloudName == cloudName; });
-    return count > 0;
+    return bundle.hasCloud(cloudName);
 };
 
-void Visualizer::addCloudToBundle(const Cloud& newCloud)
+void Visualizer::pushBundle(const Bundle& bundle)
 {
-    auto& bundles = mBundles;
-    auto createNewBundle = [&bundles](const Cloud& newCloud)
+    mBundles.push_back(bundle);
+    mLastBundleIdxByName[bundle.mName] = getNbBundles() - 1;
+
+    for (auto& suffix : mLastBundleIdxBySuffix)
     {
-        bundles.push_back({ newCloud.mBundleName, Clouds(1, newCloud) });
-    };
+        const auto& name = bundle.mName;
+        if ((name.length() >= suffix.first.length()) && (name.compare(name.size() - suffix.first.size(), suffix.first.size(), suffix.first) == 0))
+            suffix.second = getNbBundles() - 1;
+    }
+}
 
-    auto getLastBundleWithName = [&bundles](const std::string& bundleName)
+int Visualizer::getLastBundleIdxWithSuffix(const std::string& suffix)
+{
+    auto it = mLastBundleIdxBySuffix.find(suffix);
+    if (it != mLastBundleIdxBySuffix.end())
+        return it->second;
+
+    // First search of this suffix: scan the bundles once, pushBundle keeps it up to date afterwards.
+    int idx = getNbBundles() - 1;
+    for (; idx >= 0; --idx)
     {
-        return std::find_if(bundles.rbegin(), bundles.rend(),
-            [&bundleName](const Bundle& b) { return b.mName == bundleName; });
-    };
+        const auto& name = mBundles[idx].mName;
+        if ((name.length() >= suffix.length()) && (name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0))
+            break;
+    }
 
-    auto bundleExists = [&bundles](const std::string& bundleName)
+    mLastBundleIdxBySuffix[suffix] = idx;
+    return idx;
+}
+
+void Visualizer::addCloudToBundle(const Cloud& newCloud)
+{
+    auto createNewBundle = [&](const Cloud& newCloud)
     {
-        return 0 < std::count_if(bundles.begin(), bundles.end(),
-            [&bundleName](const Bundle& b) { return b.mName == bundleName; });
+        Bundle bundle;
+        bundle.mName = newCloud.mBundleName;
+        bundle.addCloud(newCloud);
+        pushBundle(bundle);
     };
 
     // Determine if creating a new bundle with the current cloud or add it
@@ -375,14 +1318,15 @@ void Visualizer::addCloudToBundle(const Cloud& newCloud)
 
         if (newCloud.mBundleName != currentBundle.mName) // not for the current bundle
         {
-            if (bundleExists(newCloud.mBundleName))
+            auto lastBundleIt = mLastBundleIdxByName.find(newCloud.mBundleName);
+            if (lastBundleIt != mLastBundleIdxByName.end())
             {
-                auto lastBundleIt = getLastBundleWithName(newCloud.mBundleName);
+                auto& lastBundle = mBundles[lastBundleIt->second];
 
-                if (hasCloudNameInBundle(*lastBundleIt, newCloud.mCloudName)) // previous bundle with this name already has this cloud, so create new bundle
+                if (lastBundle.hasCloud(newCloud.mCloudName)) // previous bundle with this name already has this cloud, so create new bundle
                     createNewBundle(newCloud);
                 else // this cloud does not exists in that previous bundle, add the cloud to it
-                    lastBundleIt->mClouds.push_back(newCloud);
+                    lastBundle.addCloud(newCloud);
 
                 // NOTE TODO: mScopeDepth is no longer incremented, since it interferes with the notion that a bundle may have bundles in between
                 // (we don't want multiple bundles in this case).
@@ -390,27 +1334,19 @@ void Visualizer::addCloudToBundle(const Cloud& newCloud)
             else // this is a new bundle
                 createNewBundle(newCloud);
         }
-        else if (hasCloudNameInBundle(currentBundle, newCloud.mCloudName)) // current bundle already has this cloud, must be a new bundle
+        else if (currentBundle.hasCloud(newCloud.mCloudName)) // current bundle already has this cloud, must be a new bundle
         {
             createNewBundle(newCloud);
         }
         else // add the cloud to current bundle
         {
-            currentBundle.mClouds.push_back(newCloud);
+            currentBundle.addCloud(newCloud);
         }
     }
 }
 
 void Visualizer::createCompareBundle(const std::string& bundleScope, const std::string& bundleSearchStr, const std::string& bundleCompareStr, const std::string& compareCloudName)
 {
-    auto& bundles = mBundles;
-
-    auto getLastBundleHavingSuffix = [&](const std::string& suffix)
-    {
-        return std::find_if(bundles.rbegin(), bundles.rend(),
-            [&](const Bundle& b) { return (b.mName.length() >= suffix.length()) && (b.mName.compare(b.mName.size() - suffix.size(), suffix.size(), suffix) == 0); });
-    };
-
     auto extractComparisonStrings = [&](std::stringstream ss)
     {
         std::string substr;
@@ -435,6 +1371,7 @@ void Visualizer::createCompareBundle(const std::string& bundleScope, const std::
 
     Bundle newBundle;
     newBundle.mName = bundleScope + " compare "; // will be augmented
+    newBundle.mIsCompare = true;
 
     for (const auto& compareElement : compareElementsStrs)
     {
@@ -442,35 +1379,347 @@ void Visualizer::createCompareBundle(const std::string& bundleScope, const std::
         std::string bundleNameSuffix = bundleSearchStr;
         bundleNameSuffix = bundleNameSuffix.replace(bundleNameSuffix.find(wildcard), wildcard.length(), compareElement);
 
-        auto bundleIt = getLastBundleHavingSuffix(bundleNameSuffix);
-        if (bundleIt != bundles.rend())
+        const int bundleIdx = getLastBundleIdxWithSuffix(bundleNameSuffix);
+        if (bundleIdx >= 0)
         {
+            const auto bundleIt = mBundles.begin() + bundleIdx;
             auto cloudIt = getCloud(bundleIt->mClouds, compareCloudName);
             if (cloudIt != bundleIt->mClouds.end())
             {
                 newBundle.mName += "(" + compareElement + ")";
 
-                auto newCloud = *cloudIt; // copy, not reference
+                auto newCloud = *cloudIt; // copy, not reference
+
+                newCloud.mCloudName += "-" + compareElement; // make a unique name in bundle
+                newCloud.mViewport = newBundle.mClouds.size(); // each cloud to compare has its viewport
+                setCloudRenderingProperties(newCloud);
+
+                // Add to bundle.
+                newBundle.addCloud(newCloud);
+            }
+            else
+                std::cout << "[Visualizer][Compare] Bundle [" + bundleIt->mName + "] does not contain a cloud named [" + compareCloudName + "]." << std::endl;
+        }
+        else
+            std::cout << "[Visualizer][Compare] No bundle found containing strings [" + bundleSearchStr + "] and [" + compareElement + "]." << std::endl;
+    }
+
+    newBundle.mName += " " + bundleSearchStr;
+
+    // Only add the bundle if at least one cloud was found
+    if (newBundle.mClouds.size() > 0)
+        pushBundle(newBundle);
+}
+
+namespace
+{
+    template <typename T>
+    T readValue(const uint8_t* data)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    // Value of a field of a point, as text.
+    std::string getPointFieldText(const pcl::PCLPointCloud2& message, const pcl::PCLPointField& field, size_t pointIdx)
+    {
+        const uint8_t* data = &message.data[pointIdx * message.point_step + field.offset];
+
+        if ((field.name == "rgb") || (field.name == "rgba")) // packed colors
+        {
+            const uint32_t rgb = readValue<uint32_t>(data);
+            return "(" + std::to_string((rgb >> 16) & 0xff) + ", " + std::to_string((rgb >> 8) & 0xff) + ", " + std::to_string(rgb & 0xff) + ")";
+        }
+
+        std::stringstream ss;
+        switch (field.datatype)
+        {
+        case pcl::PCLPointField::INT8: ss << static_cast<int>(readValue<int8_t>(data)); break;
+        case pcl::PCLPointField::UINT8: ss << static_cast<int>(readValue<uint8_t>(data)); break;
+        case pcl::PCLPointField::INT16: ss << readValue<int16_t>(data); break;
+        case pcl::PCLPointField::UINT16: ss << readValue<uint16_t>(data); break;
+        case pcl::PCLPointField::INT32: ss << readValue<int32_t>(data); break;
+        case pcl::PCLPointField::UINT32: ss << readValue<uint32_t>(data); break;
+        case pcl::PCLPointField::FLOAT32: ss << readValue<float>(data); break;
+        case pcl::PCLPointField::FLOAT64: ss << readValue<double>(data); break;
+        default: ss << "?"; break;
+        }
+        return ss.str();
+    }
+
+    // New message with float features added after the existing ones.
+    pcl::PCLPointCloud2::Ptr addFeatures(const pcl::PCLPointCloud2& message, const std::vector<std::pair<std::string, std::vector<float>>>& features)
+    {
+        pcl::PCLPointCloud2::Ptr result(new pcl::PCLPointCloud2());
+        result->header = message.header;
+        result->height = message.height;
+        result->width = message.width;
+        result->is_bigendian = message.is_bigendian;
+        result->is_dense = message.is_dense;
+        result->fields = message.fields;
+
+        for (const auto& feature : features)
+        {
+            pcl::PCLPointField field;
+            field.name = feature.first;
+            field.offset = message.point_step + static_cast<uint32_t>(result->fields.size() - message.fields.size()) * sizeof(float);
+            field.datatype = pcl::PCLPointField::FLOAT32;
+            field.count = 1;
+            result->fields.push_back(field);
+        }
+
+        result->point_step = message.point_step + static_cast<uint32_t>(features.size() * sizeof(float));
+        result->row_step = result->point_step * result->width;
+
+        const size_t nbPoints = static_cast<size_t>(message.width) * message.height;
+        result->data.resize(nbPoints * result->point_step);
+        for (size_t i = 0; i < nbPoints; ++i)
+        {
+            auto* pDst = &result->data[i * result->point_step];
+            std::memcpy(pDst, &message.data[i * message.point_step], message.point_step);
+            for (size_t j = 0; j < features.size(); ++j)
+                std::memcpy(pDst + message.point_step + j * sizeof(float), &features[j].second[i], sizeof(float));
+        }
+
+        return result;
+    }
+}
+
+void Visualizer::addCompareFeatures(Bundle& bundle) const
+{
+    auto& clouds = bundle.mClouds;
+    if ((clouds.size() < 2) || std::any_of(clouds.begin(), clouds.end(), [](const Cloud& c) { return !c.mPointCloudMessage || (c.mType != Cloud::EType::ePoints); }))
+        return;
+
+    const std::string distanceName = "compare-distance";
+    const std::string diffPrefix = "compare-diff-";
+
+    std::vector<pcl::PCLPointCloud2::Ptr> results(clouds.size());
+    for (size_t k = 0; k < clouds.size(); ++k)
+    {
+        const auto& message = *clouds[k].mPointCloudMessage;
+        const auto& other = *clouds[(k == 0) ? 1 : 0].mPointCloudMessage;
+
+        const size_t nbPoints = static_cast<size_t>(message.width) * message.height;
+        const size_t nbOtherPoints = static_cast<size_t>(other.width) * other.height;
+
+        // Search tree of the other cloud, without its invalid points.
+        const auto ox = readFeatureValues(other, "x"), oy = readFeatureValues(other, "y"), oz = readFeatureValues(other, "z");
+        std::vector<float> otherPoints;
+        std::vector<size_t> otherIndices; // point index of each tree point
+        otherPoints.reserve(3 * nbOtherPoints);
+        for (size_t i = 0; i < nbOtherPoints; ++i)
+        {
+            if (std::isnan(ox[i]) || std::isnan(oy[i]) || std::isnan(oz[i]))
+                continue;
+            otherPoints.insert(otherPoints.end(), { ox[i], oy[i], oz[i] });
+            otherIndices.push_back(i);
+        }
+
+        if (otherIndices.empty())
+            continue;
+
+        using SearchTree = flann::Index<flann::L2<float>>;
+        SearchTree tree{ flann::KDTreeSingleIndexParams() }; // optimized for 3D, gives exact result
+        tree.buildIndex(flann::Matrix<float>(otherPoints.data(), otherIndices.size(), 3));
+
+        // Features present in both clouds.
+        std::vector<std::string> sharedNames;
+        for (const auto& field : message.fields)
+        {
+            const bool isShared = std::any_of(other.fields.begin(), other.fields.end(), [&](const pcl::PCLPointField& f) { return f.name == field.name; });
+            if (isShared && (field.datatype == pcl::PCLPointField::FLOAT32) && (field.name != "x") && (field.name != "y") && (field.name != "z"))
+                sharedNames.push_back(field.name);
+        }
+
+        std::vector<std::vector<float>> values, otherValues;
+        for (const auto& name : sharedNames)
+        {
+            values.push_back(readFeatureValues(message, name));
+            otherValues.push_back(readFeatureValues(other, name));
+        }
+
+        std::vector<std::pair<std::string, std::vector<float>>> features;
+        features.emplace_back(distanceName, std::vector<float>(nbPoints, std::numeric_limits<float>::quiet_NaN()));
+        for (const auto& name : sharedNames)
+            features.emplace_back(diffPrefix + name, std::vector<float>(nbPoints, std::numeric_limits<float>::quiet_NaN()));
+
+        // Nearest neighbours, by chunks of points in parallel.
+        const auto x = readFeatureValues(message, "x"), y = readFeatureValues(message, "y"), z = readFeatureValues(message, "z");
+        const size_t chunkSize = 4096;
+        std::atomic<size_t> nextChunk{ 0 };
+        auto searchChunks = [&]()
+        {
+            std::vector<float> query(3);
+            std::vector<int> index(1);
+            std::vector<float> dist(1);
+            for (size_t first = chunkSize * nextChunk++; first < nbPoints; first = chunkSize * nextChunk++)
+            {
+                for (size_t i = first; i < std::min(first + chunkSize, nbPoints); ++i)
+                {
+                    if (std::isnan(x[i]) || std::isnan(y[i]) || std::isnan(z[i]))
+                        continue;
+
+                    query = { x[i], y[i], z[i] };
+                    flann::Matrix<float> queryMatrix(query.data(), 1, 3);
+                    flann::Matrix<int> indexMatrix(index.data(), 1, 1);
+                    flann::Matrix<float> distMatrix(dist.data(), 1, 1);
+                    tree.knnSearch(queryMatrix, indexMatrix, distMatrix, 1, flann::SearchParams());
+
+                    const size_t j = otherIndices[index[0]];
+                    features[0].second[i] = std::sqrt(dist[0]); // squared distance
+                    for (size_t f = 0; f < sharedNames.size(); ++f)
+                        features[f + 1].second[i] = values[f][i] - otherValues[f][j];
+                }
+            }
+        };
+
+        const size_t nbThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), nbPoints / chunkSize + 1);
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < nbThreads; ++t)
+            threads.emplace_back(searchChunks);
+        searchChunks();
+        for (auto& thread : threads)
+            thread.join();
+
+        results[k] = addFeatures(message, features);
+    }
+
+    // Replace the messages at the end, the loaded messages being used as the other clouds.
+    for (size_t k = 0; k < clouds.size(); ++k)
+        if (results[k])
+            clouds[k].mPointCloudMessage = results[k];
+}
+
+void Visualizer::addExpressionFeatures(Bundle& bundle) const
+{
+    if (mFeatureExpressions.empty())
+        return;
+
+    for (auto& cloud : bundle.mClouds)
+    {
+        if (!cloud.mPointCloudMessage || (cloud.mType != Cloud::EType::ePoints))
+            continue;
+
+        const auto& message = *cloud.mPointCloudMessage;
+
+        // In order, an expression may use the features derived before it.
+        FeatureExpression::Features features;
+        for (const auto& expression : mFeatureExpressions)
+        {
+            const auto& name = expression.getName();
+            const bool isExisting = std::any_of(message.fields.begin(), message.fields.end(), [&](const pcl::PCLPointField& f) { return f.name == name; });
+            if (isExisting)
+            {
+                logWarning("[addExpressionFeatures] Cloud [" + cloud.mCloudName + "] already has a feature named [" + name + "]; not derived.");
+                continue;
+            }
+
+            features.erase(std::remove_if(features.begin(), features.end(), [&](const FeatureExpression::Features::value_type& f) { return f.first == name; }), features.end());
+            features.emplace_back(name, expression.evaluate(message, features));
+        }
+
+        if (!features.empty())
+            cloud.mPointCloudMessage = addFeatures(message, features);
+    }
+}
+
+void Visualizer::addDerivedFeatures()
+{
+    auto& bundle = getCurrentBundle();
+    if (!hasDerivedFeatures(bundle))
+        return;
+
+    // Only point clouds get derived features.
+    std::vector<Cloud*> clouds;
+    for (auto& cloud : bundle.mClouds)
+        if (cloud.mPointCloudMessage && (cloud.mType == Cloud::EType::ePoints))
+            clouds.push_back(&cloud);
+
+    std::vector<CloudLoader::Message> cached;
+    for (const auto* cloud : clouds)
+        cached.push_back(mLoader.find(getDerivedFeaturesKey(*cloud)));
+
+    if (std::all_of(cached.begin(), cached.end(), [](const CloudLoader::Message& message) { return static_cast<bool>(message); }))
+    {
+        for (size_t k = 0; k < clouds.size(); ++k)
+            clouds[k]->mPointCloudMessage = cached[k];
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    if (bundle.mIsCompare)
+        addCompareFeatures(bundle);
+    addExpressionFeatures(bundle);
+
+    for (const auto* cloud : clouds)
+        mLoader.put(getDerivedFeaturesKey(*cloud), cloud->mPointCloudMessage);
+
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[Visualizer] Derived features computed in " << std::fixed << std::setprecision(0) << ms << " ms." << std::endl;
+}
+
+std::string Visualizer::getDerivedFeaturesKey(const Cloud& cloud) const
+{
+    // A cloud may be in many bundles (e.g. compare bundles), with different derived features. Bundle indices change
+    // when the bundles of the folder are merged, so the bundle is identified by its name and timestamp.
+    const auto& bundle = getCurrentBundle();
+    std::string key = "derived|" + bundle.mName + "|" + bundle.getTimestamp() + "|" + cloud.getFileKey();
+    for (const auto& expression : mFeatureExpressions)
+        key += "|" + expression.getDefinition();
+
+    return key;
+}
+
+bool Visualizer::addFeatureExpression(const std::string& definition)
+{
+    FeatureExpression expression;
+    std::string error;
+    if (!expression.parse(definition, error))
+    {
+        logError("[addFeatureExpression] Invalid derived feature '" + definition + "': " + error + ".");
+        return false;
+    }
+
+    auto it = std::find_if(mFeatureExpressions.begin(), mFeatureExpressions.end(), [&](const FeatureExpression& e) { return e.getName() == expression.getName(); });
+    if (it != mFeatureExpressions.end())
+        *it = expression;
+    else
+        mFeatureExpressions.push_back(expression);
 
-                newCloud.mCloudName += "-" + compareElement; // make a unique name in bundle
-                newCloud.mViewport = newBundle.mClouds.size(); // each cloud to compare has its viewport
-                setCloudRenderingProperties(newCloud);
+    return true;
+}
 
-                // Add to bundle.
-                newBundle.mClouds.push_back(newCloud);
-            }
-            else
-                std::cout << "[Visualizer][Compare] Bundle [" + bundleIt->mName + "] does not contain a cloud named [" + compareCloudName + "]." << std::endl;
-        }
-        else
-            std::cout << "[Visualizer][Compare] No bundle found containing strings [" + bundleSearchStr + "] and [" + compareElement + "]." << std::endl;
-    }
+void Visualizer::editFeatureExpressions(bool clear)
+{
+    // Derived features may change, with the same names.
+    for (auto& bundle : mBundles)
+        for (auto& cloud : bundle.mClouds)
+            cloud.mHistograms.clear();
 
-    newBundle.mName += " " + bundleSearchStr;
+    if (clear)
+    {
+        mFeatureExpressions.clear();
+    }
+    else
+    {
+        std::string definition;
+        std::cout << "-----------------------" << std::endl;
+        std::cout << "Derived features: " << std::endl;
+        for (const auto& expression : mFeatureExpressions)
+            std::cout << "  " << expression.getDefinition() << std::endl;
+        std::cout << "Enter derived feature (name = expression): ";
+        std::getline(std::cin >> std::ws, definition);
+        std::cout << "-----------------------" << std::endl;
+
+        if (!addFeatureExpression(definition))
+            return;
+    }
 
-    // Only add the bundle if at least one cloud was found
-    if (newBundle.mClouds.size() > 0)
-        bundles.push_back(newBundle);
+    // Reload the current bundle, with its new features.
+    mBundleSwitchInfo.mSwitchToBundleIdx = mCurrentBundleIdx;
 }
 
 const Visualizer::Bundle& Visualizer::getCurrentBundle() const
@@ -485,6 +1734,97 @@ Visualizer::Bundle& Visualizer::getCurrentBundle()
     return mBundles[mCurrentBundleIdx];
 }
 
+std::string Visualizer::getFeatureStatsText(int colorIdx) const
+{
+    if (colorIdx < 0 || colorIdx >= mCommonColorNames.size())
+        return "";
+
+    // Statistics of the colormap source cloud, or of the first cloud having them.
+    const auto& featureName = mCommonColorNames[colorIdx];
+    const auto& clouds = getCurrentBundle().mClouds;
+    auto hasStats = [&](const Cloud& cloud) { return cloud.mFeatureStats.count(featureName) > 0; };
+
+    auto cloudIt = std::find_if(clouds.begin(), clouds.end(), [&](const Cloud& cloud) { return (cloud.mCloudName == mColormapSourceId) && hasStats(cloud); });
+    if (cloudIt == clouds.end())
+        cloudIt = std::find_if(clouds.begin(), clouds.end(), hasStats);
+    if (cloudIt == clouds.end())
+        return "";
+
+    const auto& stats = cloudIt->mFeatureStats.at(featureName);
+    std::stringstream ss;
+    ss << "\n\rRange: [" << stats.mMin << ", " << stats.mMax << "], mean: " << stats.mMean << " (" << cloudIt->mCloudName << ")";
+    return ss.str();
+}
+
+std::string Visualizer::getHistogramText(int colorIdx)
+{
+    if (colorIdx < 0 || colorIdx >= mCommonColorNames.size())
+        return "";
+
+    // Histogram of the colormap source cloud, or of the first cloud having the feature.
+    const auto& featureName = mCommonColorNames[colorIdx];
+    auto& clouds = getCurrentBundle().mClouds;
+    auto hasFeature = [&](const Cloud& cloud)
+    {
+        if ((cloud.mType != Cloud::EType::ePoints) || !cloud.mPointCloudMessage)
+            return false;
+        const auto& fields = cloud.mPointCloudMessage->fields;
+        return std::any_of(fields.begin(), fields.end(), [&](const pcl::PCLPointField& f) { return f.name == featureName; });
+    };
+
+    auto cloudIt = std::find_if(clouds.begin(), clouds.end(), [&](const Cloud& cloud) { return (cloud.mCloudName == mColormapSourceId) && hasFeature(cloud); });
+    if (cloudIt == clouds.end())
+        cloudIt = std::find_if(clouds.begin(), clouds.end(), hasFeature);
+    if (cloudIt == clouds.end())
+        return "";
+
+    const auto& histogram = getFeatureHistogram(*cloudIt, featureName);
+    if (!histogram.isValid())
+        return "";
+
+    const size_t maxCount = std::max<size_t>(1, *std::max_element(histogram.mBins.begin(), histogram.mBins.end()));
+    const size_t barWidth = 40;
+    const float binWidth = (histogram.mHigh - histogram.mLow) / histogram.mBins.size();
+
+    std::stringstream ss;
+    ss << "\n\rHistogram of " << featureName << " (" << cloudIt->mCloudName << "), percentiles " << histogram.mPercentile << " to " << 100.0f - histogram.mPercentile;
+    ss << "\n\r  below (min " << histogram.mMin << ") " << histogram.mNbBelow;
+    for (size_t b = 0; b < histogram.mBins.size(); ++b)
+        ss << "\n\r  " << histogram.mLow + b * binWidth << " " << std::string(histogram.mBins[b] * barWidth / maxCount, '#') << " " << histogram.mBins[b];
+    ss << "\n\r  above " << histogram.mHigh << " (max " << histogram.mMax << ") " << histogram.mNbAbove;
+
+    return ss.str();
+}
+
+const FeatureHistogram& Visualizer::getFeatureHistogram(Cloud& cloud, const FeatureName& name)
+{
+    auto it = cloud.mHistograms.find(name);
+    if (it == cloud.mHistograms.end())
+    {
+        const auto histogram = cloud.mPointCloudMessage ? FeatureHistogram::compute(*cloud.mPointCloudMessage, name, mOptions.mColormapPercentile, FeatureStats::sNbHistogramBins) : FeatureHistogram();
+        it = cloud.mHistograms.emplace(name, histogram).first;
+    }
+
+    return it->second;
+}
+
+void Visualizer::applyColormapRanges(int colorIdx)
+{
+    if (!mUsePercentileRange || (colorIdx < 0) || (colorIdx >= mCommonColorNames.size()))
+        return;
+
+    const auto& featureName = mCommonColorNames[colorIdx];
+    for (auto& cloud : getCurrentBundle().mClouds)
+    {
+        if ((cloud.mType != Cloud::EType::ePoints) || !cloud.mPointCloudMessage || !getCloudRenderingProperties(cloud).mColormapRange.empty())
+            continue;
+
+        const auto& histogram = getFeatureHistogram(cloud, featureName);
+        if (histogram.isValid() && (histogram.mLow < histogram.mHigh))
+            getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_LUT_RANGE, histogram.mLow, histogram.mHigh, cloud.mCloudName);
+    }
+}
+
 int Visualizer::getColorHandlerIndex()
 {
     int colorIdx = 0;
@@ -502,7 +1842,14 @@ int Visualizer::getColorHandlerIndex()
 void Visualizer::reinstantiateViewer()
 {
     const auto& bundle = getCurrentBundle();
-    mViewer.reset(new PclVisualizer("Point Cloud Visualizer")); // temp name, will be overwritten
+    mViewer.reset(new PclVisualizer("Point Cloud Visualizer", !isBatchMode())); // temp name, will be overwritten
+    mViewer->setActorCacheBudget(getCacheLevelBudget());
+
+    if (isBatchMode())
+    {
+        getViewer().getRenderWindow()->SetOffScreenRendering(1);
+        getViewer().setSize(mOptions.mBatchWidth, mOptions.mBatchHeight);
+    }
 
     int nbRows{ 1 };
     int nbCols{ 0 };
@@ -527,7 +1874,10 @@ void Visualizer::reinstantiateViewer()
 
     getViewer().setBackgroundColor(mBackgroundGrayLevel, mBackgroundGrayLevel, mBackgroundGrayLevel);
 
-    //getViewer().registerPointPickingCallback(&Visualizer::pointPickingEventCallback, *this);
+    if (isBatchMode())
+        return;
+
+    getViewer().registerPointPickingCallback(&Visualizer::pointPickingEventCallback, *this);
     getViewer().registerKeyboardCallback(&Visualizer::keyboardEventCallback, *this);
 }
 
@@ -537,34 +1887,68 @@ void Visualizer::reset()
     mColormapSourceId = "";
 }
 
-void Visualizer::render(const Bundle& bundle)
+void Visualizer::render()
 {
     const std::string infoTextId = "infoTextId";
     getViewer().addText("", 10, 10, infoTextId, mInfoTextViewportId);
 
+    // Key events interrupt the spin, so waiting long when idle does not delay them.
+    const int idleSpinMs = 1000;
+
+    mIsRenderDirty = true;
     while (!getViewer().wasStopped() && !mustSwitchBundle())
     {
-        getViewer().setBackgroundColor(mBackgroundGrayLevel, mBackgroundGrayLevel, mBackgroundGrayLevel);
+        if (mIsRenderDirty) // only after an event that may have changed what is displayed
+        {
+            mIsRenderDirty = false;
 
-        const int colorIdx = getColorHandlerIndex();
+            getViewer().setBackgroundColor(mBackgroundGrayLevel, mBackgroundGrayLevel, mBackgroundGrayLevel);
 
-        std::string help = "";
-        if (mShowInfoText)
-        {
-            if (mSameBundleNavigationMode) help += "Bundle navigation:" + getBundleLocalScopeName(getCurrentBundle().mName, mSameBundleNavigationDepth) + "\n\r";
-            help += "Colormap source: " + mColormapSourceId + "\n\r";
-            help += "Color handler: " + std::to_string(colorIdx + 1) + " (" + ((colorIdx < mCommonColorNames.size()) ? mCommonColorNames[colorIdx] : "-") + ")";
+            const int colorIdx = getColorHandlerIndex();
+            applyColormapRanges(colorIdx); // the color handler may have changed
+
+            std::string help = "";
+            if (mShowInfoText)
+            {
+                if (mSameBundleNavigationMode) help += "Bundle navigation:" + getBundleLocalScopeName(getCurrentBundle().mName, mSameBundleNavigationDepth) + "\n\r";
+                if (mCatalog.isPending()) help += "Indexing the folder, other bundles will follow\n\r";
+                help += "Colormap source: " + mColormapSourceId + "\n\r";
+                help += "Color handler: " + std::to_string(colorIdx + 1) + " (" + ((colorIdx < mCommonColorNames.size()) ? mCommonColorNames[colorIdx] : "-") + ")";
+                help += getFeatureStatsText(colorIdx);
+                help += getPickedPointText();
+                help += getFiltersText();
+                if (mShowPerf) help += getPerfText();
+            }
+            if (mShowHistogram)
+                help += getHistogramText(colorIdx);
+            getViewer().updateText(help, 10, 10, 14, 0.5, 0.5, 0.5, infoTextId); // text, xpos, ypos, fontsize, r, g, b, id
         }
-        getViewer().updateText(help, 10, 10, 14, 0.5, 0.5, 0.5, infoTextId); // text, xpos, ypos, fontsize, r, g, b, id
 
-        getViewer().spinOnce(100);
+        // After an interrupted spin, PCL skips the spins until its update period elapsed: spinOnce returns at once,
+        // without handling events. Wait a little then, rather than iterating for nothing.
+        const auto spinStart = std::chrono::steady_clock::now();
+        getViewer().spinOnce(idleSpinMs);
+        if (std::chrono::steady_clock::now() - spinStart < std::chrono::milliseconds(1))
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        if (mCatalog.isPending() && mCatalog.isReady())
+            mergeCatalog();
+
+        mPerf.mFrameMs = getLastFrameTime(); // each spin renders
+        if (mPerf.mIsLogPending)
+            logPerf();
+
+        if (mOptions.mFollow)
+            followFolder();
+
+        receiveLiveClouds();
 
         // Point size can be changed with +/- in default PCL implementation. It changes point size of all clouds
         // in the viewport where the mouse is pointing. Since it is not trivial to keep track of those changes,
         // here is a workaround to sync the point size value for all clouds.
-        if (mIdentifiedCloudIdx == -1) // do not do this in identification mode
+        if (mIsRenderDirty && (mIdentifiedCloudIdx == -1)) // do not do this in identification mode
         {
-            for (const auto& cloud : bundle.mClouds)
+            for (const auto& cloud : getCurrentBundle().mClouds) // the bundles may grow when following the folder
             {
                 double size{ 1 };
                 getViewer().getPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, size, cloud.mCloudName);
@@ -573,7 +1957,7 @@ void Visualizer::render(const Bundle& bundle)
         }
 
         if (mustSwitchBundle())
-            mBundleSwitchInfo.mColorHandle = colorIdx;
+            mBundleSwitchInfo.mColorHandle = getColorHandlerIndex();
 
         if (mustReinstantiateViewer())
         {
@@ -597,7 +1981,7 @@ bool Visualizer::mustReinstantiateViewer()
     if (!mViewer)
         return true;
 
-    if (getViewer().wasStopped())
+    if (getViewer().wasStopped() && !isBatchMode()) // no interactor in batch mode, always "stopped"
         return true;
 
     if (mustSwitchBundle())
@@ -627,7 +2011,12 @@ void Visualizer::getBundleViewportLayout(const Bundle& bundle, int& nbRows, int&
 
 void Visualizer::switchBundle()
 {
-    // Clear loaded clouds.
+    // Keep the actors of the current clouds while the window is kept (when closed, its actors are gone).
+    // A batch does not come back to a bundle, no need to keep them.
+    if (mViewer && !getViewer().wasStopped() && !isBatchMode())
+        removeCloudsFromRender(getCurrentBundle().mClouds);
+
+    // Clear loaded clouds (they stay in the loader cache if they are close to the next bundle).
     for (auto& cloud : getCurrentBundle().mClouds)
         cloud.mPointCloudMessage.reset();
 
@@ -638,16 +2027,44 @@ void Visualizer::switchBundle()
         mBundleSwitchInfo.mSwitchToBundleIdx = -1;
     }
 
-    // Load bundle clouds.
+    using Clock = std::chrono::steady_clock;
+    auto getElapsedMs = [](const Clock::time_point& start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+    mPerf = BundlePerf();
+
+    // Load bundle clouds, usually already loaded in background.
+    auto start = Clock::now();
     for (auto& cloud : getCurrentBundle().mClouds)
     {
-        cloud.mPointCloudMessage.reset(new pcl::PCLPointCloud2());
-        pcl::io::loadPCDFile(cloud.mFullName, *cloud.mPointCloudMessage);
+        const Cloud& constCloud = cloud;
+        cloud.mPointCloudMessage = mLoader.get(cloud.getFileKey(), [&constCloud]() { return constCloud.loadMessage(); });
     }
+    mPerf.mWaitMs = getElapsedMs(start);
 
-    printBundleStack();
+    for (const auto& cloud : getCurrentBundle().mClouds)
+    {
+        mPerf.mLoadMs += mLoader.getLoadTime(cloud.getFileKey());
+        if (cloud.mPointCloudMessage)
+        {
+            mPerf.mNbBytes += cloud.mPointCloudMessage->data.size();
+            mPerf.mNbPoints += static_cast<size_t>(cloud.mPointCloudMessage->width) * cloud.mPointCloudMessage->height;
+        }
+    }
+
+    start = Clock::now();
+    addDerivedFeatures();
+    mPerf.mDerivedMs = getElapsedMs(start);
+
+    mPickedCloudName.clear();
+    mPointMasks.clear();
+
+    if (!isBatchMode()) // the batch knows which bundles come next
+    {
+        prefetchBundles();
+        printBundleStack();
+    }
 
     // Deal with the viewer instance.
+    start = Clock::now();
     const bool isNewWindow = mustReinstantiateViewer();
     if (isNewWindow)
     {
@@ -668,9 +2085,12 @@ void Visualizer::switchBundle()
     getViewer().setWindowName(getCurrentBundle().mName + " - " + getCurrentBundle().getTimestamp());
 
     const auto& clouds = getCurrentBundle().mClouds;
+    mPerf.mViewerMs = getElapsedMs(start);
 
     // Create the actors (what is displayed with their properties)
+    start = Clock::now();
     prepareCloudsForRender(clouds);
+    mPerf.mPrepareMs = getElapsedMs(start);
 
     int colorIdx{ 0 };
     if (isNewWindow)
@@ -692,6 +2112,113 @@ void Visualizer::switchBundle()
     for (const auto& cloud : clouds)
         if (cloud.mType == Cloud::EType::ePoints)
             getViewer().updateColorHandlerIndex(cloud.mCloudName, colorIdx);
+
+    applyFilters();
+    applyColormapRanges(colorIdx);
+
+    if (!isBatchMode())
+        buildPickIndices(); // once the actors are added, in their space
+
+    mPerf.mIsLogPending = !mOptions.mPerfLogFile.empty();
+}
+
+void Visualizer::prefetchBundles()
+{
+    // Bundles in the direction of navigation first, then the other direction.
+    std::vector<int> bundleIndices;
+    for (const int direction : { mNavigationStep < 0 ? -1 : 1, mNavigationStep < 0 ? 1 : -1 })
+    {
+        int idx = mCurrentBundleIdx;
+        for (int i = 0; i < mOptions.mPrefetchDepth; ++i)
+        {
+            idx = getNextBundleIdx(idx, direction);
+            if (idx < 0)
+                break;
+            bundleIndices.push_back(idx);
+        }
+    }
+
+    prefetchBundles(bundleIndices);
+}
+
+void Visualizer::prefetchBundles(const std::vector<int>& bundleIndices)
+{
+    std::vector<CloudLoader::Request> requests;
+    for (const int idx : bundleIndices)
+    {
+        for (const auto& cloud : mBundles[idx].mClouds)
+        {
+            auto cloudCopy = std::make_shared<Cloud>(cloud); // the bundles may be modified while loading
+            cloudCopy->mPointCloudMessage.reset();
+            requests.emplace_back(cloud.getFileKey(), [cloudCopy]() { return cloudCopy->loadMessage(); });
+        }
+    }
+
+    std::unordered_set<std::string> currentFiles;
+    for (const auto& cloud : getCurrentBundle().mClouds)
+    {
+        currentFiles.insert(cloud.getFileKey());
+        if (hasDerivedFeatures(getCurrentBundle()))
+            currentFiles.insert(getDerivedFeaturesKey(cloud));
+    }
+
+    mLoader.prefetch(requests, currentFiles);
+}
+
+void Visualizer::renderBatch()
+{
+    namespace fs = boost::filesystem;
+
+    boost::system::error_code ec;
+    fs::create_directories(mOptions.mBatchFolder, ec);
+
+    // Bundles of this worker.
+    std::vector<int> bundleIndices;
+    int nbMatching = 0;
+    for (int i = 0; i < getNbBundles(); ++i)
+    {
+        if (mBundles[i].mName.find(mOptions.mBatchFilter) == std::string::npos)
+            continue;
+
+        if (nbMatching++ % std::max(1, mOptions.mBatchNbWorkers) == mOptions.mBatchWorker)
+            bundleIndices.push_back(i);
+    }
+
+    // There is no interactor in batch mode: the camera file is read, and the images written, without it.
+    pcl::visualization::Camera camera;
+    const bool hasCamera = !mOptions.mBatchCameraFile.empty() && PclVisualizer::readCameraFile(mOptions.mBatchCameraFile, camera);
+    if (!mOptions.mBatchCameraFile.empty() && !hasCamera)
+        logError("[renderBatch] Could not read the camera file " + mOptions.mBatchCameraFile + ". Fitting each bundle instead.");
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < bundleIndices.size(); ++i)
+    {
+        mBundleSwitchInfo.mSwitchToBundleIdx = bundleIndices[i];
+        switchBundle();
+
+        // Load the next bundles while rendering this one.
+        const size_t nbPrefetch = std::min<size_t>(std::max(0, mOptions.mPrefetchDepth), bundleIndices.size() - i - 1);
+        prefetchBundles(std::vector<int>(bundleIndices.begin() + i + 1, bundleIndices.begin() + i + 1 + nbPrefetch));
+
+        if (hasCamera)
+            getViewer().setCameraParameters(camera);
+        else
+            getViewer().resetCamera(); // fit the bundle
+
+        const auto& bundle = getCurrentBundle();
+        const auto filename = fs::path(mOptions.mBatchFolder) / ("visualizer." + bundle.getTimestamp() + "." + bundle.mName + ".png");
+        if (!getViewer().saveImage(filename.string()))
+            logError("[renderBatch] Could not write " + filename.string() + ".");
+
+        mPerf.mFrameMs = getLastFrameTime();
+        if (mPerf.mIsLogPending)
+            logPerf();
+    }
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "[Visualizer] Rendered " << bundleIndices.size() << " bundles in " << std::fixed << std::setprecision(2) << seconds << " s ("
+        << (seconds > 0.0 ? bundleIndices.size() / seconds : 0.0) << " bundles/s)." << std::endl;
 }
 
 void Visualizer::printBundleStack()
@@ -736,35 +2263,15 @@ void Visualizer::prepareCloudsForRender(const Clouds& clouds)
         {
             getViewer().removeShape(cloud.mCloudName, getViewportId(cloud.mViewport));
 
-            pcl::PointCloud<PointLine>::Ptr lines(new pcl::PointCloud<PointLine>);
-            pcl::fromPCLPointCloud2(*cloud.mPointCloudMessage, *lines);
-
-            const int nbLines = lines->size();
-
-            pcl::PointCloud<pcl::PointXYZ>::Ptr source(new pcl::PointCloud<pcl::PointXYZ>);
-            pcl::copyPointCloud(*lines, *source);
-
-            pcl::PointCloud<pcl::PointXYZ>::Ptr target(new pcl::PointCloud<pcl::PointXYZ>(nbLines, 1));
-            pcl::Correspondences correspondences;
-            correspondences.reserve(nbLines);
-            for (int i = 0; i < nbLines; ++i)
+            // Colored per line by the rgb feature, so no color property.
+            if (!getViewer().addLines(*cloud.mPointCloudMessage, cloud.mCloudName, getViewportId(cloud.mViewport)))
             {
-                target->points[i].x = lines->points[i].x2;
-                target->points[i].y = lines->points[i].y2;
-                target->points[i].z = lines->points[i].z2;
-                correspondences.emplace_back(i, i, 1);
+                logError("[render] Cloud [" + cloud.mCloudName + "] is not a valid lines cloud. Won't add it.");
+                continue;
             }
 
-            getViewer().addCorrespondences<pcl::PointXYZ>(source, target, correspondences, cloud.mCloudName, getViewportId(cloud.mViewport));
-
-            const auto rgb = lines->front().rgb;
-            const auto r = (rgb >> 16) & 0xFF;
-            const auto g = (rgb >> 8) & 0xFF;
-            const auto b = (rgb) & 0xFF;
-
             getViewer().setShapeRenderingProperties(pcl::visualization::PCL_VISUALIZER_LINE_WIDTH, getCloudRenderingProperties(cloud).mSize, cloud.mCloudName);
             getViewer().setShapeRenderingProperties(pcl::visualization::PCL_VISUALIZER_OPACITY, getCloudRenderingProperties(cloud).mOpacity, cloud.mCloudName);
-            getViewer().setShapeRenderingProperties(pcl::visualization::PCL_VISUALIZER_COLOR, r / 255., g / 255., b / 255., cloud.mCloudName);
         }
         else if (cloud.mType == Cloud::EType::eSphere)
         {
@@ -876,10 +2383,16 @@ void Visualizer::prepareCloudsForRender(const Clouds& clouds)
             getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_OPACITY, getCloudRenderingProperties(cloud).mOpacity, cloud.mCloudName);
             getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_COLOR, r / 255., g / 255., b / 255., cloud.mCloudName);
         }
+        else if (getViewer().addPointCloudFromCache(cloud.mCloudName, getCloudActorCacheKey(cloud), getViewportId(cloud.mViewport))) // points, already built
+        {
+            setPointCloudRenderingProperties(cloud);
+            ++mPerf.mNbCachedActors;
+        }
         else // points
         {
             const auto colorHandlers = generateColorHandlers(cloud.mPointCloudMessage);
-            const auto geometryHandlers = generateGeometryHandlers(cloud.mPointCloudMessage);
+            const auto geometryHandlers = generateGeometryHandlers(cloud);
+            mPerf.mNbHandlers += static_cast<int>(colorHandlers.size() + geometryHandlers.size());
 
             if (colorHandlers.size() == 0 || geometryHandlers.size() == 0)
             {
@@ -916,18 +2429,55 @@ void Visualizer::prepareCloudsForRender(const Clouds& clouds)
 
             getViewer().filterHandlers(cloud.mCloudName);
 
-            const auto& props = getCloudRenderingProperties(cloud);
-            getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, props.mSize, cloud.mCloudName);
-            getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_OPACITY, props.mOpacity, cloud.mCloudName);
-            getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_LUT, props.mColormap, cloud.mCloudName);
-            getViewer().setColormapRangeAuto(cloud.mCloudName);
+            setPointCloudRenderingProperties(cloud);
+            ++mPerf.mNbBuiltActors;
+        }
+    }
+}
+
+void Visualizer::setPointCloudRenderingProperties(const Cloud& cloud)
+{
+    const auto& props = getCloudRenderingProperties(cloud);
+    getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, props.mSize, cloud.mCloudName);
+    getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_OPACITY, props.mOpacity, cloud.mCloudName);
+    getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_LUT, props.mColormap, cloud.mCloudName);
+    getViewer().setColormapRangeAuto(cloud.mCloudName);
+
+    if (props.mColormapRange.size() == 2)
+        getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_LUT_RANGE, props.mColormapRange[0], props.mColormapRange[1], cloud.mCloudName); // does range values check
+}
+
+void Visualizer::removeCloudsFromRender(const Clouds& clouds)
+{
+    // Point clouds are the costly ones to build; keep their actors for when coming back to them.
+    for (const auto& cloud : clouds)
+    {
+        if ((cloud.mType == Cloud::EType::ePoints) && cloud.mPointCloudMessage)
+        {
+            // Cached with all their points: the filters of the time they are restored are applied then.
+            auto mask = mPointMasks.find(cloud.mCloudName);
+            if ((mask != mPointMasks.end()) && (mask->second.getNbVisible() < mask->second.getNbPoints()))
+                getViewer().setAllPointsVisible(cloud.mCloudName);
 
-            if (props.mColormapRange.size() == 2)
-                getViewer().setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_LUT_RANGE, props.mColormapRange[0], props.mColormapRange[1], cloud.mCloudName); // does range values check
+            getViewer().removePointCloudToCache(cloud.mCloudName, getCloudActorCacheKey(cloud), cloud.mPointCloudMessage->data.size(), getViewportId(cloud.mViewport));
         }
     }
 }
 
+std::string Visualizer::getCloudActorCacheKey(const Cloud& cloud) const
+{
+    // The actor handlers depend on the features of all clouds of the bundle.
+    std::string key = cloud.getFileKey() + "|" + cloud.mCloudName + "|" + std::to_string(cloud.mViewport);
+    for (const auto& name : mCommonColorNames)
+        key += "|" + name;
+    for (const auto& name : mCommonGeoNames)
+        key += "|" + name;
+    for (const auto& expression : mFeatureExpressions) // a feature may be redefined with the same name
+        key += "|" + expression.getDefinition();
+
+    return key;
+}
+
 void Visualizer::setFeaturesOrder(const std::vector<FeatureName>& names)
 {
     mFeaturesOrder = names;
@@ -1004,19 +2554,17 @@ void Visualizer::generateCommonHandlersLists(const Clouds& clouds)
                 mCommonColorNames.push_back(name);
         }
 
-        ///////////////////////////////////////
-        //// Geo names.
-        //for (const auto& space : cloud.second->mSpaces)
-        //{
-        //    // Only add if not there.
-        //    const auto& name = space.getName();
-        //    if (std::find(mCommonGeoNames.begin(), mCommonGeoNames.end(), name) == mCommonGeoNames.end())
-        //        mCommonGeoNames.push_back(name);
-        //}
-
-        mCommonGeoNames.push_back("xyz"); // TODO SPACES
-        ///////////////////////////////////////
+        // Geo names, named like PCL names its handlers. xyz first: it is the geometry of the color handlers.
+        if (mCommonGeoNames.empty())
+            mCommonGeoNames.push_back("xyz");
 
+        for (const auto& space : cloud.mSpaces)
+        {
+            // Only add if not there.
+            const auto name = space[0] + space[1] + space[2];
+            if (std::find(mCommonGeoNames.begin(), mCommonGeoNames.end(), name) == mCommonGeoNames.end())
+                mCommonGeoNames.push_back(name);
+        }
     }
 
     // Reorder color handlers if necessary.
@@ -1045,10 +2593,13 @@ std::vector<ColorHandlerConstPtr> Visualizer::generateColorHandlers(
 
     std::vector<ColorHandlerConstPtr> handlers;
 
-    auto addRgb = [&]() { handlers.emplace_back(new pcl::visualization::PointCloudColorHandlerRGBField<pcl::PCLPointCloud2>(pclCloudMsg)); }; 
-    auto addNull = [&]() { handlers.emplace_back(new PointCloudColorHandlerNull(pclCloudMsg)); }; 
-    auto addRandom = [&]() { handlers.emplace_back(new pcl::visualization::PointCloudColorHandlerRandom<pcl::PCLPointCloud2>(pclCloudMsg)); }; 
-    auto addGeneric = [&](FeatureName name) { handlers.emplace_back(new pcl::visualization::PointCloudColorHandlerGenericField<pcl::PCLPointCloud2>(pclCloudMsg, name)); }; 
+    // Colors are only computed the first time a handler is displayed.
+    auto addCached = [&](pcl::visualization::PointCloudColorHandler<pcl::PCLPointCloud2>* handler) { handlers.emplace_back(new PointCloudColorHandlerCached(pclCloudMsg, ColorHandlerConstPtr(handler))); };
+
+    auto addRgb = [&]() { addCached(new pcl::visualization::PointCloudColorHandlerRGBField<pcl::PCLPointCloud2>(pclCloudMsg)); }; 
+    auto addNull = [&]() { addCached(new PointCloudColorHandlerNull(pclCloudMsg)); }; 
+    auto addRandom = [&]() { addCached(new pcl::visualization::PointCloudColorHandlerRandom<pcl::PCLPointCloud2>(pclCloudMsg)); }; 
+    auto addGeneric = [&](FeatureName name) { addCached(new pcl::visualization::PointCloudColorHandlerGenericField<pcl::PCLPointCloud2>(pclCloudMsg, name)); }; 
 
     for (const auto& name : mCommonColorNames)
     {
@@ -1072,61 +2623,297 @@ std::vector<ColorHandlerConstPtr> Visualizer::generateColorHandlers(
     return std::move(handlers);
 }
 
-std::vector<GeometryHandlerConstPtr> Visualizer::generateGeometryHandlers(const pcl::PCLPointCloud2::Ptr pclCloudMsg) const
+std::vector<GeometryHandlerConstPtr> Visualizer::generateGeometryHandlers(const Cloud& cloud) const
+{
+    if (mCommonGeoNames.size() <= 0)
+        logError("[generateGeometryHandlers] Common geo names list not generated.");
+
+    const auto& pclCloudMsg = cloud.mPointCloudMessage;
+
+    auto hasFieldInPointCloudMsg = [&pclCloudMsg] (const std::string& name)
+    {
+        const auto& f = pclCloudMsg->fields;
+        return std::find_if(f.begin(), f.end(), [&name](const pcl::PCLPointField& p) { return p.name == name; }) != f.end();
+    };
+
+    auto findSpace = [&cloud] (const std::string& name)
+    {
+        const auto& s = cloud.mSpaces;
+        return std::find_if(s.begin(), s.end(), [&name](const std::array<FeatureName, 3>& space) { return space[0] + space[1] + space[2] == name; });
+    };
+
+    std::vector<GeometryHandlerConstPtr> handlers;
+
+    // Points are only extracted the first time a handler is displayed.
+    auto addCached = [&](pcl::visualization::PointCloudGeometryHandler<pcl::PCLPointCloud2>* handler) { handlers.emplace_back(new PointCloudGeometryHandlerCached(pclCloudMsg, GeometryHandlerConstPtr(handler))); };
+
+    for (const auto& name : mCommonGeoNames)
+    {
+        const auto space = findSpace(name);
+        if (name == "xyz")
+            addCached(new pcl::visualization::PointCloudGeometryHandlerXYZ<pcl::PCLPointCloud2>(pclCloudMsg)); // all clouds have it, even without space lines (older files)
+        else if ((space != cloud.mSpaces.end()) && std::all_of(space->begin(), space->end(), hasFieldInPointCloudMsg))
+            addCached(new PointCloudGeometryHandlerSpace(pclCloudMsg, *space));
+        else
+            handlers.emplace_back(new PointCloudGeometryHandlerNull(pclCloudMsg));
+    }
+
+    return std::move(handlers);
+}
+
+void PointCloudGeometryHandlerSpace::getGeometry(vtkSmartPointer<vtkPoints> &points) const
+{
+    if (!points) points = vtkSmartPointer<vtkPoints>::New();
+    points->SetDataTypeToFloat();
+
+    // Same points as the PCL color handlers: all of them if the cloud is dense or has no x, else those with valid x, y, z.
+    const auto& fields = cloud_->fields;
+    const bool hasX = std::any_of(fields.begin(), fields.end(), [](const pcl::PCLPointField& f) { return f.name == "x"; });
+    const bool isAllValid = cloud_->is_dense || !hasX;
+
+    const size_t nbPoints = static_cast<size_t>(cloud_->width) * cloud_->height;
+    std::vector<float> x, y, z;
+    if (!isAllValid)
+    {
+        x = readFeatureValues(*cloud_, "x");
+        y = readFeatureValues(*cloud_, "y");
+        z = readFeatureValues(*cloud_, "z");
+    }
+
+    const std::array<std::vector<float>, 3> coordinates = { { readFeatureValues(*cloud_, mSpace[0]), readFeatureValues(*cloud_, mSpace[1]), readFeatureValues(*cloud_, mSpace[2]) } };
+
+    points->SetNumberOfPoints(static_cast<vtkIdType>(nbPoints));
+    float* data = static_cast<float*>(points->GetVoidPointer(0));
+    vtkIdType j = 0;
+    for (size_t i = 0; i < nbPoints; ++i)
+    {
+        if (!isAllValid && !(std::isfinite(x[i]) && std::isfinite(y[i]) && std::isfinite(z[i])))
+            continue;
+
+        for (size_t k = 0; k < 3; ++k)
+            data[3 * j + k] = std::isfinite(coordinates[k][i]) ? coordinates[k][i] : 0.0f;
+        ++j;
+    }
+    points->SetNumberOfPoints(j);
+}
+
+void PclVisualizer::filterHandlers(const std::string &id)
+{
+    // The same handler is added with each color handler; distinct handlers are kept, even with the same name (e.g. null ones),
+    // so that a space has the same index in all clouds.
+    auto compare = [](GeometryHandlerConstPtr lhs, GeometryHandlerConstPtr rhs) { return lhs == rhs; };
+
+    auto cloudActorMap = getCloudActorMap();
+    auto it = cloudActorMap->find(id);
+    if (it != cloudActorMap->end())
+    {
+        auto& h = it->second.geometry_handlers;
+
+        // We do not sort, to not reorder the handlers. Anyway, equal handlers
+        // should be grouped together.
+        h.erase(std::unique(h.begin(), h.end(), compare), h.end());
+    }
+}
+
+// Overriding to get index from the correct cloud actor map. Obscur why.
+int PclVisualizer::getGeometryHandlerIndex(const std::string &id)
+{
+    auto cloudActorMap = getCloudActorMap(); // instead of style_->getCloudActorMap() in base class, where our id never exists...
+    auto it = cloudActorMap->find(id);
+    if (it == cloudActorMap->end())
+        return (-1);
+
+    return (it->second.geometry_handler_index_);
+}
+
+vtkSmartPointer<vtkPolyData> PclVisualizer::createLinesPolyData(const pcl::PCLPointCloud2& message)
+{
+    auto findField = [&](const std::string& name) -> const pcl::PCLPointField*
+    {
+        auto it = std::find_if(message.fields.begin(), message.fields.end(), [&](const pcl::PCLPointField& f) { return f.name == name; });
+        return ((it != message.fields.end()) && (pcl::getFieldSize(it->datatype) == 4)) ? &*it : nullptr;
+    };
+
+    // Coordinates of both ends of each line, in the order of the points of the polydata.
+    const pcl::PCLPointField* coordinateFields[6] = { findField("x"), findField("y"), findField("z"), findField("x2"), findField("y2"), findField("z2") };
+    for (const auto* field : coordinateFields)
+        if (!field || (field->datatype != pcl::PCLPointField::FLOAT32))
+            return nullptr;
+
+    const pcl::PCLPointField* rgbField = findField("rgb");
+    const uint32_t defaultRgb = (128 << 16) | (128 << 8) | 128; // gray, like VisualizerData
+
+    const vtkIdType nbLines = static_cast<vtkIdType>(message.width) * message.height;
+    if (message.data.size() < static_cast<size_t>(nbLines) * message.point_step)
+        return nullptr; // truncated
+
+    auto coordinates = vtkSmartPointer<vtkFloatArray>::New();
+    coordinates->SetNumberOfComponents(3);
+    coordinates->SetNumberOfTuples(2 * nbLines);
+    float* pCoordinates = coordinates->GetPointer(0);
+
+    auto cells = vtkSmartPointer<vtkIdTypeArray>::New();
+    cells->SetNumberOfComponents(1);
+    cells->SetNumberOfTuples(3 * nbLines);
+    vtkIdType* pCells = cells->GetPointer(0);
+
+    auto colors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+    colors->SetNumberOfComponents(3);
+    colors->SetNumberOfTuples(nbLines);
+    unsigned char* pColors = colors->GetPointer(0);
+
+    // One pass over the message: 2 points, a segment and a color per line.
+    for (vtkIdType i = 0; i < nbLines; ++i)
+    {
+        const uint8_t* pLine = &message.data[i * message.point_step];
+
+        for (int k = 0; k < 6; ++k)
+            std::memcpy(&pCoordinates[6 * i + k], pLine + coordinateFields[k]->offset, sizeof(float));
+
+        pCells[3 * i] = 2;
+        pCells[3 * i + 1] = 2 * i;
+        pCells[3 * i + 2] = 2 * i + 1;
+
+        uint32_t rgb = defaultRgb;
+        if (rgbField)
+            std::memcpy(&rgb, pLine + rgbField->offset, sizeof(rgb));
+        pColors[3 * i] = (rgb >> 16) & 0xFF;
+        pColors[3 * i + 1] = (rgb >> 8) & 0xFF;
+        pColors[3 * i + 2] = rgb & 0xFF;
+    }
+
+    auto points = vtkSmartPointer<vtkPoints>::New();
+    points->SetData(coordinates);
+
+    auto lines = vtkSmartPointer<vtkCellArray>::New();
+    lines->SetCells(nbLines, cells);
+
+    auto polydata = vtkSmartPointer<vtkPolyData>::New();
+    polydata->SetPoints(points);
+    polydata->SetLines(lines);
+    polydata->GetCellData()->SetScalars(colors);
+
+    return polydata;
+}
+
+bool PclVisualizer::addLines(const pcl::PCLPointCloud2& message, const std::string& id, int viewport)
+{
+    if (getShapeActorMap()->count(id) > 0)
+        return false;
+
+    auto polydata = createLinesPolyData(message);
+    if (!polydata)
+        return false;
+
+    auto mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+    mapper->SetInputData(polydata);
+    mapper->SetScalarModeToUseCellData();
+    mapper->SetColorModeToDefault(); // unsigned char scalars are colors
+    mapper->ScalarVisibilityOn();
+
+    auto actor = vtkSmartPointer<vtkActor>::New();
+    actor->SetMapper(mapper);
+
+    // A shape like the others: removeShape and setShapeRenderingProperties apply to it.
+    addActorToViewport(actor, viewport);
+    (*getShapeActorMap())[id] = actor;
+
+    return true;
+}
+
+bool PclVisualizer::saveImage(const std::string& filename)
 {
-    if (mCommonGeoNames.size() <= 0)
-        logError("[generateGeometryHandlers] Common geo names list not generated.");
+    auto window = getRenderWindow();
+    if (!window)
+        return false;
 
-    std::vector<GeometryHandlerConstPtr> handlers;
+    window->Render();
 
-    // TODO spaces
+    auto image = vtkSmartPointer<vtkWindowToImageFilter>::New();
+    image->SetInput(window);
+    image->SetInputBufferTypeToRGB();
+    image->ReadFrontBufferOff(); // offscreen, the image is in the back buffer
+    image->Update();
 
-    //////auto findSpace = [&cloud] (const std::string& name)
-    //////{
-    //////    const auto& s = cloud.mSpaces;
-    //////    return std::find_if(s.begin(), s.end(), [&name](const Space& space) { return space.getName() == name; });
-    //////};
+    auto writer = vtkSmartPointer<vtkPNGWriter>::New();
+    writer->SetFileName(filename.c_str());
+    writer->SetInputConnection(image->GetOutputPort());
+    writer->Write();
 
-    //////using GeoHandler = pcl::visualization::PointCloudGeometryHandlerCustom<pcl::PCLPointCloud2>;
-    //////for (const auto& name : mCommonGeoNames)
-    //////{
-    //////    const auto space = findSpace(name);
-    //////    if (space != cloud.mSpaces.end())
-    //////        handlers.emplace_back(new GeoHandler(pclCloudMsg, space->u1, space->u2, space->u3));
-    //////    else
-    //////        handlers.emplace_back(new PointCloudGeometryHandlerNull(pclCloudMsg));
-    //////}
+    boost::system::error_code ec;
+    return boost::filesystem::exists(filename, ec);
+}
 
-    handlers.emplace_back(new pcl::visualization::PointCloudGeometryHandlerXYZ<pcl::PCLPointCloud2>(pclCloudMsg)); // TODO spces: replace by above
+bool PclVisualizer::readCameraFile(const std::string& filename, pcl::visualization::Camera& camera)
+{
+    // One line: clip near,far/focal x,y,z/position x,y,z/view up x,y,z/fovy/window size/window position
+    std::ifstream file(filename);
+    std::string line;
+    if (!std::getline(file, line))
+        return false;
+
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::replace(line.begin(), line.end(), '/', ' ');
+
+    std::istringstream iss(line);
+    iss >> camera.clip[0] >> camera.clip[1]
+        >> camera.focal[0] >> camera.focal[1] >> camera.focal[2]
+        >> camera.pos[0] >> camera.pos[1] >> camera.pos[2]
+        >> camera.view[0] >> camera.view[1] >> camera.view[2]
+        >> camera.fovy;
+    if (!iss)
+        return false;
+
+    if (!(iss >> camera.window_size[0] >> camera.window_size[1] >> camera.window_pos[0] >> camera.window_pos[1]))
+        camera.window_size[0] = camera.window_size[1] = camera.window_pos[0] = camera.window_pos[1] = 0.0;
 
-    return std::move(handlers);
+    return true;
 }
 
-void PclVisualizer::filterHandlers(const std::string &id)
+bool PclVisualizer::setVisiblePoints(const std::string& id, const std::vector<size_t>& displayIndices)
 {
-    auto compare = [](GeometryHandlerConstPtr lhs, GeometryHandlerConstPtr rhs) { return lhs->getFieldName() == rhs->getFieldName(); };
-
     auto cloudActorMap = getCloudActorMap();
     auto it = cloudActorMap->find(id);
-    if (it != cloudActorMap->end())
+    if (it == cloudActorMap->end())
+        return false;
+
+    auto* polydata = vtkPolyData::SafeDownCast(it->second.actor->GetMapper()->GetInput());
+    if (!polydata)
+        return false;
+
+    // One vertex cell per visible point, as PCL builds them; the points and their colors stay as they are.
+    auto cells = vtkSmartPointer<vtkIdTypeArray>::New();
+    cells->SetNumberOfComponents(1);
+    cells->SetNumberOfTuples(2 * displayIndices.size());
+    vtkIdType* cellData = cells->GetPointer(0);
+    for (size_t i = 0; i < displayIndices.size(); ++i)
     {
-        auto& h = it->second.geometry_handlers;
-
-        // We do not sort, to not reorder the handlers. Anyway, equal handlers
-        // should be grouped together.
-        h.erase(std::unique(h.begin(), h.end(), compare), h.end());
+        cellData[2 * i] = 1;
+        cellData[2 * i + 1] = static_cast<vtkIdType>(displayIndices[i]);
     }
+
+    auto verts = vtkSmartPointer<vtkCellArray>::New();
+    verts->SetCells(static_cast<vtkIdType>(displayIndices.size()), cells);
+    polydata->SetVerts(verts);
+    polydata->Modified();
+
+    return true;
 }
 
-// Overriding to get index from the correct cloud actor map. Obscur why.
-int PclVisualizer::getGeometryHandlerIndex(const std::string &id)
+bool PclVisualizer::setAllPointsVisible(const std::string& id)
 {
-    auto cloudActorMap = getCloudActorMap(); // instead of style_->getCloudActorMap() in base class, where our id never exists...
+    auto cloudActorMap = getCloudActorMap();
     auto it = cloudActorMap->find(id);
     if (it == cloudActorMap->end())
-        return (-1);
+        return false;
 
-    return (it->second.geometry_handler_index_);
+    auto* polydata = vtkPolyData::SafeDownCast(it->second.actor->GetMapper()->GetInput());
+    if (!polydata)
+        return false;
+
+    std::vector<size_t> displayIndices(polydata->GetNumberOfPoints());
+    std::iota(displayIndices.begin(), displayIndices.end(), 0);
+    return setVisiblePoints(id, displayIndices);
 }
 
 // Using pcl::visualization::PCL_VISUALIZER_LUT_RANGE_AUTO is not sufficient; it
@@ -1154,6 +2941,112 @@ bool PclVisualizer::setColormapRangeAuto(const std::string &id)
     return true;
 }
 
+void PclVisualizer::interruptSpin()
+{
+    if (interactor_)
+        interactor_->TerminateApp(); // makes spinOnce return, as its timer would
+}
+
+void PclVisualizer::removePointCloudToCache(const std::string& id, const std::string& key, size_t extraBytes, int viewport)
+{
+    auto cloudActorMap = getCloudActorMap();
+    auto it = cloudActorMap->find(id);
+    if (it == cloudActorMap->end())
+        return;
+
+    CachedActor cached;
+    cached.mKey = key;
+    cached.mActor = it->second;
+    cached.mBytes = extraBytes;
+
+    vtkActor* actor = it->second.actor;
+    if (actor && actor->GetMapper() && actor->GetMapper()->GetInput())
+        cached.mBytes += actor->GetMapper()->GetInput()->GetActualMemorySize() * 1024; // in kibibytes
+
+    for (const auto& handler : it->second.color_handlers)
+    {
+        auto cachedHandler = boost::dynamic_pointer_cast<const PointCloudColorHandlerCached>(handler);
+        if (cachedHandler)
+            cached.mBytes += cachedHandler->getMemorySize();
+    }
+
+    auto* polydata = (actor && actor->GetMapper()) ? vtkPolyData::SafeDownCast(actor->GetMapper()->GetInput()) : nullptr;
+    for (const auto& handler : it->second.geometry_handlers)
+    {
+        auto cachedHandler = boost::dynamic_pointer_cast<const PointCloudGeometryHandlerCached>(handler);
+        if (cachedHandler && (!polydata || (polydata->GetPoints() != cachedHandler->getPoints()))) // the displayed ones are counted with the actor
+            cached.mBytes += cachedHandler->getMemorySize();
+    }
+
+    removePointCloud(id, viewport);
+
+    auto existing = mCachedActorsByKey.find(key);
+    if (existing != mCachedActorsByKey.end())
+    {
+        mCachedActorsBytes -= existing->second->mBytes;
+        mCachedActors.erase(existing->second);
+    }
+
+    mCachedActors.push_front(cached);
+    mCachedActorsByKey[key] = mCachedActors.begin();
+    mCachedActorsBytes += cached.mBytes;
+
+    evictCachedActors();
+}
+
+bool PclVisualizer::addPointCloudFromCache(const std::string& id, const std::string& key, int viewport)
+{
+    auto cachedIt = mCachedActorsByKey.find(key);
+    if (cachedIt == mCachedActorsByKey.end())
+        return false;
+
+    auto cloudActorMap = getCloudActorMap();
+    if (cloudActorMap->find(id) != cloudActorMap->end())
+        return false; // already displayed
+
+    const auto& cloudActor = cachedIt->second->mActor;
+    (*cloudActorMap)[id] = cloudActor;
+
+    addActorToViewport(cloudActor.actor, viewport);
+
+    // In use, not cached anymore until removed again.
+    mCachedActorsBytes -= cachedIt->second->mBytes;
+    mCachedActors.erase(cachedIt->second);
+    mCachedActorsByKey.erase(cachedIt);
+
+    return true;
+}
+
+void PclVisualizer::addActorToViewport(vtkProp* actor, int viewport)
+{
+    // Same as the base class addActorToRenderer, which is private.
+    auto renderers = getRendererCollection();
+    renderers->InitTraversal();
+    int i = 0;
+    while (vtkRenderer* renderer = renderers->GetNextItem())
+    {
+        if ((viewport == 0) || (viewport == i))
+            renderer->AddActor(actor);
+        ++i;
+    }
+}
+
+void PclVisualizer::setActorCacheBudget(size_t bytes)
+{
+    mActorCacheBudget = bytes;
+    evictCachedActors();
+}
+
+void PclVisualizer::evictCachedActors()
+{
+    while ((mCachedActorsBytes > mActorCacheBudget) && !mCachedActors.empty())
+    {
+        mCachedActorsBytes -= mCachedActors.back().mBytes;
+        mCachedActorsByKey.erase(mCachedActors.back().mKey);
+        mCachedActors.pop_back();
+    }
+}
+
 void Visualizer::keyboardEventCallback(const pcl::visualization::KeyboardEvent& event, void*)
 {
     if ((event.getKeySym() == "i" || event.getKeySym() == "I") && event.keyDown())
@@ -1171,7 +3064,11 @@ void Visualizer::keyboardEventCallback(const pcl::visualization::KeyboardEvent&
     }
     else if ((event.getKeySym() == "t" || event.getKeySym() == "T") && event.keyDown())
     {
-        if (event.isShiftPressed()) // switch theme
+        if (event.isCtrlPressed()) // histogram of the color handler feature
+            mShowHistogram = !mShowHistogram;
+        else if (event.isAltPressed()) // performance of the bundle in the info text
+            mShowPerf = !mShowPerf;
+        else if (event.isShiftPressed()) // switch theme
             mBackgroundGrayLevel = 1.0 - mBackgroundGrayLevel;
         else // show text toggle
             mShowInfoText = !mShowInfoText;
@@ -1207,50 +3104,70 @@ void Visualizer::keyboardEventCallback(const pcl::visualization::KeyboardEvent&
         else if (event.isAltPressed())
             changeCurrentCloudSize(-1);
     }
+    else if ((event.getKeySym() == "v" || event.getKeySym() == "V" || event.getKeySym() == "bracketleft" || event.getKeySym() == "bracketright"
+        || event.getKeySym() == "braceleft" || event.getKeySym() == "braceright") && event.keyDown())
+    {
+        editFilters(event);
+    }
+    else if ((event.getKeySym() == "d" || event.getKeySym() == "D") && event.keyDown())
+    {
+        editFeatureExpressions(event.isCtrlPressed());
+    }
+    else if (event.isAltPressed() && (event.getKeySym().size() == 1) && std::isdigit(event.getKeySym()[0]) && event.keyDown())
+    {
+        onSpaceSwitched(); // already switched by PCL
+    }
     else if ((event.getKeySym() == "j" || event.getKeySym() == "J") && event.keyDown())
     {
         const auto filename = mPath / ("visualizer." + getCurrentBundle().getTimestamp() + "." + getCurrentBundle().mName + ".png");
         std::cout << "Saving screenshot (" << filename << ")." << std::endl;
         mViewer->saveScreenshot(filename.string());
     }
+
+    // Any key may change what is displayed (including PCL builtin keys): update now rather than at the end of the spin.
+    mIsRenderDirty = true;
+    getViewer().interruptSpin();
 }
 
 int Visualizer::determineNextBundleIdx(int step)
+{
+    mNavigationStep = step;
+
+    const int nextBundleIdx = getNextBundleIdx(mCurrentBundleIdx, step);
+    return (nextBundleIdx >= 0) ? nextBundleIdx : mBundleSwitchInfo.mSwitchToBundleIdx; // keep same by default
+}
+
+int Visualizer::getNextBundleIdx(int fromIdx, int step) const
 {
     const bool isLeft = step < 0;
 
-    int nextBundleIdx = mBundleSwitchInfo.mSwitchToBundleIdx; // keep same by default
+    if (fromIdx < 0)
+        return -1;
 
-    if (mCurrentBundleIdx >= 0)
+    if (!mSameBundleNavigationMode)
     {
-        if (!mSameBundleNavigationMode)
-        {
-            if (isLeft && (mCurrentBundleIdx > 0)) // do not overshoot left
-                nextBundleIdx = mCurrentBundleIdx + step;
-            else if (!isLeft && (mCurrentBundleIdx < getNbBundles() - 1)) // do not overshoot right
-                nextBundleIdx = mCurrentBundleIdx + step;
-        }
-        else
+        if (isLeft && (fromIdx > 0)) // do not overshoot left
+            return std::max(0, fromIdx + step);
+        else if (!isLeft && (fromIdx < getNbBundles() - 1)) // do not overshoot right
+            return std::min(getNbBundles() - 1, fromIdx + step);
+    }
+    else
+    {
+        const auto& bundleName = mBundles[fromIdx].mName;
+        const int limit = isLeft ? 0 : getNbBundles() - 1;
+        const int start = fromIdx + step;
+        const int end = limit + step;
+        for (int i = start; i != end; i += step)
         {
-            const auto& bundleName = getCurrentBundle().mName;
-            const int limit = isLeft ? 0 : getNbBundles() - 1;
-            const int start = mCurrentBundleIdx + step;
-            const int end = limit + step;
-            for (int i = start; i != end; i += step)
-            {
-                if ((i < 0) || (i >= getNbBundles())) // do not overshoot
-                    break;
+            if ((i < 0) || (i >= getNbBundles())) // do not overshoot
+                break;
 
-                if (getBundleLocalScopeName(mBundles[i].mName, mSameBundleNavigationDepth) == getBundleLocalScopeName(bundleName, mSameBundleNavigationDepth))
-                {
-                    nextBundleIdx = i;
-                    break;
-                }
-            }
+            if (getBundleLocalScopeName(mBundles[i].mName, mSameBundleNavigationDepth) == getBundleLocalScopeName(bundleName, mSameBundleNavigationDepth))
+                return i;
         }
     }
 
-    return nextBundleIdx;
+    return -1;
 }
 
 void Visualizer::changeCurrentCloudOpacity(double delta)
@@ -1361,7 +3278,17 @@ void Visualizer::editColorMap(const pcl::visualization::KeyboardEvent& e)
 
     auto& props = (it != clouds.end()) ? getCloudRenderingProperties(*it) : getCloudRenderingProperties(clouds.front());
 
-    if (e.isCtrlPressed()) // edit colormap range
+    if (e.isAltPressed()) // automatic ranges: percentiles or min and max values
+    {
+        mUsePercentileRange = !mUsePercentileRange;
+        std::cout << "[Visualizer] Automatic colormap ranges: " << (mUsePercentileRange ? "percentiles" : "min and max values") << "." << std::endl;
+
+        if (!mUsePercentileRange)
+            for (const auto& cloud : clouds)
+                if ((cloud.mType == Cloud::EType::ePoints) && getCloudRenderingProperties(cloud).mColormapRange.empty())
+                    getViewer().setColormapRangeAuto(cloud.mCloudName);
+    }
+    else if (e.isCtrlPressed()) // edit colormap range
     {
         if (e.isShiftPressed())
         {
@@ -1402,6 +3329,221 @@ void Visualizer::editColorMap(const pcl::visualization::KeyboardEvent& e)
     }
 }
 
+void Visualizer::editFilters(const pcl::visualization::KeyboardEvent& e)
+{
+    if (e.isCtrlPressed())
+    {
+        mFilters.clear();
+        applyFilters();
+        return;
+    }
+
+    // Filter on the current color handler feature.
+    const int colorIdx = getColorHandlerIndex();
+    if ((colorIdx < 0) || (colorIdx >= mCommonColorNames.size()))
+        return;
+
+    const auto& featureName = mCommonColorNames[colorIdx];
+    float featureMin, featureMax;
+    if (!getFeatureRange(featureName, featureMin, featureMax))
+    {
+        logWarning("[editFilters] No cloud has values for feature [" + featureName + "].");
+        return;
+    }
+
+    auto filterIt = std::find_if(mFilters.begin(), mFilters.end(), [&](const FeatureFilter& f) { return f.mFeatureName == featureName; });
+    if (filterIt == mFilters.end())
+    {
+        FeatureFilter filter;
+        filter.mFeatureName = featureName;
+        filter.mMin = featureMin;
+        filter.mMax = featureMax;
+        mFilters.push_back(filter);
+        filterIt = mFilters.end() - 1;
+    }
+
+    auto& filter = *filterIt;
+    const std::string key = e.getKeySym();
+    if ((key == "v") || (key == "V")) // set filter range by asking user inputs
+    {
+        std::cout << "-----------------------" << std::endl;
+        std::cout << "Feature [" << featureName << "] values in [" << featureMin << ", " << featureMax << "]" << std::endl;
+        std::cout << "Enter filter MIN value: ";
+        std::cin >> filter.mMin;
+        std::cout << "Enter filter MAX value: ";
+        std::cin >> filter.mMax;
+        std::cout << "-----------------------" << std::endl;
+    }
+    else // move a threshold by a step; holding the key moves it continuously
+    {
+        const float step = (featureMax - featureMin) / 100.0f;
+        if (key == "bracketleft") filter.mMax -= step;
+        else if (key == "bracketright") filter.mMax += step;
+        else if (key == "braceleft") filter.mMin -= step;
+        else if (key == "braceright") filter.mMin += step;
+    }
+
+    applyFilters();
+}
+
+void Visualizer::applyFilters()
+{
+    if (mFilters.empty() && mPointMasks.empty())
+        return; // nothing is hidden
+
+    for (const auto& cloud : getCurrentBundle().mClouds)
+    {
+        auto* mask = getPointMask(cloud);
+        if (mask && mask->setFilters(mFilters))
+            getViewer().setVisiblePoints(cloud.mCloudName, mask->getVisibleDisplayIndices());
+    }
+}
+
+bool Visualizer::getFeatureRange(const std::string& name, float& min, float& max)
+{
+    bool isFound = false;
+    for (const auto& cloud : getCurrentBundle().mClouds)
+    {
+        auto* mask = getPointMask(cloud);
+        float cloudMin, cloudMax;
+        if (!mask || !mask->getFeatureRange(name, cloudMin, cloudMax))
+            continue;
+
+        min = isFound ? std::min(min, cloudMin) : cloudMin;
+        max = isFound ? std::max(max, cloudMax) : cloudMax;
+        isFound = true;
+    }
+
+    return isFound;
+}
+
+PointMask* Visualizer::getPointMask(const Cloud& cloud)
+{
+    std::array<FeatureName, 3> space;
+    if (!cloud.mPointCloudMessage || (cloud.mType != Cloud::EType::ePoints) || !getDisplayedSpace(cloud, space))
+    {
+        mPointMasks.erase(cloud.mCloudName);
+        return nullptr;
+    }
+
+    auto it = mPointMasks.find(cloud.mCloudName);
+    if (it == mPointMasks.end())
+        it = mPointMasks.emplace(cloud.mCloudName, PointMask(cloud.mPointCloudMessage)).first;
+
+    return &it->second;
+}
+
+bool Visualizer::getDisplayedSpace(const Cloud& cloud, std::array<FeatureName, 3>& space)
+{
+    // The geometry handlers of a cloud follow mCommonGeoNames (see generateGeometryHandlers).
+    const int index = getViewer().getGeometryHandlerIndex(cloud.mCloudName);
+    if ((index <= 0) || (index >= static_cast<int>(mCommonGeoNames.size()))) // not displayed yet: added with the first one
+    {
+        space = { { "x", "y", "z" } };
+        return true;
+    }
+
+    const auto& name = mCommonGeoNames[index];
+    const auto it = std::find_if(cloud.mSpaces.begin(), cloud.mSpaces.end(), [&](const std::array<FeatureName, 3>& s) { return s[0] + s[1] + s[2] == name; });
+    if (it == cloud.mSpaces.end())
+        return false; // null handler
+
+    space = *it;
+    return true;
+}
+
+void Visualizer::onSpaceSwitched()
+{
+    // PCL rebuilt the vertices of the clouds with the points of the space, all visible: hide the filtered ones again.
+    if (!mFilters.empty() || !mPointMasks.empty())
+    {
+        for (const auto& cloud : getCurrentBundle().mClouds)
+        {
+            auto* mask = getPointMask(cloud);
+            if (!mask)
+                continue;
+
+            mask->setFilters(mFilters);
+            if (mask->getNbVisible() < mask->getNbPoints())
+                getViewer().setVisiblePoints(cloud.mCloudName, mask->getVisibleDisplayIndices());
+        }
+    }
+
+    buildPickIndices();
+}
+
+std::string Visualizer::getFiltersText() const
+{
+    if (mFilters.empty())
+        return "";
+
+    std::stringstream ss;
+    for (const auto& filter : mFilters)
+        ss << "\n\rFilter: " << filter.mMin << " <= " << filter.mFeatureName << " <= " << filter.mMax;
+
+    size_t nbVisible = 0, nbPoints = 0;
+    for (const auto& item : mPointMasks)
+    {
+        nbVisible += item.second.getNbVisible();
+        nbPoints += item.second.getNbPoints();
+    }
+    ss << " (" << nbVisible << " of " << nbPoints << " points visible)";
+
+    return ss.str();
+}
+
+double Visualizer::getLastFrameTime()
+{
+    double seconds = 0.0;
+    auto renderers = getViewer().getRendererCollection();
+    renderers->InitTraversal();
+    while (vtkRenderer* renderer = renderers->GetNextItem())
+        seconds += renderer->GetLastRenderTimeInSeconds();
+
+    return 1000.0 * seconds;
+}
+
+std::string Visualizer::getPerfText()
+{
+    const double mb = 1.0 / (1024.0 * 1024.0);
+
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1);
+    ss << "\n\rPerf: load " << mPerf.mLoadMs << " ms (waited " << mPerf.mWaitMs << " ms), " << mPerf.mNbBytes * mb << " MB, " << mPerf.mNbPoints << " points";
+    ss << "\n\rPerf: derived " << mPerf.mDerivedMs << " ms, viewer " << mPerf.mViewerMs << " ms, actors " << mPerf.mPrepareMs << " ms ("
+        << mPerf.mNbBuiltActors << " built with " << mPerf.mNbHandlers << " handlers, " << mPerf.mNbCachedActors << " cached)";
+    ss << "\n\rPerf: frame " << mPerf.mFrameMs << " ms";
+    ss << "\n\rPerf: cache " << mLoader.getMemoryUsage() * mb << " MB of files, " << getViewer().getActorCacheMemoryUsage() * mb << " MB of actors";
+
+    for (const auto& cloud : getCurrentBundle().mClouds)
+        if (cloud.mPointCloudMessage)
+            ss << "\n\r  " << cloud.mCloudName << ": " << static_cast<size_t>(cloud.mPointCloudMessage->width) * cloud.mPointCloudMessage->height << " points";
+
+    return ss.str();
+}
+
+void Visualizer::logPerf()
+{
+    mPerf.mIsLogPending = false;
+
+    std::ofstream file(mOptions.mPerfLogFile, std::ios::app);
+    if (!file)
+    {
+        logWarning("[logPerf] Could not open the performance log file '" + mOptions.mPerfLogFile + "'.");
+        mOptions.mPerfLogFile.clear(); // do not try again for every bundle
+        return;
+    }
+
+    if (file.tellp() == 0)
+        file << "bundle,timestamp,clouds,points,bytes,load_ms,wait_ms,derived_ms,viewer_ms,prepare_ms,handlers,built_actors,cached_actors,frame_ms" << std::endl;
+
+    const auto& bundle = getCurrentBundle();
+    file << std::fixed << std::setprecision(2)
+        << bundle.mName << "," << bundle.getTimestamp() << "," << bundle.mClouds.size() << "," << mPerf.mNbPoints << "," << mPerf.mNbBytes << ","
+        << mPerf.mLoadMs << "," << mPerf.mWaitMs << "," << mPerf.mDerivedMs << "," << mPerf.mViewerMs << "," << mPerf.mPrepareMs << ","
+        << mPerf.mNbHandlers << "," << mPerf.mNbBuiltActors << "," << mPerf.mNbCachedActors << "," << mPerf.mFrameMs << std::endl;
+}
+
 void Visualizer::printHelp() const
 {
     // (built-in help has been printed already)
@@ -1418,7 +3560,8 @@ void Visualizer::printHelp() const
         "                  m, M : loop through colormaps \n"
         "          SHIFT + m, M : loop through colormaps backwards \n"
         "   CTRL +         m, M : prompts user input in the console the enter min and max values for the colormap range \n"
-        "   CTRL + SHIFT + m, M : use automatic min and max values for the colormap range \n"
+        "   CTRL + SHIFT + m, M : use an automatic colormap range \n"
+        "   ALT  +         m, M : toggle automatic colormap ranges between percentiles and min and max values \n"
         "\n"
         " In IDENTIFICATION mode: \n"
         "\n"
@@ -1438,6 +3581,18 @@ void Visualizer::printHelp() const
         "\n"
         "                  t, T : toggle display of the info text \n"
         "          SHIFT + t, T : toggle background (light, dark) \n"
+        "           CTRL + t, T : toggle display of the histogram of the color handler feature \n"
+        "           ALT  + t, T : toggle display of the performance of the bundle (load, derived features, actors, frame time) in the info text \n"
+        "\n"
+        "   SHIFT + left click : show the feature values of a point in the info text \n"
+        "\n"
+        "             v, V : prompts user input in the console to enter the min and max values of the current color handler feature; points outside are hidden \n"
+        "      CTRL + v, V : remove all filters \n"
+        "           [ or ] : lower or raise the max value of the filter on the current color handler feature \n"
+        "   SHIFT + [ or ] : lower or raise the min value of the filter on the current color handler feature \n"
+        "\n"
+        "          d, D : prompts user input in the console to add a derived feature (name = expression) \n"
+        "   CTRL + d, D : remove all derived features \n"
         "\n"
     );
 }
@@ -1456,36 +3611,181 @@ int Visualizer::getViewportId(ViewportIdx viewport) const
     return isValid ? mViewportIds[viewport] : 0;
 }
 
-// TODO indexed cloud
-//void Visualizer::pointPickingEventCallback(const pcl::visualization::PointPickingEvent& event, void*)
-//{
-//    const int pickedIdx = event.getPointIndex();
-//    float x, y, z;
-//    event.getPoint(x, y, z);
-//
-//    std::cout << "Picked point #" << pickedIdx << ": (" << x << ", " << y << ", " << z << ")" << std::endl;
-//
-//    // Find corresponding point in clouds that have indexed clouds.
-//    for (auto& pair : mClouds)
-//    {
-//        auto& name = pair.first;
-//        auto& cloud = *pair.second;
-//        if (cloud.mIndexedClouds.size() > 0) // has indexed clouds
-//        {
-//            // Find the point in the current space (geometry handler).
-//            const int iGeo = getViewer().getGeometryHandlerIndex(name);
-//            const auto& space = cloud.mSpaces[iGeo];
-//            const int foundIdx = space.findPickedPointIndex(x, y, z);
-//
-//            if (foundIdx >= 0)
-//            {
-//                std::cout << "Found point #" << foundIdx << std::endl;
-//                prepareCloudsForRender(cloud.mIndexedClouds[foundIdx]);
-//
-//                // Update the main map.
-//                for (const auto& idxPair : cloud.mIndexedClouds[foundIdx])
-//                    mClouds[idxPair.first] = idxPair.second;
-//            }
-//        }
-//    }
-//}
+std::shared_ptr<const Visualizer::PickIndex> Visualizer::buildPickIndex(const pcl::PCLPointCloud2& message, const std::array<FeatureName, 3>& space)
+{
+    auto index = std::make_shared<PickIndex>();
+
+    // Invalid points are not displayed, so they cannot be picked.
+    const auto x = readFeatureValues(message, space[0]), y = readFeatureValues(message, space[1]), z = readFeatureValues(message, space[2]);
+    index->mPoints.reserve(3 * x.size());
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        if (!std::isfinite(x[i]) || !std::isfinite(y[i]) || !std::isfinite(z[i]))
+            continue;
+        index->mPoints.insert(index->mPoints.end(), { x[i], y[i], z[i] });
+        index->mPointIndices.push_back(i);
+    }
+
+    if (!index->mPointIndices.empty())
+        index->mTree.buildIndex(flann::Matrix<float>(index->mPoints.data(), index->mPointIndices.size(), 3));
+
+    return index;
+}
+
+int Visualizer::PickIndex::findPointIndex(float x, float y, float z) const
+{
+    if (mPointIndices.empty())
+        return -1;
+
+    std::vector<float> query = { x, y, z };
+    std::vector<int> index(1);
+    std::vector<float> dist(1);
+    flann::Matrix<float> queryMatrix(query.data(), 1, 3);
+    flann::Matrix<int> indexMatrix(index.data(), 1, 1);
+    flann::Matrix<float> distMatrix(dist.data(), 1, 1);
+    mTree.knnSearch(queryMatrix, indexMatrix, distMatrix, 1, flann::SearchParams());
+
+    const bool isFound = (index[0] >= 0) && (dist[0] < 1e-10); // the picked point is the displayed point, same coordinates
+    return isFound ? static_cast<int>(mPointIndices[index[0]]) : -1;
+}
+
+void Visualizer::buildPickIndices()
+{
+    std::vector<PickIndexBuilder::Source> sources;
+    for (const auto& cloud : getCurrentBundle().mClouds)
+    {
+        std::array<FeatureName, 3> space;
+        if (cloud.mPointCloudMessage && !isShape(cloud) && getDisplayedSpace(cloud, space))
+            sources.push_back({ cloud.mCloudName, cloud.mPointCloudMessage, space });
+    }
+
+    // The trees of the previous bundle are not needed anymore (one being built is finished, then dropped).
+    mPickIndices = mPickIndexBuilder.build(std::move(sources));
+}
+
+Visualizer::PickIndexBuilder::PickIndexBuilder()
+{
+    mThread = std::thread(&PickIndexBuilder::run, this);
+}
+
+Visualizer::PickIndexBuilder::~PickIndexBuilder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mIsStopped = true;
+        if (mIndices)
+            mIndices->mIsCancelled = true;
+    }
+
+    mCondition.notify_all();
+    mThread.join();
+}
+
+std::shared_ptr<Visualizer::PickIndices> Visualizer::PickIndexBuilder::build(std::vector<Source> sources)
+{
+    auto indices = std::make_shared<PickIndices>();
+    indices->mNbClouds = sources.size();
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mIndices)
+            mIndices->mIsCancelled = true;
+
+        mSources = std::move(sources);
+        mIndices = indices;
+        mIsPending = true;
+    }
+
+    mCondition.notify_all();
+    return indices;
+}
+
+void Visualizer::PickIndexBuilder::run()
+{
+    while (true)
+    {
+        std::vector<Source> sources;
+        std::shared_ptr<PickIndices> indices;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this]() { return mIsStopped || mIsPending; });
+
+            if (mIsStopped)
+                return;
+
+            sources = std::move(mSources);
+            indices = mIndices;
+            mIsPending = false;
+        }
+
+        for (const auto& source : sources)
+        {
+            if (indices->mIsCancelled)
+                break;
+
+            auto index = buildPickIndex(*source.mMessage, source.mSpace);
+
+            std::lock_guard<std::mutex> lock(indices->mMutex);
+            indices->mIndices[source.mCloudName] = index;
+        }
+    }
+}
+
+void Visualizer::pointPickingEventCallback(const pcl::visualization::PointPickingEvent& event, void*)
+{
+    if ((event.getPointIndex() < 0) || !mPickIndices)
+        return;
+
+    // The event point index is the index among the displayed points of some cloud, not the cloud point index: search the coordinates.
+    float x, y, z;
+    event.getPoint(x, y, z);
+
+    std::unordered_map<CloudName, std::shared_ptr<const PickIndex>> indices;
+    {
+        std::lock_guard<std::mutex> lock(mPickIndices->mMutex);
+        indices = mPickIndices->mIndices;
+    }
+
+    for (const auto& cloud : getCurrentBundle().mClouds)
+    {
+        const auto it = indices.find(cloud.mCloudName);
+        const int pointIdx = (it != indices.end()) ? it->second->findPointIndex(x, y, z) : -1;
+        if (pointIdx >= 0)
+        {
+            std::cout << "[Visualizer] Picked point #" << pointIdx << " of [" << cloud.mCloudName << "]: (" << x << ", " << y << ", " << z << ")" << std::endl;
+            mPickedCloudName = cloud.mCloudName;
+            mPickedPointIdx = pointIdx;
+            mIsRenderDirty = true;
+            getViewer().interruptSpin();
+            return;
+        }
+    }
+
+    if (indices.size() < mPickIndices->mNbClouds)
+        logWarning("[pointPickingEventCallback] The clouds are still being indexed, pick again in a moment.");
+    else
+        logWarning("[pointPickingEventCallback] The picked point is not a point of the bundle clouds.");
+}
+
+std::string Visualizer::getPickedPointText() const
+{
+    if (mPickedCloudName.empty())
+        return "";
+
+    const auto& clouds = getCurrentBundle().mClouds;
+    const auto cloudIt = std::find_if(clouds.begin(), clouds.end(), [&](const Cloud& cloud) { return cloud.mCloudName == mPickedCloudName; });
+    if ((cloudIt == clouds.end()) || !cloudIt->mPointCloudMessage)
+        return "";
+
+    const auto& message = *cloudIt->mPointCloudMessage;
+    if (mPickedPointIdx >= static_cast<size_t>(message.width) * message.height)
+        return "";
+
+    const size_t nbFeaturesPerLine = 6;
+    std::stringstream ss;
+    ss << "\n\rPicked point #" << mPickedPointIdx << " (" << mPickedCloudName << ")";
+    for (size_t i = 0; i < message.fields.size(); ++i)
+        ss << ((i % nbFeaturesPerLine == 0) ? "\n\r  " : ", ") << message.fields[i].name << ": " << getPointFieldText(message, message.fields[i], mPickedPointIdx);
+
+    return ss.str();
+}
@@ -2,16 +2,38 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <pcl/pcl_base.h>
 #include <pcl/point_types.h>
 #include <pcl/visualization/pcl_visualizer.h>
 
+#include <vtkPolyData.h>
+
 #include <flann/flann.h> // TODO put this with spaces
 
+#include "VisualizerEncoding.h"
+#include "VisualizerExpression.h"
+#include "VisualizerFilter.h"
+#include "VisualizerHistogram.h"
+#include "VisualizerLive.h"
+#include "VisualizerLoader.h"
+
 namespace pcv
 {
     using CloudName = std::string;
@@ -66,32 +88,188 @@ namespace pcv
         };
     };
 
+    // Points of a space, one per point with valid x, y, z: the same points as the PCL color handlers color, so that
+    // the colors match the points whatever the space (the PCL handler skips the points with invalid coordinates in the space).
+    // Coordinates that are not valid in the space are 0.
+    class PointCloudGeometryHandlerSpace : public pcl::visualization::PointCloudGeometryHandler<pcl::PCLPointCloud2>
+    {
+    public:
+        PointCloudGeometryHandlerSpace(const PointCloudConstPtr &cloud, const std::array<std::string, 3>& space) :
+            pcl::visualization::PointCloudGeometryHandler<pcl::PCLPointCloud2>(cloud), mSpace(space) {}
+
+        virtual std::string getName() const override { return "PointCloudGeometryHandlerSpace"; }
+        virtual std::string getFieldName() const override { return mSpace[0] + mSpace[1] + mSpace[2]; }
+        virtual void getGeometry(vtkSmartPointer<vtkPoints> &points) const override;
+
+    private:
+        std::array<std::string, 3> mSpace;
+    };
+
+    // Computes the colors of another handler once and keeps them, so that switching color
+    // handlers (numkeys) only changes the active scalars array of the cloud actor.
+    class PointCloudColorHandlerCached : public pcl::visualization::PointCloudColorHandler<pcl::PCLPointCloud2>
+    {
+    public:
+        PointCloudColorHandlerCached(const PointCloudConstPtr &cloud, const ColorHandlerConstPtr& handler) :
+            pcl::visualization::PointCloudColorHandler<pcl::PCLPointCloud2>(cloud), mHandler(handler) { capable_ = handler->isCapable(); }
+
+        virtual std::string getName() const override { return mHandler->getName(); }
+        virtual std::string getFieldName() const override { return mHandler->getFieldName(); }
+        virtual bool getColor(vtkSmartPointer<vtkDataArray> &scalars) const override
+        {
+            if (!mScalars)
+                mIsColorValid = mHandler->getColor(mScalars);
+
+            scalars = mScalars;
+            return mIsColorValid;
+        }
+
+        size_t getMemorySize() const { return mScalars ? mScalars->GetActualMemorySize() * 1024 : 0; } // 0 if never displayed
+
+    private:
+        ColorHandlerConstPtr mHandler;
+        mutable vtkSmartPointer<vtkDataArray> mScalars;
+        mutable bool mIsColorValid{ false };
+    };
+
+    // Points of a space are only extracted the first time it is displayed; switching back to it reuses them.
+    class PointCloudGeometryHandlerCached : public pcl::visualization::PointCloudGeometryHandler<pcl::PCLPointCloud2>
+    {
+    public:
+        PointCloudGeometryHandlerCached(const PointCloudConstPtr &cloud, const GeometryHandlerConstPtr& handler) :
+            pcl::visualization::PointCloudGeometryHandler<pcl::PCLPointCloud2>(cloud), mHandler(handler) { capable_ = handler->isCapable(); }
+
+        virtual std::string getName() const override { return mHandler->getName(); }
+        virtual std::string getFieldName() const override { return mHandler->getFieldName(); }
+        virtual void getGeometry(vtkSmartPointer<vtkPoints> &points) const override
+        {
+            if (!mPoints)
+                mHandler->getGeometry(mPoints);
+
+            points = mPoints;
+        }
+
+        const vtkSmartPointer<vtkPoints>& getPoints() const { return mPoints; } // null if never displayed
+        size_t getMemorySize() const { return mPoints ? mPoints->GetActualMemorySize() * 1024 : 0; }
+
+    private:
+        GeometryHandlerConstPtr mHandler;
+        mutable vtkSmartPointer<vtkPoints> mPoints;
+    };
+
     // This class allows using protected stuff from PCLVisualizer.
     class PclVisualizer : public pcl::visualization::PCLVisualizer
     {
     public:
-        PclVisualizer(const std::string& name) : pcl::visualization::PCLVisualizer(name) {}
+        PclVisualizer(const std::string& name, bool createInteractor = true) : pcl::visualization::PCLVisualizer(name, createInteractor) {}
         void filterHandlers(const std::string &id);
         int getGeometryHandlerIndex(const std::string &id);
         bool setColormapRangeAuto(const std::string &id);
+
+        /// Make the current spinOnce return without waiting for its time to elapse.
+        void interruptSpin();
+
+        /// Remove a point cloud from the viewer, keeping its actor (geometry, handlers) to add it back without rebuilding it.
+        /// @param[in] id: the point cloud id
+        /// @param[in] key: identifies the state of the actor, to add it back only in the same conditions
+        /// @param[in] extraBytes: memory held by the actor that is not in its geometry (the message of its handlers)
+        /// @param[in] viewport: the viewport id of the point cloud
+        void removePointCloudToCache(const std::string& id, const std::string& key, size_t extraBytes, int viewport);
+
+        /// Add back a point cloud removed with removePointCloudToCache. Returns false if it is not cached anymore.
+        bool addPointCloudFromCache(const std::string& id, const std::string& key, int viewport);
+
+        /// Memory that cached actors may use, least recently used first out.
+        void setActorCacheBudget(size_t bytes);
+        size_t getActorCacheMemoryUsage() const { return mCachedActorsBytes; }
+
+        /// Render and write the window to a PNG file. Unlike saveScreenshot, it does not need an interactor (batch mode has none).
+        bool saveImage(const std::string& filename);
+
+        /// Read a camera file saved by PCL (CTRL + s, or saveCameraParameters), without the interactor loadCameraParameters needs.
+        /// Returns false if the file cannot be read. The window size and position of the file are not read.
+        static bool readCameraFile(const std::string& filename, pcl::visualization::Camera& camera);
+
+        /// Only display some points of a point cloud, without rebuilding its geometry nor its colors.
+        /// @param[in] id: the point cloud id
+        /// @param[in] displayIndices: indices of the points to display, among the points of the geometry (points with valid coordinates)
+        bool setVisiblePoints(const std::string& id, const std::vector<size_t>& displayIndices);
+        bool setAllPointsVisible(const std::string& id); // all the points of the geometry
+
+        /// Add a lines cloud as one shape: a single polydata with a segment and a color per line, built in one pass over the message.
+        /// Returns false if the shape already exists or if the message is not a lines cloud (x y z x2 y2 z2 as floats; rgb is optional).
+        /// @param[in] message: one line per point
+        /// @param[in] id: the shape id
+        /// @param[in] viewport: where to add it
+        bool addLines(const pcl::PCLPointCloud2& message, const std::string& id, int viewport);
+
+        /// The polydata of addLines: 2 points, a line cell and an rgb cell color per line. Null if the message is not a lines cloud.
+        static vtkSmartPointer<vtkPolyData> createLinesPolyData(const pcl::PCLPointCloud2& message);
+
+    private:
+        struct CachedActor
+        {
+            std::string mKey;
+            pcl::visualization::CloudActor mActor;
+            size_t mBytes{ 0 };
+        };
+
+        void evictCachedActors();
+        void addActorToViewport(vtkProp* actor, int viewport); // viewport 0 for all
+
+        std::list<CachedActor> mCachedActors; // most recently used first
+        std::unordered_map<std::string, std::list<CachedActor>::iterator> mCachedActorsByKey;
+        size_t mCachedActorsBytes{ 0 };
+        size_t mActorCacheBudget{ 512 * 1024 * 1024 };
+    };
+
+    struct VisualizerOptions
+    {
+        int mPrefetchDepth{ 2 }; // number of bundles loaded in advance on each side of the current bundle
+        int mCacheSizeMb{ 1024 }; // memory for recently viewed clouds, half for loaded files and half for built actors
+        bool mFollow{ false }; // add the files written in the folder while the viewer is open
+        bool mFollowNewest{ true }; // when following, switch to the newest bundle when one is added
+        std::vector<std::string> mFeatureExpressions; // derived features of all bundles, "name = expression" (see FeatureExpression)
+        float mColormapPercentile{ 1.0f }; // automatic colormap ranges go from this percentile to 100 minus it (0 for the min and max values)
+        std::string mPerfLogFile; // if not empty, append the performance of each displayed bundle to this file (CSV)
+        std::string mLiveRingName; // if not empty, display the clouds published to this live ring (see VisualizerData::setLiveEnabled)
+
+        // Batch mode: render bundles to PNG files offscreen, without window nor interaction.
+        std::string mBatchFolder; // batch mode if not empty, where to write the images
+        std::string mBatchFilter; // only render bundles whose name contains this
+        std::string mBatchCameraFile; // camera parameters (.cam file saved by PCL); the camera fits the bundle if empty
+        int mBatchWidth{ 1280 };
+        int mBatchHeight{ 720 };
+        int mBatchWorker{ 0 }; // this process renders one bundle out of mBatchNbWorkers, starting at this one
+        int mBatchNbWorkers{ 1 };
     };
 
     class Visualizer
     {
     public:
-        Visualizer(const FileName& fileName);
-        Visualizer(const std::vector<FileName>& fileName) : Visualizer(fileName.back()) {};
+        using Options = VisualizerOptions;
+
+        Visualizer(const FileName& fileName, const Options& options = Options());
+        Visualizer(const std::vector<FileName>& fileName, const Options& options = Options()) : Visualizer(fileName.back(), options) {};
 
         PclVisualizer& getViewer();
 
-    private:
-        struct BundleSwitchInfo
+        /// Identifies the content of a file, to notice that it was rewritten: its size, last write time and file id (inode).
+        /// The id catches the rewrites that the time may miss, as Cloud::save renames a new file over the old one.
+        struct FileVersion
         {
-            int mSwitchToBundleIdx{ 0 };
-            int mColorHandle{ 0 };
-            pcl::visualization::Camera mCamParams;
+            static FileVersion get(const boost::filesystem::path& path); // all 0 if the file cannot be read
+
+            bool operator==(const FileVersion& other) const { return (mSize == other.mSize) && (mTimeNs == other.mTimeNs) && (mFileId == other.mFileId); }
+            bool operator!=(const FileVersion& other) const { return !(*this == other); }
+            std::string toString() const { return std::to_string(mSize) + "|" + std::to_string(mTimeNs) + "|" + std::to_string(mFileId); }
+
+            uintmax_t mSize{ 0 };
+            int64_t mTimeNs{ 0 }; // since the epoch, in nanoseconds
+            uint64_t mFileId{ 0 };
         };
 
+        // Clouds and bundles, as read from the files (public for tools like VisualizerBench).
         struct CloudRenderingProperties
         {
             int mSize{ 1 };
@@ -105,6 +283,25 @@ namespace pcv
             enum class EType {ePoints, eLines, ePlane, eSphere, eCylinder};
 
             void parseFileHeader();
+            void parseHeaderLine(const std::string& line);
+
+            /// Read the comment lines at the beginning of a PCD file, without reading the rest of the file.
+            static std::vector<std::string> readFileHeader(const std::string& filename);
+            static std::vector<std::string> readFileHeader(const char* pBegin, const char* pEnd); // PCD content in memory
+
+            /// Load the point cloud message, expanding encoded features back to float.
+            void load();
+            pcl::PCLPointCloud2::Ptr loadMessage() const; // thread safe, does not modify the cloud
+
+            /// Read a PCD from memory (a mapped file, a live record) with the PCL reader, expanding encoded features. Returns false if it is not a valid PCD.
+            bool parseMessage(const char* pBegin, const char* pEnd, pcl::PCLPointCloud2& message) const;
+
+            /// Expand the encoded features of a message to float. Its points are laid out as in the file, in its data or at pData.
+            void expandEncodedFields(pcl::PCLPointCloud2& message, const uint8_t* pData = nullptr) const;
+            bool hasEncodedFields(const pcl::PCLPointCloud2& message) const;
+
+            /// Identifies the content of the file, which may be rewritten: key of the loaded message and of the actor in their caches.
+            std::string getFileKey() const { return mFullName + "|" + mFileVersion.toString(); }
 
             std::string mFullName;
             std::string mFileName;
@@ -113,10 +310,16 @@ namespace pcv
             std::string mCloudName;
             EType mType{ EType::ePoints };
             int mViewport{ 0 };
+            FileVersion mFileVersion; // when its header was read; all 0 for a live cloud
 
             CloudRenderingProperties mRenderingProperties;
+            std::map<std::string, FeatureEncoding> mEncodings;
+            std::vector<std::array<FeatureName, 3>> mSpaces; // coordinates of each space (geometry handler), in order of definition
+            std::map<std::string, FeatureStats> mFeatureStats;
+            std::map<std::string, FeatureHistogram> mHistograms; // of the loaded message, by feature, computed when needed
 
             pcl::PCLPointCloud2::Ptr mPointCloudMessage;
+            pcl::PCLPointCloud2::Ptr mLiveMessage; // received from a live ring, loaded instead of the file
         };
 
         using Clouds = std::vector<Cloud>;
@@ -124,13 +327,26 @@ namespace pcv
         struct Bundle
         {
             std::string getTimestamp() const { return mClouds.front().mTimeStamp; }
+            void addCloud(const Cloud& cloud) { mClouds.push_back(cloud); mCloudNames.insert(cloud.mCloudName); }
+            bool hasCloud(const std::string& cloudName) const { return mCloudNames.count(cloudName) > 0; }
+
             std::string mName;
             Clouds mClouds;
+            std::unordered_set<std::string> mCloudNames; // names of mClouds, for fast lookup
             int mScopeDepth{ 0 };
+            bool mIsCompare{ false }; // clouds of other bundles, compared to each other
         };
 
         using Bundles = std::vector<Bundle>;
 
+    private:
+        struct BundleSwitchInfo
+        {
+            int mSwitchToBundleIdx{ 0 };
+            int mColorHandle{ 0 };
+            pcl::visualization::Camera mCamParams;
+        };
+
         /// Add to draw a 3d basis (3 RGB vectors) at a specified location.
         /// @param[in] u1: 3d vector of the x axis (red)
         /// @param[in] u2: 3d vector of the y axis (green)
@@ -142,14 +358,17 @@ namespace pcv
         void addBasis(const Eigen::Vector3f& u1, const Eigen::Vector3f& u2, const Eigen::Vector3f& u3, const Eigen::Vector3f& origin, const std::string& name, double scale = 1.0, ViewportIdx viewport= 0);
 
         /// Render current state: consolidate data, save files and generate visualization window (blocks code execution).
-        /// @param[in] bundle: the bundle of clouds to render
-        void render(const Bundle& bundle);
+        void render();
 
         /// Specify some features to render first (put them first in the list of features), in specified order; all other features will keep their default order.
         /// @param[in] names: array of the ordered features to put first in the features list
         void setFeaturesOrder(const std::vector<FeatureName>& names);
 
         void prepareCloudsForRender(const Clouds& clouds);
+        void removeCloudsFromRender(const Clouds& clouds);
+        void setPointCloudRenderingProperties(const Cloud& cloud);
+        size_t getCacheLevelBudget() const { return static_cast<size_t>(std::max(0, mOptions.mCacheSizeMb)) * 1024 * 1024 / 2; } // loaded files and built actors
+        std::string getCloudActorCacheKey(const Cloud& cloud) const;
 
         const Bundle& getCurrentBundle() const;
         Bundle& getCurrentBundle();
@@ -159,20 +378,22 @@ namespace pcv
         void logWarning(const std::string& msg) const { std::cout << "[VISUALIZER][WARNING]" << msg << std::endl; }
 
         std::vector<ColorHandlerConstPtr> generateColorHandlers(const pcl::PCLPointCloud2::Ptr pclCloudMsg) const;
-        std::vector<GeometryHandlerConstPtr> generateGeometryHandlers(const pcl::PCLPointCloud2::Ptr pclCloudMsg) const;
+        std::vector<GeometryHandlerConstPtr> generateGeometryHandlers(const Cloud& cloud) const;
         void generateCommonHandlersLists(const Clouds& clouds);
 
         int getViewportId(ViewportIdx viewport) const;
 
         // Interactivity
         void keyboardEventCallback(const pcl::visualization::KeyboardEvent& event, void*);
-        //void pointPickingEventCallback(const pcl::visualization::PointPickingEvent& event, void*);
+        void pointPickingEventCallback(const pcl::visualization::PointPickingEvent& event, void*);
         void identifyClouds(bool enabled, bool back);
         void editColorMap(const pcl::visualization::KeyboardEvent& e);
+        void editFilters(const pcl::visualization::KeyboardEvent& e);
         void printHelp() const;
         void changeCurrentCloudOpacity(double delta);
         void changeCurrentCloudSize(double delta);
         int determineNextBundleIdx(int step);
+        int getNextBundleIdx(int fromIdx, int step) const;
 
         void setColormapSource(const std::string& id);
 
@@ -185,13 +406,144 @@ namespace pcv
 
         static void getBundleViewportLayout(const Bundle& bundle, int& nbRows, int& nbCols);
         int getColorHandlerIndex();
+        std::string getFeatureStatsText(int colorIdx) const;
+        std::string getHistogramText(int colorIdx);
+
+        const FeatureHistogram& getFeatureHistogram(Cloud& cloud, const FeatureName& name);
+        void applyColormapRanges(int colorIdx); // percentile ranges of the color handler feature, for the clouds without a range set by the user
 
         void switchBundle();
+        void prefetchBundles();
+        void prefetchBundles(const std::vector<int>& bundleIndices); // most important first
+        void renderBatch();
+        bool isBatchMode() const { return !mOptions.mBatchFolder.empty(); }
         void printBundleStack();
 
         void generateBundles(const FileName& fileName);
+        std::vector<boost::filesystem::path> listNewFiles(std::vector<boost::filesystem::path>* changedPaths = nullptr); // files of the folder not seen yet, and those rewritten since
+        void updateChangedFiles(const std::vector<boost::filesystem::path>& paths); // their clouds are read again
+        bool addFiles(const std::vector<boost::filesystem::path>& paths); // returns true if headers were added to the index
+        void followFolder();
+        void onBundlesAdded(int nbBundlesBefore, size_t nbCurrentCloudsBefore); // switch to the newest bundle, or refresh the current one
+
+        // Live: clouds published by running processes through shared memory, added like the files of the folder.
+        void receiveLiveClouds();
+        void dropLiveMessages(); // oldest first, over the memory budget; their clouds are loaded from their file, kept if not saved
+        std::shared_ptr<LiveRing> mLiveRing; // null until the publishing process created it
+        std::chrono::steady_clock::time_point mLastLiveAttachTime;
+        std::deque<std::pair<int, CloudName>> mLiveClouds; // bundle index, cloud name, in order of reception
+        size_t mLiveBytes{ 0 };
+
+        // Header comments of the files of a folder, saved in the folder so that unchanged files are not read again.
+        struct HeaderIndexEntry
+        {
+            FileVersion mVersion;
+            std::vector<std::string> mLines;
+        };
+
+        using HeaderIndex = std::unordered_map<std::string, HeaderIndexEntry>; // by file name
+
+        static HeaderIndex loadHeaderIndex(const boost::filesystem::path& folder);
+        static void saveHeaderIndex(const boost::filesystem::path& folder, const HeaderIndex& index);
+        static const std::string sHeaderIndexFileName;
+        HeaderIndex mHeaderIndex;
+        std::unordered_map<std::string, FileVersion> mKnownFiles; // files already added to the bundles (or invalid), by file name; all 0 for a live cloud whose file was not listed yet
+        std::chrono::steady_clock::time_point mLastFollowTime;
+
+        // A file of the folder, with its name and header parsed.
+        struct FileEntry
+        {
+            Cloud mCloud;
+            HeaderIndexEntry mHeader;
+            bool mIsIndexed{ false }; // header taken from the index
+            bool mIsCompare{ false };
+            bool mIsValid{ false };
+            std::vector<std::string> mCompareTokens; // bundle scope, command, compare elements, search string, cloud name
+        };
+
+        static bool parseFileName(const boost::filesystem::path& path, FileEntry& entry); // false if not a visualizer file name
+        static std::vector<FileEntry> parseFiles(const std::vector<boost::filesystem::path>& paths, const HeaderIndex& index,
+            const std::atomic<bool>* isStopped = nullptr); // in parallel, thread safe; the entries not parsed when stopped are not valid
+        bool assembleFiles(std::vector<FileEntry>& entries); // into bundles; returns true if headers were added to the index
+
+        // Startup on a file: its bundle is displayed first, while the files of the folder are parsed in background.
+        struct Catalog
+        {
+            HeaderIndex mHeaderIndex; // loaded from the folder
+            std::vector<FileEntry> mEntries; // all files of the folder
+        };
+
+        /// Parse the files of a folder in a thread, stopped when destroyed so that exiting does not wait for it.
+        class CatalogLoader
+        {
+        public:
+            ~CatalogLoader();
+
+            void start(const boost::filesystem::path& folder, const std::vector<boost::filesystem::path>& paths);
+            bool isPending() const { return mThread.joinable(); } // started, and not taken yet
+            bool isReady() const { return mIsReady; }
+            Catalog take(); // once ready
+
+        private:
+            std::atomic<bool> mIsStopped{ false };
+            std::atomic<bool> mIsReady{ false };
+            Catalog mCatalog;
+            std::thread mThread;
+        };
+
+        /// Generate the bundle of a file from the files of its folder, only reading the headers of that bundle,
+        /// then start parsing all the files in background. Returns false if the bundle of the file cannot be found that way.
+        /// @param[in] file: the file to display first
+        /// @param[in] paths: the files of the folder
+        bool generateFileBundle(const boost::filesystem::path& file, const std::vector<boost::filesystem::path>& paths);
+        static std::vector<boost::filesystem::path> getBundleSiblings(const boost::filesystem::path& file, const std::vector<boost::filesystem::path>& paths); // from the file names
+        void mergeCatalog(); // replace the bundles by those of the whole folder, keeping the current one as it is
+        CatalogLoader mCatalog; // pending while the folder is parsed in background
+
         void addCloudToBundle(const Cloud& newCloud);
+        void pushBundle(const Bundle& bundle);
         void createCompareBundle(const std::string& bundleScope, const std::string& bundleSearchStr, const std::string& bundleCompareStr, const std::string& compareCloudName);
+        int getLastBundleIdxWithSuffix(const std::string& suffix); // -1 if none
+
+        /// Add features comparing each cloud of a compare bundle to the first one (to the second, for the first):
+        /// the distance to the nearest point of the other cloud, and the difference with its value for each shared feature.
+        void addCompareFeatures(Bundle& bundle) const;
+
+        /// Add the derived features to the clouds of the current bundle (compare features, then feature expressions).
+        /// They are computed once per bundle, then cached with the loaded files.
+        void addDerivedFeatures();
+        void addExpressionFeatures(Bundle& bundle) const;
+        bool hasDerivedFeatures(const Bundle& bundle) const { return bundle.mIsCompare || !mFeatureExpressions.empty(); }
+        std::string getDerivedFeaturesKey(const Cloud& cloud) const; // cache key of a cloud of the current bundle with its derived features
+        bool addFeatureExpression(const std::string& definition); // replaces the expression of the same name, if any
+        void editFeatureExpressions(bool clear);
+
+        // Filters on feature ranges, hiding points of the displayed clouds.
+        void applyFilters(); // to the clouds of the current bundle, updating only what changed
+        bool getFeatureRange(const std::string& name, float& min, float& max); // over the clouds of the current bundle
+        PointMask* getPointMask(const Cloud& cloud); // null if not a point cloud, or if nothing is displayed in its space
+        std::string getFiltersText() const;
+
+        // Where the time of a bundle switch goes, shown in the info text (ALT + t) and logged to mOptions.mPerfLogFile.
+        struct BundlePerf
+        {
+            double mLoadMs{ 0.0 };     // reading and decoding the files, in background when prefetched
+            double mWaitMs{ 0.0 };     // waiting for the loader in the switch (files not prefetched yet)
+            double mDerivedMs{ 0.0 };  // compare features and feature expressions
+            double mViewerMs{ 0.0 };   // creating or clearing the window
+            double mPrepareMs{ 0.0 };  // actors: handlers and geometry of point clouds, shapes
+            double mFrameMs{ 0.0 };    // last frame rendered by VTK, all viewports
+            size_t mNbBytes{ 0 };      // loaded messages of the bundle
+            size_t mNbPoints{ 0 };
+            int mNbHandlers{ 0 };      // color and geometry handlers created
+            int mNbBuiltActors{ 0 };
+            int mNbCachedActors{ 0 };  // reused from the actor cache
+            bool mIsLogPending{ false }; // logged once the first frame is rendered
+        };
+
+        double getLastFrameTime(); // in ms
+        std::string getPerfText();
+        void logPerf();
 
         static bool hasCloudNameInBundle(const Bundle& bundle, const std::string& cloudName);
 
@@ -204,13 +556,81 @@ namespace pcv
 
         static bool isShape(const Cloud& cloud);
 
+        // Space displayed for a cloud (ALT + number), with which PCL rebuilds the displayed points (those with valid coordinates).
+        bool getDisplayedSpace(const Cloud& cloud, std::array<FeatureName, 3>& space); // false if the cloud has nothing in this space
+        void onSpaceSwitched(); // the visible points and the pick indices depend on the displayed points
+
+        // Point picking: search tree of the points of a cloud, to find the cloud point of a picked (displayed) point.
+        struct PickIndex
+        {
+            int findPointIndex(float x, float y, float z) const; // -1 if not a point of the cloud
+
+            flann::Index<flann::L2<float>> mTree{ flann::KDTreeSingleIndexParams() }; // optimized for 3D, gives exact result
+            std::vector<float> mPoints; // x, y, z of the valid points, used by the tree
+            std::vector<size_t> mPointIndices; // cloud point index of each tree point
+        };
+
+        // Search trees of the clouds of a bundle, built in a background thread.
+        struct PickIndices
+        {
+            std::mutex mMutex;
+            std::unordered_map<CloudName, std::shared_ptr<const PickIndex>> mIndices; // only the trees already built
+            size_t mNbClouds{ 0 }; // number of trees to build
+            std::atomic<bool> mIsCancelled{ false }; // the bundle is not displayed anymore
+        };
+
+        // Builds the pick indices in a single background thread, like CloudLoader: the trees of large clouds take seconds
+        // to build, switching bundles must not wait for them. Only the latest request is built; the previous ones are dropped.
+        class PickIndexBuilder
+        {
+        public:
+            struct Source
+            {
+                CloudName mCloudName;
+                pcl::PCLPointCloud2::Ptr mMessage;
+                std::array<FeatureName, 3> mSpace; // of the displayed points
+            };
+
+            PickIndexBuilder();
+            ~PickIndexBuilder(); // once the tree being built is finished
+
+            /// Build the indices of clouds, cancelling the previous request; they are added to the returned indices once built.
+            std::shared_ptr<PickIndices> build(std::vector<Source> sources);
+
+        private:
+            void run();
+
+            std::mutex mMutex;
+            std::condition_variable mCondition;
+            bool mIsStopped{ false };
+            bool mIsPending{ false }; // the latest request is not started yet
+
+            std::vector<Source> mSources; // of the latest request
+            std::shared_ptr<PickIndices> mIndices; // of the latest request
+
+            std::thread mThread;
+        };
+
+        static std::shared_ptr<const PickIndex> buildPickIndex(const pcl::PCLPointCloud2& message, const std::array<FeatureName, 3>& space);
+        void buildPickIndices(); // of the current bundle, in its displayed spaces, in background
+        std::string getPickedPointText() const; // feature values of the picked point, for the info text
+
         std::shared_ptr<PclVisualizer> mViewer;
         std::vector<int> mViewportIds;
 
         Bundles mBundles;
+        std::unordered_map<std::string, int> mLastBundleIdxByName; // index of the most recent bundle with a given name
+        std::unordered_map<std::string, int> mLastBundleIdxBySuffix; // same, by name suffix, for the suffixes searched by compare bundles
         int mCurrentBundleIdx{ 0 };
+        int mNavigationStep{ 1 }; // last navigation step, its sign gives the direction in which to prefetch
         BundleSwitchInfo mBundleSwitchInfo;
 
+        Options mOptions;
+        CloudLoader mLoader;
+        std::vector<FeatureExpression> mFeatureExpressions;
+        std::vector<FeatureFilter> mFilters;
+        std::unordered_map<CloudName, PointMask> mPointMasks; // of the clouds of the current bundle
+
         bool mSameBundleNavigationMode{ false };
         int mSameBundleNavigationDepth{ 1 };
 
@@ -222,7 +642,18 @@ namespace pcv
         int mIdentifiedCloudIdx{ -1 };
         std::string mColormapSourceId;
 
+        BundlePerf mPerf; // of the current bundle
+
+        PickIndexBuilder mPickIndexBuilder;
+        std::shared_ptr<PickIndices> mPickIndices; // of the current bundle
+        CloudName mPickedCloudName; // empty if no point is picked
+        size_t mPickedPointIdx{ 0 };
+
         bool mShowInfoText{ true };
+        bool mShowHistogram{ false };
+        bool mShowPerf{ false };
+        bool mUsePercentileRange{ true }; // automatic colormap ranges from percentiles, rather than min and max values
+        bool mIsRenderDirty{ true }; // the info text and synced properties must be updated
         float mBackgroundGrayLevel{ 0.1 };
 
         std::map<CloudName, CloudRenderingProperties> mProperties;
@@ -2,29 +2,145 @@
 
 #include <math.h>
 #include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <boost/filesystem.hpp>
+
 #include "Visualizer.h"
+#include "VisualizerJournal.h"
 
 using namespace pcv;
 
+namespace
+{
+    // Batch mode over many processes: run this executable once per worker, with the same arguments.
+    int renderBatchWorkers(const std::string& executable, const std::vector<std::string>& args, const std::string& folder, int nbWorkers)
+    {
+        namespace fs = boost::filesystem;
+
+        auto countImages = [&]()
+        {
+            int count = 0;
+            boost::system::error_code ec;
+            if (fs::is_directory(folder, ec))
+                for (const auto& it : boost::make_iterator_range(fs::directory_iterator(folder), {}))
+                    count += (it.path().extension() == ".png");
+            return count;
+        };
+
+        const int nbImagesBefore = countImages();
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> workers;
+        std::vector<int> results(nbWorkers, 0);
+        for (int k = 0; k < nbWorkers; ++k)
+        {
+            std::string command = "\"" + executable + "\"";
+            for (const auto& arg : args)
+                command += " \"" + arg + "\"";
+            command += " --worker " + std::to_string(k) + " " + std::to_string(nbWorkers);
+#ifdef _WIN32
+            command = "\"" + command + "\""; // cmd strips the outer quotes
+#endif
+            workers.emplace_back([command, &results, k]() { results[k] = std::system(command.c_str()); });
+        }
+
+        for (auto& worker : workers)
+            worker.join();
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const int nbImages = countImages() - nbImagesBefore; // new images; overwritten ones are not counted
+        std::cout << "[Visualizer] " << nbWorkers << " workers rendered " << nbImages << " new images in " << std::fixed << std::setprecision(2) << seconds << " s ("
+            << (seconds > 0.0 ? nbImages / seconds : 0.0) << " bundles/s)." << std::endl;
+
+        return std::all_of(results.begin(), results.end(), [](int r) { return r == 0; }) ? 0 : 1;
+    }
+}
+
 int main(int argc, char* argv[])
 {
     std::vector<std::string> files;
     files.reserve(argc);
 
-    if (argc > 1)
+    // Recovery tool: VisualizerApp --recover [folder]
+    if ((argc > 1) && (std::string(argv[1]) == "--recover"))
     {
-        for(int i = 1; i < argc; i++)
-            files.push_back(argv[i]);
+        const std::string folder = (argc > 2) ? argv[2] : VisualizerData::sFolder;
+        std::cout << "[Visualizer] Recovered " << Journal::recoverFolder(folder) << " clouds in '" << folder << "'." << std::endl;
+        return 0;
     }
-    else
+
+    Visualizer::Options options;
+    std::vector<std::string> workerArgs; // batch mode: arguments of the worker processes (all but --jobs)
+    int nbJobs = 1;
+    for (int i = 1; i < argc; i++)
     {
-        files.push_back("../");
+        const std::string arg = argv[i];
+        if ((arg == "--jobs") && (i + 1 < argc))
+        {
+            nbJobs = std::max(1, std::atoi(argv[++i])); // batch mode: number of processes
+            continue;
+        }
+
+        const int first = i;
+
+        if ((arg == "--prefetch") && (i + 1 < argc))
+            options.mPrefetchDepth = std::max(0, std::atoi(argv[++i])); // number of bundles loaded in advance on each side
+        else if ((arg == "--cache-mb") && (i + 1 < argc))
+            options.mCacheSizeMb = std::max(0, std::atoi(argv[++i])); // memory for recently viewed clouds
+        else if (arg == "--follow")
+            options.mFollow = true; // add the new files of the folder, switch to the newest bundle
+        else if (arg == "--follow-stay")
+        {
+            options.mFollow = true; // add the new files of the folder, stay on the current bundle
+            options.mFollowNewest = false;
+        }
+        else if ((arg == "--feature") && (i + 1 < argc))
+            options.mFeatureExpressions.push_back(argv[++i]); // derived feature, "name = expression"
+        else if ((arg == "--colormap-percentile") && (i + 1 < argc))
+            options.mColormapPercentile = static_cast<float>(std::atof(argv[++i])); // automatic colormap ranges, 0 for min and max values
+        else if ((arg == "--perf-log") && (i + 1 < argc))
+            options.mPerfLogFile = argv[++i]; // append the performance of each displayed bundle to this CSV file
+        else if (arg == "--live") // display the clouds published by running processes (VisualizerData::setLiveEnabled)
+        {
+            const bool hasName = (i + 1 < argc) && (std::string(argv[i + 1]).compare(0, 2, "--") != 0) && !boost::filesystem::exists(argv[i + 1]);
+            options.mLiveRingName = hasName ? argv[++i] : LiveRing::sDefaultName;
+        }
+        else if ((arg == "--batch") && (i + 1 < argc))
+            options.mBatchFolder = argv[++i]; // render all bundles to PNG files in this folder, offscreen
+        else if ((arg == "--filter") && (i + 1 < argc))
+            options.mBatchFilter = argv[++i];
+        else if ((arg == "--camera") && (i + 1 < argc))
+            options.mBatchCameraFile = argv[++i];
+        else if ((arg == "--size") && (i + 2 < argc))
+        {
+            options.mBatchWidth = std::max(1, std::atoi(argv[++i]));
+            options.mBatchHeight = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((arg == "--worker") && (i + 2 < argc)) // set by --jobs
+        {
+            options.mBatchWorker = std::atoi(argv[++i]);
+            options.mBatchNbWorkers = std::max(1, std::atoi(argv[++i]));
+        }
+        else
+            files.push_back(arg);
+
+        workerArgs.insert(workerArgs.end(), argv + first, argv + i + 1); // with the option values
     }
 
-    Visualizer app(files.back()); // if many files, take last file (probably most recent)
+    if (files.empty())
+        files.push_back("../");
+
+    if (!options.mBatchFolder.empty() && (nbJobs > 1))
+        return renderBatchWorkers(argv[0], workerArgs, options.mBatchFolder, nbJobs);
+
+    Visualizer app(files.back(), options); // if many files, take last file (probably most recent)
 
     return 0;
 }
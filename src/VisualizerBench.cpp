@@ -0,0 +1,361 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <pcl/pcl_base.h>
+#include <pcl/point_types.h>
+#include <pcl/io/pcd_io.h>
+
+#include "Visualizer.h"
+#include "VisualizerData.h"
+
+// Micro-benchmarks of the capture (VisualizerData), save and load paths.
+//
+// Usage: VisualizerBench [--out results.json] [--max-points N] [--max-features N] [--filter text]
+//
+// The results are written as JSON, using the same layout as Google Benchmark ("context" and
+// "benchmarks", times in ms), so that runs of different releases can be compared.
+
+using namespace pcv;
+
+namespace
+{
+    struct Options
+    {
+        std::string mOutput;
+        int mMaxPoints{ 10000000 };
+        int mMaxFeatures{ 40 };
+        std::string mFilter;
+    };
+
+    struct Result
+    {
+        std::string mName;
+        std::string mOperation;
+        int mNbPoints{ 0 };
+        int mNbFeatures{ 0 };
+        int mIterations{ 0 };
+        double mMeanMs{ 0.0 };
+        double mMinMs{ 0.0 };
+        double mMaxMs{ 0.0 };
+        size_t mBytes{ 0 }; // bytes processed per iteration, 0 if not relevant
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    double getElapsedMs(const Clock::time_point& start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    FeatureData makeFeature(int nbPoints, unsigned int seed)
+    {
+        std::mt19937 generator(seed);
+        std::uniform_real_distribution<float> distribution(-10.0f, 10.0f);
+
+        FeatureData values(nbPoints);
+        for (auto& v : values)
+            v = distribution(generator);
+
+        return values;
+    }
+
+    std::string getFeatureName(int i)
+    {
+        static const char* sNames[] = { "x", "y", "z" };
+        return (i < 3) ? sNames[i] : "f" + std::to_string(i);
+    }
+
+    class Bench
+    {
+    public:
+        Bench(const Options& options, const boost::filesystem::path& folder) : mOptions(options), mFolder(folder) {}
+
+        /// Capture operations that only depend on the number of points.
+        void runCapture(int nbPoints)
+        {
+            pcl::PointCloud<pcl::PointXYZ> points;
+            points.resize(nbPoints);
+            const auto x = makeFeature(nbPoints, 1), y = makeFeature(nbPoints, 2), z = makeFeature(nbPoints, 3);
+            for (int i = 0; i < nbPoints; ++i)
+                points[i].getVector3fMap() = Eigen::Vector3f(x[i], y[i], z[i]);
+
+            const int iterations = getIterations(nbPoints);
+
+            measure("addCloud", nbPoints, 3, iterations, 0, [&]()
+            {
+                Cloud cloud;
+                const auto start = Clock::now();
+                cloud.addCloud(points);
+                return getElapsedMs(start);
+            });
+
+            measure("addSpace", nbPoints, 3, iterations, 0, [&]()
+            {
+                Cloud cloud;
+                cloud.addFeature(x, "x").addFeature(y, "y").addFeature(z, "z");
+                const auto start = Clock::now();
+                cloud.addSpace("x", "y", "z");
+                return getElapsedMs(start);
+            });
+
+            // A line is 2 points; use as many lines as points so the sweep stays comparable.
+            measure("addLine", nbPoints, 7, iterations, 0, [&]()
+            {
+                Cloud cloud;
+                const auto start = Clock::now();
+                for (int i = 0; i < nbPoints; ++i)
+                    cloud.addLine(points[i].getVector3fMap(), points[(i + 1) % nbPoints].getVector3fMap());
+                return getElapsedMs(start);
+            });
+        }
+
+        /// Operations that depend on the number of points and features.
+        void run(int nbPoints, int nbFeatures)
+        {
+            // Features share one vector, only their size matters.
+            const auto values = makeFeature(nbPoints, 4);
+            const int iterations = getIterations(nbPoints);
+
+            measure("addFeature", nbPoints, nbFeatures, iterations, 0, [&]()
+            {
+                Cloud cloud;
+                const auto start = Clock::now();
+                for (int j = 0; j < nbFeatures; ++j)
+                    cloud.addFeature(values, getFeatureName(j));
+                return getElapsedMs(start);
+            });
+
+            const auto filename = (mFolder / ("bench." + std::to_string(nbPoints) + "." + std::to_string(nbFeatures) + ".pcd")).string();
+            {
+                Cloud cloud;
+                for (int j = 0; j < nbFeatures; ++j)
+                    cloud.addFeature(values, getFeatureName(j));
+                cloud.addSpace("x", "y", "z");
+
+                measure("save", nbPoints, nbFeatures, iterations, 0, [&]()
+                {
+                    const auto start = Clock::now();
+                    cloud.save(filename);
+                    return getElapsedMs(start);
+                });
+
+                if (!boost::filesystem::exists(filename))
+                    cloud.save(filename); // save was filtered out, but the file is needed to load
+            }
+
+            const size_t fileSize = boost::filesystem::exists(filename) ? boost::filesystem::file_size(filename) : 0;
+            setBytes("save", nbPoints, nbFeatures, fileSize);
+
+            // Header parsing is fast and independent of the number of points: repeat it to get a stable mean.
+            measure("parseFileHeader", nbPoints, nbFeatures, 100, 0, [&]()
+            {
+                Visualizer::Cloud cloud;
+                cloud.mFullName = filename;
+                const auto start = Clock::now();
+                cloud.parseFileHeader();
+                return getElapsedMs(start);
+            });
+
+            measure("loadPCDFile", nbPoints, nbFeatures, iterations, fileSize, [&]()
+            {
+                pcl::PCLPointCloud2 message;
+                const auto start = Clock::now();
+                pcl::io::loadPCDFile(filename, message);
+                return getElapsedMs(start);
+            });
+
+            // Viewer path: the PCL reader on the mapped file, encoded features expanded to float from the mapping.
+            measure("loadMessage", nbPoints, nbFeatures, iterations, fileSize, [&]()
+            {
+                Visualizer::Cloud cloud;
+                cloud.mFullName = filename;
+                cloud.parseFileHeader();
+                const auto start = Clock::now();
+                cloud.load();
+                return getElapsedMs(start);
+            });
+
+            // Derived feature, as typed in the viewer.
+            {
+                Visualizer::Cloud cloud;
+                cloud.mFullName = filename;
+                cloud.parseFileHeader();
+                cloud.load();
+
+                FeatureExpression expression;
+                std::string error;
+                expression.parse("bench = sqrt(x * x + y * y) + |z| * 0.5 > 10", error);
+
+                measure("evaluateExpression", nbPoints, nbFeatures, iterations, 0, [&]()
+                {
+                    const auto start = Clock::now();
+                    expression.evaluate(*cloud.mPointCloudMessage);
+                    return getElapsedMs(start);
+                });
+            }
+
+            boost::system::error_code ec;
+            boost::filesystem::remove(filename, ec);
+        }
+
+        const std::vector<Result>& getResults() const { return mResults; }
+
+    private:
+        static int getIterations(int nbPoints)
+        {
+            return std::max(1, std::min(10, 1000000 / nbPoints));
+        }
+
+        static std::string getName(const std::string& operation, int nbPoints, int nbFeatures)
+        {
+            return operation + "/points:" + std::to_string(nbPoints) + "/features:" + std::to_string(nbFeatures);
+        }
+
+        void measure(const std::string& operation, int nbPoints, int nbFeatures, int iterations, size_t bytes, const std::function<double()>& func)
+        {
+            Result result;
+            result.mName = getName(operation, nbPoints, nbFeatures);
+            if (!mOptions.mFilter.empty() && result.mName.find(mOptions.mFilter) == std::string::npos)
+                return;
+
+            result.mOperation = operation;
+            result.mNbPoints = nbPoints;
+            result.mNbFeatures = nbFeatures;
+            result.mIterations = iterations;
+            result.mBytes = bytes;
+            result.mMinMs = std::numeric_limits<double>::max();
+
+            for (int i = 0; i < iterations; ++i)
+            {
+                const double ms = func();
+                result.mMeanMs += ms / iterations;
+                result.mMinMs = std::min(result.mMinMs, ms);
+                result.mMaxMs = std::max(result.mMaxMs, ms);
+            }
+
+            std::cout << std::left << std::setw(48) << result.mName << std::right << std::fixed << std::setprecision(3)
+                << std::setw(14) << result.mMeanMs << " ms" << std::endl;
+
+            mResults.push_back(result);
+        }
+
+        void setBytes(const std::string& operation, int nbPoints, int nbFeatures, size_t bytes)
+        {
+            const auto name = getName(operation, nbPoints, nbFeatures);
+            for (auto& result : mResults)
+                if (result.mName == name)
+                    result.mBytes = bytes;
+        }
+
+        Options mOptions;
+        boost::filesystem::path mFolder;
+        std::vector<Result> mResults;
+    };
+
+    void writeJson(std::ostream& out, const std::vector<Result>& results)
+    {
+        const auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+        out << "{" << std::endl;
+        out << "  \"context\": {" << std::endl;
+        out << "    \"date\": \"" << std::put_time(std::localtime(&now), "%Y-%m-%dT%H:%M:%S") << "\"," << std::endl;
+        out << "    \"executable\": \"VisualizerBench\"" << std::endl;
+        out << "  }," << std::endl;
+        out << "  \"benchmarks\": [" << std::endl;
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const auto& r = results[i];
+            out << "    {" << std::endl;
+            out << "      \"name\": \"" << r.mName << "\"," << std::endl;
+            out << "      \"run_name\": \"" << r.mName << "\"," << std::endl;
+            out << "      \"run_type\": \"iteration\"," << std::endl;
+            out << "      \"operation\": \"" << r.mOperation << "\"," << std::endl;
+            out << "      \"points\": " << r.mNbPoints << "," << std::endl;
+            out << "      \"features\": " << r.mNbFeatures << "," << std::endl;
+            out << "      \"iterations\": " << r.mIterations << "," << std::endl;
+            out << std::setprecision(6) << std::fixed;
+            out << "      \"real_time\": " << r.mMeanMs << "," << std::endl;
+            out << "      \"min_time\": " << r.mMinMs << "," << std::endl;
+            out << "      \"max_time\": " << r.mMaxMs << "," << std::endl;
+            out << "      \"ns_per_point\": " << (r.mMeanMs * 1e6 / r.mNbPoints) << "," << std::endl;
+            if (r.mBytes > 0)
+                out << "      \"bytes_per_second\": " << (r.mBytes / (r.mMeanMs * 1e-3)) << "," << std::endl;
+            out << "      \"time_unit\": \"ms\"" << std::endl;
+            out << "    }" << (i + 1 < results.size() ? "," : "") << std::endl;
+        }
+
+        out << "  ]" << std::endl;
+        out << "}" << std::endl;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = (i + 1 < argc);
+
+        if (arg == "--out" && hasValue)
+            options.mOutput = argv[++i];
+        else if (arg == "--max-points" && hasValue)
+            options.mMaxPoints = std::atoi(argv[++i]);
+        else if (arg == "--max-features" && hasValue)
+            options.mMaxFeatures = std::atoi(argv[++i]);
+        else if (arg == "--filter" && hasValue)
+            options.mFilter = argv[++i];
+        else
+        {
+            std::cout << "Usage: VisualizerBench [--out results.json] [--max-points N] [--max-features N] [--filter text]" << std::endl;
+            return 1;
+        }
+    }
+
+    namespace fs = boost::filesystem;
+    const auto folder = fs::temp_directory_path() / fs::unique_path("visualizer-bench-%%%%-%%%%");
+    fs::create_directories(folder);
+
+    Bench bench(options, folder);
+    for (const int nbPoints : { 1000, 10000, 100000, 1000000, 10000000 })
+    {
+        if (nbPoints > options.mMaxPoints) continue;
+
+        bench.runCapture(nbPoints);
+        for (const int nbFeatures : { 3, 10, 40 })
+        {
+            if (nbFeatures > options.mMaxFeatures) continue;
+            bench.run(nbPoints, nbFeatures);
+        }
+    }
+
+    boost::system::error_code ec;
+    fs::remove_all(folder, ec);
+
+    if (options.mOutput.empty())
+        writeJson(std::cout, bench.getResults());
+    else
+    {
+        std::ofstream out(options.mOutput);
+        writeJson(out, bench.getResults());
+        std::cout << "[VisualizerBench] Results written in " << options.mOutput << std::endl;
+    }
+
+    return 0;
+}
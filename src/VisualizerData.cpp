@@ -1,11 +1,15 @@
 #include "VisualizerData.h"
+#include "VisualizerJournal.h"
 
 #include <algorithm>
 #include <iostream>
 #include <iomanip>
+#include <limits>
 #include <ctime>
 #include <chrono>
+#include <cstring>
 #include <sstream>
+#include <thread>
 
 #include <boost/filesystem.hpp>
 
@@ -16,6 +20,9 @@ using namespace pcv;
 
 const std::string VisualizerData::sFilePrefix = "visualizer.";
 const std::string VisualizerData::sFolder = "VisualizerData/";
+bool VisualizerData::sJournalEnabled = false;
+bool VisualizerData::sFilesEnabled = true;
+std::shared_ptr<LiveRing> VisualizerData::sLiveRing;
 thread_local std::string VisualizerData::sFullScopeName = "";
 
 void logError(const std::string& msg)
@@ -28,6 +35,63 @@ void logWarning(const std::string& msg)
     std::cout << "[VISUALIZER][WARNING]" << msg << std::endl;
 }
 
+namespace
+{
+    FeatureStats computeFeatureStats(const FeatureData& data)
+    {
+        FeatureStats stats;
+
+        // Single pass for min, max and mean; kept branchless (NaN fails the comparisons) so that it vectorizes.
+        float min = std::numeric_limits<float>::infinity();
+        float max = -std::numeric_limits<float>::infinity();
+        double sum = 0.0;
+        size_t count = 0;
+        for (const auto v : data)
+        {
+            const bool isValid = (v == v);
+            min = (v < min) ? v : min;
+            max = (v > max) ? v : max;
+            sum += isValid ? v : 0.0;
+            count += isValid;
+        }
+
+        if (count == 0)
+            return stats;
+
+        stats.mMin = min;
+        stats.mMax = max;
+        stats.mMean = sum / count;
+        stats.mCount = count;
+
+        // The histogram needs the range, so it is a second pass.
+        const int nbBins = FeatureStats::sNbHistogramBins;
+        stats.mHistogram.assign(nbBins, 0);
+        const double range = static_cast<double>(max) - min;
+        if (!std::isfinite(range))
+            return stats;
+
+        const double binsPerUnit = (range > 0.0) ? nbBins / range : 0.0;
+        for (const auto v : data)
+        {
+            if (v == v)
+            {
+                const int bin = static_cast<int>((v - min) * binsPerUnit);
+                ++stats.mHistogram[std::min(bin, nbBins - 1)];
+            }
+        }
+
+        return stats;
+    }
+
+    size_t getPointSize(const std::vector<FeatureEncoding>& encodings)
+    {
+        size_t pointSize = 0;
+        for (const auto& encoding : encodings)
+            pointSize += (encoding.mType == EEncoding::eFloat32) ? 4 : 2;
+        return pointSize;
+    }
+}
+
 VisualizerData::VisualizerData(const std::string& name)
 { 
     mLocalScopeName = name;
@@ -38,6 +102,10 @@ VisualizerData::VisualizerData(const std::string& name)
 VisualizerData::~VisualizerData()
 {
     render(); // force render (saving files) at destruction
+
+    for (auto& pair : mClouds)
+        pair.second->closeJournal(); // clouds that could not be rendered
+
     sFullScopeName = mPreviousFullScopeName;
 }
 
@@ -72,12 +140,23 @@ const FileNames& VisualizerData::render()
             continue;
         }
 
+        // Published first: a running viewer gets it without waiting for the file.
+        if (sLiveRing && !cloud.publish(*sLiveRing, boost::filesystem::path(getCloudFilename(cloud, name)).filename().string()))
+            logWarning("[render] Cloud [" + name + "] does not fit in the live ring (" + std::to_string(sLiveRing->getCapacity() / (1024 * 1024)) + " MB), it is not published.");
+
+        if (!sFilesEnabled)
+        {
+            cloud.closeJournal(); // delivered
+            continue;
+        }
+
         boost::filesystem::create_directory(sFolder);
         if (boost::filesystem::exists(sFolder))
         {
             const std::string fileName = getCloudFilename(cloud, name);
             mFileNames.push_back(fileName);
             cloud.save(fileName);
+            cloud.closeJournal(); // the saved file is now the reference
 
 #ifdef SAVE_PLY
             if (cloud.hasFeature("rgb"))
@@ -110,6 +189,12 @@ Cloud& VisualizerData::getCloud(const CloudName& name)
 
     mClouds[name]->setParent(this);
 
+    if (sJournalEnabled)
+    {
+        boost::filesystem::create_directory(sFolder);
+        mClouds[name]->setJournal(getJournalFilename(name));
+    }
+
     return *mClouds[name];
 }
 
@@ -219,6 +304,27 @@ std::string VisualizerData::getCloudFilename(const Cloud& cloud, const std::stri
     return sFolder + sFilePrefix + cloud.mTimestamp + "." + sFullScopeName +  "." + cloudName + ".pcd";
 }
 
+std::string VisualizerData::getJournalFilename(const std::string& cloudName) const
+{
+    return sFolder + sFilePrefix + createTimestampString() + "." + sFullScopeName + "." + cloudName + Journal::sExtension;
+}
+
+void VisualizerData::setLiveEnabled(bool enabled, const std::string& ringName, int capacityMb)
+{
+    sLiveRing.reset();
+    if (!enabled)
+        return;
+
+    sLiveRing = LiveRing::create(ringName, static_cast<size_t>(std::max(capacityMb, 1)) * 1024 * 1024);
+    if (!sLiveRing)
+        logError("[setLiveEnabled] Could not create the live ring '" + ringName + "', clouds will not be published.");
+}
+
+int VisualizerData::recoverJournals(const std::string& folder)
+{
+    return Journal::recoverFolder(folder);
+}
+
 ///////////////////////////////////////////////////////////////////////////////////
 // CLOUD
 
@@ -234,11 +340,49 @@ Cloud& Cloud::setViewport(ViewportIdx viewport)
 {
     // Continue using already set viewport (do nothing) if -1.
     if (viewport > 0)
+    {
         mViewport = viewport;
+        journalProperties();
+    }
 
     return *this;
 }
 
+void Cloud::setJournal(const std::string& filename)
+{
+    if (mJournalFilename.empty())
+        mJournalFilename = filename;
+}
+
+void Cloud::closeJournal()
+{
+    if (mJournal)
+        mJournal->remove();
+
+    mJournal.reset();
+}
+
+void Cloud::journal(const std::function<void(Journal&)>& write)
+{
+    if (mJournalFilename.empty())
+        return; // journaling disabled
+
+    if (!mJournal)
+    {
+        // A new journal starts with the whole cloud, which already includes the current modification.
+        mJournal = std::make_shared<Journal>(mJournalFilename);
+        mJournal->writeSnapshot(*this);
+        return;
+    }
+
+    write(*mJournal);
+}
+
+void Cloud::journalProperties()
+{
+    journal([&](Journal& j) { j.writeProperties(*this); });
+}
+
 Cloud& Cloud::addFeature(const FeatureData& data, const FeatureName& name, ViewportIdx viewport)
 {
     const int nbPoints = getNbPoints();
@@ -256,6 +400,8 @@ Cloud& Cloud::addFeature(const FeatureData& data, const FeatureName& name, Viewp
         else
             mFeatures.emplace_back(name, data);
 
+        journal([&](Journal& j) { j.writeFeature(name, data); });
+
         if (isNewCloud) 
             addCloudCommon(viewport);
         else
@@ -378,6 +524,7 @@ Cloud& Cloud::addSpace(const FeatureName& a, const FeatureName& b, const Feature
     else if (!hasFeature(b)) { logError("[addSpace] following feature does not exit: " + b); return *this; }
     else if (!hasFeature(c)) { logError("[addSpace] following feature does not exit: " + c); return *this; }
     else mSpaces.emplace_back(*getFeature(a), *getFeature(b), *getFeature(c));
+    journal([&](Journal& j) { j.writeSpace(mSpaces.back()); });
     return *this;
 }
 
@@ -399,6 +546,13 @@ Cloud& Cloud::addLine(const Eigen::Vector3f &pt1, const Eigen::Vector3f &pt2, in
             auto& rgb = getFeatureData("rgb");
             rgb.emplace_back(packRgb(128, 128, 128)); // defaults to gray color
         }
+
+        journal([&](Journal& j)
+        {
+            for (const auto& feature : mFeatures)
+                if (!feature.second.empty())
+                    j.writeFeatureValues(feature.first, &feature.second.back(), 1);
+        });
     };
 
     const bool isNewCloud = getNbFeatures() == 0;
@@ -428,6 +582,7 @@ Cloud& Cloud::addLine(const Eigen::Vector3f &pt1, const Eigen::Vector3f &pt2, in
     }
 
     mType = EType::eLines;
+    journalProperties();
     return *this;
 }
 
@@ -502,6 +657,7 @@ Cloud& Cloud::addPlane(const Eigen::Vector3f& p, std::array<float, 4> coeffs, do
     addCloudCommon(viewport);
 
     mType = EType::ePlane;
+    journal([&](Journal& j) { j.writeSnapshot(*this); }); // features were overwritten
     return *this;
 }
 
@@ -518,6 +674,7 @@ Cloud& Cloud::addSphere(const Eigen::Vector3f& p, double radius, int viewport)
     addCloudCommon(viewport);
 
     mType = EType::eSphere;
+    journal([&](Journal& j) { j.writeSnapshot(*this); }); // features were overwritten
     return *this;
 }
 
@@ -540,6 +697,7 @@ Cloud& Cloud::addCylinder(Eigen::Vector3f axisOrigin, Eigen::Vector3f axisDirect
     addCloudCommon(viewport);
 
     mType = EType::eCylinder;
+    journal([&](Journal& j) { j.writeSnapshot(*this); }); // features were overwritten
     return *this;
 }
 
@@ -617,10 +775,66 @@ Cloud& Cloud::setDefaultFeature(const FeatureName& name)
 Cloud& Cloud::setColormapRange(double min, double max)
 {
     mColormapRange = { min, max };
+    journalProperties();
     return *this;
 }
 
-void Cloud::save(const std::string& filename) const
+Cloud& Cloud::setFeatureEncoding(const FeatureName& name, EEncoding encoding, float maxError)
+{
+    if (name == "rgb")
+        logWarning("[setFeatureEncoding] feature " + name + " is a special case and is always saved as is.");
+    else
+        mEncodings[name] = { encoding, maxError };
+
+    return *this;
+}
+
+FeatureEncoding Cloud::getSavedEncoding(const Feature& feature, const FeatureStats& stats) const
+{
+    auto it = mEncodings.find(feature.first);
+    if (it == mEncodings.end() || it->second.first == EEncoding::eFloat32 || feature.first == "rgb")
+        return FeatureEncoding();
+
+    const auto& data = feature.second;
+    const float maxError = it->second.second;
+
+    FeatureEncoding encoding;
+    encoding.mType = it->second.first;
+
+    double error = 0.0;
+    if (encoding.mType == EEncoding::eFixed16)
+    {
+        // Quantize over the feature range, which is the bounding box for the geometry features.
+        const float min = stats.mMin;
+        const float max = stats.mMax;
+        if (!std::isfinite(min) || !std::isfinite(max))
+        {
+            logWarning("[save] feature " + feature.first + " has infinite values, cannot be saved as fixed16, saved as float32.");
+            return FeatureEncoding();
+        }
+
+        encoding.mOffset = min;
+        encoding.mScale = (static_cast<double>(max) - min) / FeatureEncoding::sFixed16Max;
+        error = 0.5 * encoding.mScale;
+    }
+    else
+    {
+        for (const auto v : data)
+            if (!std::isnan(v))
+                error = std::max(error, static_cast<double>(std::abs(halfToFloat(floatToHalf(v)) - v)));
+    }
+
+    if (maxError >= 0.0f && !(error <= maxError))
+    {
+        logWarning("[save] feature " + feature.first + " error with " + toString(encoding.mType) + " encoding is " + 
+            std::to_string(error) + ", above " + std::to_string(maxError) + ", saved as float32.");
+        return FeatureEncoding();
+    }
+
+    return encoding;
+}
+
+std::string Cloud::getFileHeader(std::vector<FeatureEncoding>& encodings) const
 {
     auto getTypeString = [](EType type)
     {
@@ -648,6 +862,47 @@ void Cloud::save(const std::string& filename) const
     if (mColormapRange.size() == 2)
         f << "# visualizer cloud colormap range " << mColormapRange[0] << " " << mColormapRange[1] << std::endl;
 
+    // Spaces, to display the points in other coordinates (e.g. normals) with the viewer's geometry handlers.
+    for (const auto& space : mSpaces)
+        f << "# visualizer space " << space.u1 << " " << space.u2 << " " << space.u3 << std::endl;
+
+    std::vector<FeatureStats> stats;
+    encodings.clear();
+    stats.reserve(mFeatures.size());
+    encodings.reserve(mFeatures.size());
+    for (const auto& feature : mFeatures)
+    {
+        stats.push_back((feature.first == "rgb") ? FeatureStats() : computeFeatureStats(feature.second)); // rgb values are packed colors
+        encodings.push_back(getSavedEncoding(feature, stats.back()));
+    }
+
+    // Feature statistics, to know the ranges without reading the data.
+    for (int i = 0; i < getNbFeatures(); ++i)
+    {
+        const auto& s = stats[i];
+        if (s.mCount == 0)
+            continue;
+
+        f << "# visualizer feature " << mFeatures[i].first << " stats " << std::setprecision(std::numeric_limits<float>::max_digits10)
+            << s.mMin << " " << s.mMax << " " << s.mMean << " " << s.mCount << std::setprecision(6) << std::endl;
+
+        f << "# visualizer feature " << mFeatures[i].first << " histogram";
+        for (const auto count : s.mHistogram)
+            f << " " << count;
+        f << std::endl;
+    }
+
+    // Encoded features are 16 bit unsigned fields, expanded back to float by the viewer using these lines.
+    for (int i = 0; i < getNbFeatures(); ++i)
+    {
+        const auto& encoding = encodings[i];
+        if (encoding.mType == EEncoding::eFloat16)
+            f << "# visualizer feature " << mFeatures[i].first << " encoding float16" << std::endl;
+        else if (encoding.mType == EEncoding::eFixed16)
+            f << "# visualizer feature " << mFeatures[i].first << " encoding fixed16 " << std::setprecision(std::numeric_limits<double>::max_digits10) 
+                << encoding.mScale << " " << encoding.mOffset << std::setprecision(6) << std::endl;
+    }
+
     f << "VERSION .7" << std::endl;
 
     f << "FIELDS";
@@ -657,12 +912,12 @@ void Cloud::save(const std::string& filename) const
 
     f << "SIZE";
     for (int i = 0; i < getNbFeatures(); ++i)
-        f << " 4";
+        f << (encodings[i].mType == EEncoding::eFloat32 ? " 4" : " 2");
     f << std::endl;
 
     f << "TYPE";
     for (int i = 0; i < getNbFeatures(); ++i)
-        f << (mFeatures[i].first == "rgb" ? " U" : " F");
+        f << ((mFeatures[i].first == "rgb" || encodings[i].mType != EEncoding::eFloat32) ? " U" : " F");
     f << std::endl;
 
     f << "COUNT";
@@ -676,33 +931,81 @@ void Cloud::save(const std::string& filename) const
     f << "POINTS " << getNbPoints() << std::endl;
     f << "DATA binary" << std::endl;
 
-    // Open the file and write in it.
-    auto pFile = fopen(filename.c_str(), "wb");
-    if (pFile != NULL)
-    {
-        // Write header.
-        const auto& header = f.str();
-        fwrite(header.c_str(), sizeof(char), header.size(), pFile);
+    return f.str();
+}
 
-        // Write data. (for now, writing one datum at a time, could be optimized)
-        for (int i = 0; i < getNbPoints(); ++i)
+void Cloud::writeFileData(const std::vector<FeatureEncoding>& encodings, const std::function<void(const unsigned char*, size_t)>& write) const
+{
+    const int nbPointsPerChunk = 4096;
+    std::vector<unsigned char> chunk(nbPointsPerChunk * getPointSize(encodings));
+    for (int first = 0; first < getNbPoints(); first += nbPointsPerChunk)
+    {
+        const int last = std::min(first + nbPointsPerChunk, getNbPoints());
+        auto* pData = chunk.data();
+        for (int i = first; i < last; ++i)
         {
-            for (const auto& feature : mFeatures)
+            for (int j = 0; j < getNbFeatures(); ++j)
             {
+                const auto& feature = mFeatures[j];
+                const auto& encoding = encodings[j];
                 if (feature.first == "rgb")
                 {
                     const auto v = static_cast<uint32_t>(feature.second[i]);
-                    fwrite((unsigned char*)(&v), sizeof(v), 1, pFile);
+                    std::memcpy(pData, &v, sizeof(v));
+                    pData += sizeof(v);
                 }
-                else
+                else if (encoding.mType == EEncoding::eFloat32)
                 {
                     const auto v = feature.second[i];
-                    fwrite((unsigned char*)(&v), sizeof(v), 1, pFile);
+                    std::memcpy(pData, &v, sizeof(v));
+                    pData += sizeof(v);
+                }
+                else
+                {
+                    const uint16_t v = (encoding.mType == EEncoding::eFloat16) ? floatToHalf(feature.second[i]) : floatToFixed16(feature.second[i], encoding);
+                    std::memcpy(pData, &v, sizeof(v));
+                    pData += sizeof(v);
                 }
             }
         }
+        write(chunk.data(), pData - chunk.data());
+    }
+}
+
+void Cloud::save(const std::string& filename) const
+{
+    std::vector<FeatureEncoding> encodings;
+    const auto header = getFileHeader(encodings);
+
+    // Open the file and write in it. Written under a temporary name and renamed once complete, so that
+    // a viewer following the folder never reads a partial file.
+    const std::string tmpFilename = filename + ".tmp";
+    auto pFile = fopen(tmpFilename.c_str(), "wb");
+    if (pFile != NULL)
+    {
+        fwrite(header.c_str(), sizeof(char), header.size(), pFile);
+        writeFileData(encodings, [pFile](const unsigned char* pData, size_t size) { fwrite(pData, sizeof(unsigned char), size, pFile); });
 
         fclose(pFile);
+
+        // Replaces an existing file; on Windows, not while a viewer has it open (e.g. loading it): retry, then copy over it.
+        boost::system::error_code ec;
+        for (int attempt = 0; attempt < 10; ++attempt)
+        {
+            boost::filesystem::rename(tmpFilename, filename, ec);
+            if (!ec)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+
+        if (ec)
+        {
+            boost::filesystem::copy_file(tmpFilename, filename, boost::filesystem::copy_option::overwrite_if_exists, ec);
+            if (ec)
+                logError("[save] could not rename " + tmpFilename + " to " + filename + ": " + ec.message());
+            else
+                boost::filesystem::remove(tmpFilename, ec);
+        }
     }
     else
     {
@@ -710,6 +1013,21 @@ void Cloud::save(const std::string& filename) const
     }
 }
 
+bool Cloud::publish(LiveRing& ring, const std::string& filename) const
+{
+    std::vector<FeatureEncoding> encodings;
+    const auto header = getFileHeader(encodings);
+    const size_t size = header.size() + static_cast<size_t>(getNbPoints()) * getPointSize(encodings);
+
+    // Written straight into the ring, like in the file.
+    return ring.publish(filename, size, [&](char* pDst)
+    {
+        std::memcpy(pDst, header.data(), header.size());
+        pDst += header.size();
+        writeFileData(encodings, [&pDst](const unsigned char* pData, size_t size) { std::memcpy(pDst, pData, size); pDst += size; });
+    });
+}
+
 Space::Space(const Feature& a, const Feature& b, const Feature& c) : 
     u1(a.first), u2(b.first), u3(c.first),
     mSearchTree(flann::KDTreeSingleIndexParams()) // optimized for 3D, gives exact result
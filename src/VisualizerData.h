@@ -3,7 +3,9 @@
 #include <stdlib.h>
 
 #include <array>
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -13,9 +15,13 @@
 
 #include <flann/flann.h>
 
+#include "VisualizerEncoding.h"
+#include "VisualizerLive.h"
+
 //#define SAVE_PLY
 
 void logError(const std::string& msg);
+void logWarning(const std::string& msg);
 
 namespace pcv
 {
@@ -34,6 +40,7 @@ namespace pcv
     using ViewportIdx = int;
 
     class VisualizerData;
+    class Journal;
 
     struct Space
     {
@@ -152,13 +159,20 @@ namespace pcv
         Cloud& addPlane(const Eigen::Vector3f& p, std::array<float, 4> coeffs, double sizeU, double sizeV, const Eigen::Vector3f& up, int viewport = -1);
 
         Cloud& setViewport(ViewportIdx viewport);
-        Cloud& setSize(int size) { mSize = size; return *this; };
-        Cloud& setOpacity(double opacity) { mOpacity = opacity; return *this; };
+        Cloud& setSize(int size) { mSize = size; journalProperties(); return *this; };
+        Cloud& setOpacity(double opacity) { mOpacity = opacity; journalProperties(); return *this; };
 
         Cloud& setColor(float r, float g, float b);
         Cloud& setDefaultFeature(const FeatureName& name);
         Cloud& setColormapRange(double min, double max);
 
+        /// Store a feature with a compact encoding in the saved file; the viewer expands it back to float when loading.
+        /// @param[in] name: the name of the feature
+        /// @param[in] encoding: float16, or fixed16 (16 bit fixed point relative to the feature range, e.g. the bounding box for x, y, z)
+        /// @param[in] maxError (optional): maximum absolute error accepted, the feature is saved as float32 if the encoding exceeds it (negative to accept any error)
+        /// @return reference to the updated visualizer cloud (allows chainable commands)
+        Cloud& setFeatureEncoding(const FeatureName& name, EEncoding encoding, float maxError = -1.0f);
+
         int getNbPoints() const;
         int getNbFeatures() const { return static_cast<int>(mFeatures.size()); };
         bool hasFeature(const FeatureName& name) const;
@@ -172,8 +186,20 @@ namespace pcv
         void render() const;
         void save(const std::string& filename) const;
 
+        /// Publish the cloud to the viewers of this machine, with the same content as its file. Returns false if it does not fit in the ring.
+        /// @param[in] ring: the live ring
+        /// @param[in] filename: name of the file the cloud would be saved to (without folder)
+        bool publish(LiveRing& ring, const std::string& filename) const;
+
         void setParent(VisualizerData* visualizerPtr) { mVisualizerPtr = visualizerPtr; }
 
+        /// Record all following modifications of the cloud in a memory-mapped journal file, that can be recovered after a crash.
+        /// @param[in] filename: the journal file name (the file is only created at the first modification)
+        void setJournal(const std::string& filename);
+
+        /// Delete the journal file (e.g. once the cloud is saved); a new one is created at the next modification.
+        void closeJournal();
+
         enum class EType {ePoints, eLines, ePlane, eSphere, eCylinder};
 
         int mViewport{ 0 };
@@ -183,6 +209,7 @@ namespace pcv
         std::vector<Space> mSpaces; // using vector instead of [unordered_]map to keep order of insertion
         std::map<int, CloudsMap> mIndexedClouds;
         std::vector<Feature> mFeatures; // using vector instead of [unordered_]map to keep order of insertion
+        std::map<FeatureName, std::pair<EEncoding, float>> mEncodings; // requested encoding and max error
         std::string mTimestamp;
         EType mType{ EType::ePoints };
     private:
@@ -190,7 +217,19 @@ namespace pcv
         void createTimestamp();
         static float packRgb(int r, int g, int b) { return static_cast<float>((r << 16) + (g << 8) + (b)); }
 
+        FeatureEncoding getSavedEncoding(const Feature& feature, const FeatureStats& stats) const;
+
+        // Content of the file: the header, with the encoding chosen for each feature, then the points, written a chunk at a time.
+        std::string getFileHeader(std::vector<FeatureEncoding>& encodings) const;
+        void writeFileData(const std::vector<FeatureEncoding>& encodings, const std::function<void(const unsigned char*, size_t)>& write) const;
+
+        void journal(const std::function<void(Journal&)>& write);
+        void journalProperties();
+
         VisualizerData* mVisualizerPtr{ nullptr };
+
+        std::string mJournalFilename;
+        std::shared_ptr<Journal> mJournal;
     };
 
     class VisualizerData
@@ -395,10 +434,35 @@ namespace pcv
         /// @param[in] cloudName: the name of the cloud to compare across the bundles.
         static void compare(const std::string& searchPrefix, const std::vector<std::string>& searchElements, const std::string& searchSuffix, const std::string& cloudName);
 
+        /// Enable crash-resilient capture: clouds are written in memory-mapped journals as they are built, not only when rendered.
+        /// @param[in] enabled: whether to journal clouds created from now on
+        static void setJournalEnabled(bool enabled) { sJournalEnabled = enabled; }
+
+        /// Turn the journals left by a crashed process into regular PCD files. The journals being written, by this process
+        /// or another one, are left as they are.
+        /// @param[in] folder (optional): folder containing the journals
+        /// @return number of recovered clouds
+        static int recoverJournals(const std::string& folder = sFolder);
+
+        /// Publish the rendered clouds to the viewers of this machine (VisualizerApp --live), through a ring in shared memory,
+        /// without the round trip through files. Files are still saved, unless disabled with setFilesEnabled.
+        /// @param[in] enabled: whether to publish the clouds rendered from now on
+        /// @param[in] ringName (optional): name of the shared memory, given to the viewer
+        /// @param[in] capacityMb (optional): memory of the ring; a viewer that falls behind by more misses the oldest clouds
+        static void setLiveEnabled(bool enabled, const std::string& ringName = LiveRing::sDefaultName, int capacityMb = 256);
+
+        /// Save the rendered clouds to files (the default); disable to only publish them live.
+        /// @param[in] enabled: whether to save the clouds rendered from now on
+        static void setFilesEnabled(bool enabled) { sFilesEnabled = enabled; }
+
         static std::string createTimestampString(int hrsBack = 0);
         std::string getCloudFilename(const Cloud& cloud, const std::string& cloudName) const;
+        std::string getJournalFilename(const std::string& cloudName) const;
 
     private:
+        static bool sJournalEnabled;
+        static bool sFilesEnabled;
+        static std::shared_ptr<LiveRing> sLiveRing; // null if not publishing
         static thread_local std::string sFullScopeName;
         std::string mPreviousFullScopeName;
         std::string mLocalScopeName;
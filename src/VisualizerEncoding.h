@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace pcv
+{
+    /// How a float feature is stored in a PCD file. Encoded features are stored as 16 bit unsigned
+    /// fields; the parameters needed to expand them are written in '# visualizer feature' header comments.
+    enum class EEncoding { eFloat32, eFloat16, eFixed16 };
+
+    struct FeatureEncoding
+    {
+        EEncoding mType{ EEncoding::eFloat32 };
+        double mScale{ 1.0 };  // fixed16 only: value = offset + code * scale
+        double mOffset{ 0.0 }; // fixed16 only
+
+        static const uint16_t sFixed16Nan = 0xFFFF; // fixed16 code reserved for NaN
+        static const uint16_t sFixed16Max = 0xFFFE;
+    };
+
+    /// Statistics of a feature, computed when saving and written in '# visualizer feature' header comments,
+    /// so that ranges are known without reading the data. NaN values are not counted.
+    struct FeatureStats
+    {
+        float mMin{ 0.0f };
+        float mMax{ 0.0f };
+        double mMean{ 0.0 };
+        size_t mCount{ 0 };                 // number of values that are not NaN
+        std::vector<size_t> mHistogram;     // bins of equal width over [mMin, mMax]
+
+        static const int sNbHistogramBins = 16;
+    };
+
+    inline std::string toString(EEncoding encoding)
+    {
+        switch (encoding)
+        {
+        case EEncoding::eFloat16: return "float16";
+        case EEncoding::eFixed16: return "fixed16";
+        case EEncoding::eFloat32: // fallthrough
+        default: return "float32";
+        }
+    }
+
+    inline EEncoding toEncoding(const std::string& str)
+    {
+        if (str == "float16") return EEncoding::eFloat16;
+        if (str == "fixed16") return EEncoding::eFixed16;
+        return EEncoding::eFloat32;
+    }
+
+    /// IEEE 754 binary16 conversion, rounding to nearest even.
+    inline uint16_t floatToHalf(float value)
+    {
+        uint32_t f;
+        std::memcpy(&f, &value, sizeof(f));
+
+        const uint32_t sign = (f >> 16) & 0x8000;
+        const uint32_t floatExponent = (f >> 23) & 0xFF;
+        const int32_t exponent = static_cast<int32_t>(floatExponent) - 127 + 15;
+        uint32_t mantissa = f & 0x007FFFFF;
+
+        if (floatExponent == 0xFF) // inf or nan
+            return static_cast<uint16_t>(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+
+        if (exponent >= 0x1F) // too big, inf
+            return static_cast<uint16_t>(sign | 0x7C00);
+
+        if (exponent <= 0) // subnormal or zero
+        {
+            if (exponent < -10)
+                return static_cast<uint16_t>(sign);
+
+            mantissa |= 0x00800000; // implicit leading bit
+            const uint32_t shift = static_cast<uint32_t>(14 - exponent);
+            uint32_t half = mantissa >> shift;
+            const uint32_t rest = mantissa & ((1u << shift) - 1);
+            const uint32_t halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (half & 1)))
+                ++half;
+            return static_cast<uint16_t>(sign | half);
+        }
+
+        uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+        const uint32_t rest = mantissa & 0x1FFF;
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+            ++half; // a carry into the exponent is still the correct rounding
+        return static_cast<uint16_t>(sign | half);
+    }
+
+    inline float halfToFloat(uint16_t half)
+    {
+        const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+        uint32_t exponent = (half >> 10) & 0x1F;
+        uint32_t mantissa = half & 0x3FF;
+        uint32_t f;
+
+        if (exponent == 0x1F) // inf or nan
+            f = sign | 0x7F800000 | (mantissa << 13);
+        else if (exponent != 0)
+            f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        else if (mantissa == 0)
+            f = sign;
+        else // subnormal, normalize it
+        {
+            exponent = 127 - 15 + 1;
+            while ((mantissa & 0x400) == 0)
+            {
+                mantissa <<= 1;
+                --exponent;
+            }
+            f = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+        }
+
+        float value;
+        std::memcpy(&value, &f, sizeof(value));
+        return value;
+    }
+
+    inline uint16_t floatToFixed16(float value, const FeatureEncoding& encoding)
+    {
+        if (std::isnan(value))
+            return FeatureEncoding::sFixed16Nan;
+
+        if (encoding.mScale <= 0.0)
+            return 0;
+
+        const double code = std::round((value - encoding.mOffset) / encoding.mScale);
+        return static_cast<uint16_t>(std::max(0.0, std::min(code, static_cast<double>(FeatureEncoding::sFixed16Max))));
+    }
+
+    inline float fixed16ToFloat(uint16_t code, const FeatureEncoding& encoding)
+    {
+        if (code == FeatureEncoding::sFixed16Nan)
+            return std::numeric_limits<float>::quiet_NaN();
+
+        return static_cast<float>(encoding.mOffset + code * encoding.mScale);
+    }
+
+    inline float decodeValue(uint16_t code, const FeatureEncoding& encoding)
+    {
+        return (encoding.mType == EEncoding::eFloat16) ? halfToFloat(code) : fixed16ToFloat(code, encoding);
+    }
+}
@@ -0,0 +1,446 @@
+#include "VisualizerExpression.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+using namespace pcv;
+
+namespace
+{
+    const size_t sChunkSize = 4096; // points evaluated together, small enough for the intermediate values to stay in cache
+
+    // Point values of a field, converted to float.
+    template <typename T>
+    void gatherField(const pcl::PCLPointCloud2& message, uint32_t offset, size_t first, size_t n, float* values)
+    {
+        const uint8_t* data = &message.data[first * message.point_step + offset];
+        for (size_t i = 0; i < n; ++i, data += message.point_step)
+        {
+            T value;
+            std::memcpy(&value, data, sizeof(T));
+            values[i] = static_cast<float>(value);
+        }
+    }
+
+    void gatherField(const pcl::PCLPointCloud2& message, const pcl::PCLPointField& field, size_t first, size_t n, float* values)
+    {
+        switch (field.datatype)
+        {
+        case pcl::PCLPointField::INT8: gatherField<int8_t>(message, field.offset, first, n, values); break;
+        case pcl::PCLPointField::UINT8: gatherField<uint8_t>(message, field.offset, first, n, values); break;
+        case pcl::PCLPointField::INT16: gatherField<int16_t>(message, field.offset, first, n, values); break;
+        case pcl::PCLPointField::UINT16: gatherField<uint16_t>(message, field.offset, first, n, values); break;
+        case pcl::PCLPointField::INT32: gatherField<int32_t>(message, field.offset, first, n, values); break;
+        case pcl::PCLPointField::UINT32: gatherField<uint32_t>(message, field.offset, first, n, values); break;
+        case pcl::PCLPointField::FLOAT32: gatherField<float>(message, field.offset, first, n, values); break;
+        case pcl::PCLPointField::FLOAT64: gatherField<double>(message, field.offset, first, n, values); break;
+        default: std::fill(values, values + n, std::numeric_limits<float>::quiet_NaN()); break;
+        }
+    }
+
+    // Plain loops over contiguous arrays, so that the compiler vectorizes them.
+    template <typename Function>
+    void applyUnary(float* a, size_t n, Function f)
+    {
+        for (size_t i = 0; i < n; ++i)
+            a[i] = f(a[i]);
+    }
+
+    template <typename Function>
+    void applyBinary(float* a, const float* b, size_t n, Function f)
+    {
+        for (size_t i = 0; i < n; ++i)
+            a[i] = f(a[i], b[i]);
+    }
+}
+
+std::vector<float> pcv::readFeatureValues(const pcl::PCLPointCloud2& message, const std::string& name)
+{
+    const size_t nbPoints = static_cast<size_t>(message.width) * message.height;
+    std::vector<float> values(nbPoints, std::numeric_limits<float>::quiet_NaN());
+
+    auto field = std::find_if(message.fields.begin(), message.fields.end(), [&](const pcl::PCLPointField& f) { return f.name == name; });
+    if ((field != message.fields.end()) && (nbPoints > 0))
+        gatherField(message, *field, 0, nbPoints, values.data());
+
+    return values;
+}
+
+// Recursive descent parser, writing the program in reverse polish notation:
+//   comparison := sum [ (< | <= | > | >= | == | !=) sum ]
+//   sum        := product { (+ | -) product }
+//   product    := unary { (* | /) unary }
+//   unary      := - unary | power
+//   power      := primary [ ^ unary ]
+//   primary    := number | name | 'name' | function ( comparison [, comparison] ) | ( comparison ) | |comparison|
+class FeatureExpression::Parser
+{
+public:
+    Parser(const std::string& text, FeatureExpression& expression) : mText(text), mExpression(expression) {}
+
+    bool parse(std::string& error)
+    {
+        const bool isValid = parseComparison() && (skipSpaces() == mText.size());
+        if (!isValid)
+            error = mError.empty() ? "unexpected '" + mText.substr(mPos) + "'" : mError;
+        return isValid;
+    }
+
+private:
+    size_t skipSpaces()
+    {
+        while ((mPos < mText.size()) && std::isspace(static_cast<unsigned char>(mText[mPos])))
+            ++mPos;
+        return mPos;
+    }
+
+    bool accept(const std::string& token)
+    {
+        skipSpaces();
+        if (mText.compare(mPos, token.size(), token) != 0)
+            return false;
+        mPos += token.size();
+        return true;
+    }
+
+    bool fail(const std::string& error)
+    {
+        if (mError.empty())
+            mError = error;
+        return false;
+    }
+
+    void emit(EOperation operation, int nbOperands)
+    {
+        Instruction instruction;
+        instruction.mOperation = operation;
+        emit(instruction, nbOperands);
+    }
+
+    void emit(const Instruction& instruction, int nbOperands)
+    {
+        mExpression.mProgram.push_back(instruction);
+        mDepth += 1 - nbOperands;
+        mExpression.mStackSize = std::max(mExpression.mStackSize, static_cast<size_t>(mDepth));
+    }
+
+    bool parseComparison()
+    {
+        if (!parseSum())
+            return false;
+
+        // Longest tokens first.
+        const std::pair<const char*, EOperation> operators[] = { { "<=", EOperation::eLessEqual }, { ">=", EOperation::eGreaterEqual }, { "==", EOperation::eEqual },
+            { "!=", EOperation::eNotEqual }, { "<", EOperation::eLess }, { ">", EOperation::eGreater } };
+        for (const auto& op : operators)
+        {
+            if (accept(op.first))
+            {
+                if (!parseSum())
+                    return false;
+                emit(op.second, 2);
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    bool parseSum()
+    {
+        if (!parseProduct())
+            return false;
+
+        while (true)
+        {
+            EOperation operation;
+            if (accept("+")) operation = EOperation::eAdd;
+            else if (accept("-")) operation = EOperation::eSubtract;
+            else return true;
+
+            if (!parseProduct())
+                return false;
+            emit(operation, 2);
+        }
+    }
+
+    bool parseProduct()
+    {
+        if (!parseUnary())
+            return false;
+
+        while (true)
+        {
+            EOperation operation;
+            if (accept("*")) operation = EOperation::eMultiply;
+            else if (accept("/")) operation = EOperation::eDivide;
+            else return true;
+
+            if (!parseUnary())
+                return false;
+            emit(operation, 2);
+        }
+    }
+
+    bool parseUnary()
+    {
+        if (accept("-"))
+        {
+            if (!parseUnary())
+                return false;
+            emit(EOperation::eNegate, 1);
+            return true;
+        }
+
+        return parsePower();
+    }
+
+    bool parsePower()
+    {
+        if (!parsePrimary())
+            return false;
+
+        if (accept("^"))
+        {
+            if (!parseUnary()) // right associative
+                return false;
+            emit(EOperation::ePower, 2);
+        }
+
+        return true;
+    }
+
+    bool parsePrimary()
+    {
+        skipSpaces();
+        if (mPos >= mText.size())
+            return fail("unexpected end of expression");
+
+        if (accept("("))
+            return parseComparison() && (accept(")") || fail("missing ')'"));
+
+        if (accept("|"))
+        {
+            if (!parseComparison() || !(accept("|") || fail("missing '|'")))
+                return false;
+            emit(EOperation::eAbs, 1);
+            return true;
+        }
+
+        if (accept("'"))
+        {
+            const size_t end = mText.find('\'', mPos);
+            if (end == std::string::npos)
+                return fail("missing closing quote");
+            const std::string name = mText.substr(mPos, end - mPos);
+            mPos = end + 1;
+            emitFeature(name);
+            return true;
+        }
+
+        const char c = mText[mPos];
+        if (std::isdigit(static_cast<unsigned char>(c)) || (c == '.'))
+        {
+            const char* start = mText.c_str() + mPos;
+            char* end = nullptr;
+            Instruction instruction;
+            instruction.mNumber = std::strtof(start, &end);
+            mPos += end - start;
+            emit(instruction, 0);
+            return true;
+        }
+
+        if (std::isalpha(static_cast<unsigned char>(c)) || (c == '_'))
+        {
+            const size_t start = mPos;
+            while ((mPos < mText.size()) && (std::isalnum(static_cast<unsigned char>(mText[mPos])) || (mText[mPos] == '_')))
+                ++mPos;
+            const std::string name = mText.substr(start, mPos - start);
+
+            if (!accept("("))
+            {
+                emitFeature(name);
+                return true;
+            }
+
+            return parseFunction(name);
+        }
+
+        return fail("unexpected '" + mText.substr(mPos) + "'");
+    }
+
+    bool parseFunction(const std::string& name)
+    {
+        const std::pair<const char*, EOperation> unaryFunctions[] = { { "abs", EOperation::eAbs }, { "sqrt", EOperation::eSqrt }, { "exp", EOperation::eExp }, { "log", EOperation::eLog } };
+        const std::pair<const char*, EOperation> binaryFunctions[] = { { "min", EOperation::eMin }, { "max", EOperation::eMax } };
+
+        for (const auto& function : unaryFunctions)
+        {
+            if (name == function.first)
+            {
+                if (!parseComparison() || !(accept(")") || fail("missing ')' after the argument of " + name)))
+                    return false;
+                emit(function.second, 1);
+                return true;
+            }
+        }
+
+        for (const auto& function : binaryFunctions)
+        {
+            if (name == function.first)
+            {
+                if (!parseComparison() || !(accept(",") || fail(name + " takes 2 arguments")) || !parseComparison() || !(accept(")") || fail("missing ')' after the arguments of " + name)))
+                    return false;
+                emit(function.second, 2);
+                return true;
+            }
+        }
+
+        return fail("unknown function '" + name + "'");
+    }
+
+    void emitFeature(const std::string& name)
+    {
+        auto& names = mExpression.mFeatureNames;
+        Instruction instruction;
+        instruction.mOperation = EOperation::eFeature;
+        instruction.mFeatureIdx = std::find(names.begin(), names.end(), name) - names.begin();
+        if (instruction.mFeatureIdx == names.size())
+            names.push_back(name);
+        emit(instruction, 0);
+    }
+
+    const std::string& mText;
+    FeatureExpression& mExpression;
+    size_t mPos{ 0 };
+    int mDepth{ 0 }; // number of values on the stack after the instructions written so far
+    std::string mError;
+};
+
+bool FeatureExpression::parse(const std::string& definition, std::string& error)
+{
+    *this = FeatureExpression();
+
+    const size_t equalPos = definition.find('=');
+    if ((equalPos == std::string::npos) || (definition.compare(equalPos, 2, "==") == 0))
+    {
+        error = "expected 'name = expression'";
+        return false;
+    }
+
+    auto trim = [](const std::string& str)
+    {
+        const size_t first = str.find_first_not_of(" \t");
+        return (first == std::string::npos) ? "" : str.substr(first, str.find_last_not_of(" \t") - first + 1);
+    };
+
+    mName = trim(definition.substr(0, equalPos));
+    if (mName.empty())
+    {
+        error = "missing feature name";
+        return false;
+    }
+
+    const std::string text = definition.substr(equalPos + 1);
+    Parser parser(text, *this);
+    if (!parser.parse(error))
+    {
+        *this = FeatureExpression();
+        return false;
+    }
+
+    mDefinition = mName + " = " + trim(text);
+    return true;
+}
+
+std::vector<float> FeatureExpression::evaluate(const pcl::PCLPointCloud2& message, const Features& features) const
+{
+    const size_t nbPoints = static_cast<size_t>(message.width) * message.height;
+    std::vector<float> result(nbPoints, std::numeric_limits<float>::quiet_NaN());
+    if (mProgram.empty())
+        return result;
+
+    // Where each feature comes from: the other features first, then the message; missing if none.
+    std::vector<const std::vector<float>*> featureValues(mFeatureNames.size(), nullptr);
+    std::vector<const pcl::PCLPointField*> featureFields(mFeatureNames.size(), nullptr);
+    for (size_t k = 0; k < mFeatureNames.size(); ++k)
+    {
+        const auto& name = mFeatureNames[k];
+        auto featureIt = std::find_if(features.begin(), features.end(), [&](const Features::value_type& f) { return f.first == name; });
+        auto fieldIt = std::find_if(message.fields.begin(), message.fields.end(), [&](const pcl::PCLPointField& f) { return f.name == name; });
+
+        if ((featureIt != features.end()) && (featureIt->second.size() == nbPoints))
+            featureValues[k] = &featureIt->second;
+        else if (fieldIt != message.fields.end())
+            featureFields[k] = &*fieldIt;
+    }
+
+    std::atomic<size_t> nextChunk{ 0 };
+    auto evaluateChunks = [&]()
+    {
+        std::vector<std::vector<float>> stack(mStackSize, std::vector<float>(sChunkSize));
+        for (size_t first = sChunkSize * nextChunk++; first < nbPoints; first = sChunkSize * nextChunk++)
+        {
+            const size_t n = std::min(sChunkSize, nbPoints - first);
+            size_t depth = 0;
+            for (const auto& instruction : mProgram)
+            {
+                float* b = (depth >= 1) ? stack[depth - 1].data() : nullptr; // top of the stack: operand of unary operations, right operand of binary ones
+                float* a = (depth >= 2) ? stack[depth - 2].data() : nullptr; // left operand of binary operations, receives the result
+
+                switch (instruction.mOperation)
+                {
+                case EOperation::eNumber: std::fill(stack[depth].begin(), stack[depth].begin() + n, instruction.mNumber); ++depth; break;
+                case EOperation::eFeature:
+                {
+                    float* values = stack[depth++].data();
+                    const size_t k = instruction.mFeatureIdx;
+                    if (featureValues[k])
+                        std::copy(featureValues[k]->begin() + first, featureValues[k]->begin() + first + n, values);
+                    else if (featureFields[k])
+                        gatherField(message, *featureFields[k], first, n, values);
+                    else
+                        std::fill(values, values + n, std::numeric_limits<float>::quiet_NaN());
+                    break;
+                }
+                case EOperation::eNegate: applyUnary(b, n, [](float x) { return -x; }); break;
+                case EOperation::eAbs: applyUnary(b, n, [](float x) { return std::abs(x); }); break;
+                case EOperation::eSqrt: applyUnary(b, n, [](float x) { return std::sqrt(x); }); break;
+                case EOperation::eExp: applyUnary(b, n, [](float x) { return std::exp(x); }); break;
+                case EOperation::eLog: applyUnary(b, n, [](float x) { return std::log(x); }); break;
+                case EOperation::eAdd: applyBinary(a, b, n, [](float x, float y) { return x + y; }); --depth; break;
+                case EOperation::eSubtract: applyBinary(a, b, n, [](float x, float y) { return x - y; }); --depth; break;
+                case EOperation::eMultiply: applyBinary(a, b, n, [](float x, float y) { return x * y; }); --depth; break;
+                case EOperation::eDivide: applyBinary(a, b, n, [](float x, float y) { return x / y; }); --depth; break;
+                case EOperation::ePower: applyBinary(a, b, n, [](float x, float y) { return std::pow(x, y); }); --depth; break;
+                case EOperation::eMin: applyBinary(a, b, n, [](float x, float y) { return std::min(x, y); }); --depth; break;
+                case EOperation::eMax: applyBinary(a, b, n, [](float x, float y) { return std::max(x, y); }); --depth; break;
+                case EOperation::eLess: applyBinary(a, b, n, [](float x, float y) { return (x < y) ? 1.0f : 0.0f; }); --depth; break;
+                case EOperation::eLessEqual: applyBinary(a, b, n, [](float x, float y) { return (x <= y) ? 1.0f : 0.0f; }); --depth; break;
+                case EOperation::eGreater: applyBinary(a, b, n, [](float x, float y) { return (x > y) ? 1.0f : 0.0f; }); --depth; break;
+                case EOperation::eGreaterEqual: applyBinary(a, b, n, [](float x, float y) { return (x >= y) ? 1.0f : 0.0f; }); --depth; break;
+                case EOperation::eEqual: applyBinary(a, b, n, [](float x, float y) { return (x == y) ? 1.0f : 0.0f; }); --depth; break;
+                case EOperation::eNotEqual: applyBinary(a, b, n, [](float x, float y) { return (x != y) ? 1.0f : 0.0f; }); --depth; break;
+                }
+            }
+
+            std::copy(stack[0].begin(), stack[0].begin() + n, result.begin() + first);
+        }
+    };
+
+    const size_t nbThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), nbPoints / sChunkSize + 1);
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nbThreads; ++t)
+        threads.emplace_back(evaluateChunks);
+    evaluateChunks();
+    for (auto& thread : threads)
+        thread.join();
+
+    return result;
+}
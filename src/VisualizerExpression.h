@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <pcl/PCLPointCloud2.h>
+
+namespace pcv
+{
+    /// Values of a feature for each point, converted to float; NaN if the message does not have the feature.
+    std::vector<float> readFeatureValues(const pcl::PCLPointCloud2& message, const std::string& name);
+
+    /// A derived feature, computed for every point from the features of a point cloud message.
+    /// It is defined as "name = expression", where the expression uses feature names, numbers, + - * / ^,
+    /// comparisons (< <= > >= == !=, giving 1 or 0), parentheses, |a| and the functions abs, sqrt, exp, log, min, max.
+    /// Feature names that are not identifiers are quoted: 'compare-distance'. Missing features give NaN.
+    class FeatureExpression
+    {
+    public:
+        using Features = std::vector<std::pair<std::string, std::vector<float>>>; // name, value of each point
+
+        /// Parse a definition. Returns false, with the reason in error, if it is not valid.
+        /// @param[in] definition: "name = expression"
+        /// @param[out] error: what is wrong in the definition
+        bool parse(const std::string& definition, std::string& error);
+
+        const std::string& getName() const { return mName; }
+        const std::string& getDefinition() const { return mDefinition; }
+
+        /// Compute the value of each point, by chunks of points evaluated in parallel.
+        /// @param[in] message: point cloud message holding the features used by the expression
+        /// @param[in] features: other features, used before those of the message (e.g. features derived before this one)
+        std::vector<float> evaluate(const pcl::PCLPointCloud2& message, const Features& features = Features()) const;
+
+    private:
+        enum class EOperation { eNumber, eFeature, eNegate, eAbs, eSqrt, eExp, eLog, eAdd, eSubtract, eMultiply, eDivide, ePower, eMin, eMax, eLess, eLessEqual, eGreater, eGreaterEqual, eEqual, eNotEqual };
+
+        struct Instruction
+        {
+            EOperation mOperation{ EOperation::eNumber };
+            float mNumber{ 0.0f };    // eNumber
+            size_t mFeatureIdx{ 0 };  // eFeature, in mFeatureNames
+        };
+
+        class Parser;
+
+        std::string mName;
+        std::string mDefinition;
+        std::vector<Instruction> mProgram; // reverse polish notation
+        std::vector<std::string> mFeatureNames;
+        size_t mStackSize{ 0 }; // number of intermediate values needed to evaluate the program
+    };
+}
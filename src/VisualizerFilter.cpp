@@ -0,0 +1,171 @@
+#include "VisualizerFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "VisualizerExpression.h"
+
+using namespace pcv;
+
+PointMask::PointMask(pcl::PCLPointCloud2::ConstPtr message) :
+    mMessage(message)
+{
+    const size_t nbPoints = static_cast<size_t>(message->width) * message->height;
+    mNbHidingFilters.assign(nbPoints, 0);
+    mIsDisplayed.assign(nbPoints, 1);
+
+    // Same as the geometry handlers, that skip points with invalid x, y, z unless the cloud is dense, whatever the space.
+    const bool hasX = std::any_of(message->fields.begin(), message->fields.end(), [](const pcl::PCLPointField& f) { return f.name == "x"; });
+    if (!message->is_dense && hasX)
+    {
+        const auto x = readFeatureValues(*message, "x"), y = readFeatureValues(*message, "y"), z = readFeatureValues(*message, "z");
+        for (size_t i = 0; i < nbPoints; ++i)
+            mIsDisplayed[i] = std::isfinite(x[i]) && std::isfinite(y[i]) && std::isfinite(z[i]);
+    }
+}
+
+bool PointMask::setFilters(const std::vector<FeatureFilter>& filters)
+{
+    if (!mMessage)
+        return false;
+
+    std::unordered_map<std::string, FeatureFilter> newFilters;
+    for (const auto& filter : filters)
+        if (hasFeature(filter.mFeatureName))
+            newFilters[filter.mFeatureName] = filter;
+
+    bool isChanged = false;
+    for (const auto& item : mFilters)
+    {
+        auto newIt = newFilters.find(item.first);
+        if (newIt == newFilters.end())
+        {
+            addFilter(item.second, -1);
+            isChanged = true;
+        }
+        else if ((newIt->second.mMin != item.second.mMin) || (newIt->second.mMax != item.second.mMax))
+        {
+            moveFilter(item.second, newIt->second);
+            isChanged = true;
+        }
+    }
+
+    for (const auto& item : newFilters)
+    {
+        if (mFilters.count(item.first) == 0)
+        {
+            addFilter(item.second, 1);
+            isChanged = true;
+        }
+    }
+
+    mFilters = newFilters;
+    return isChanged;
+}
+
+size_t PointMask::getNbVisible() const
+{
+    return std::count(mNbHidingFilters.begin(), mNbHidingFilters.end(), 0);
+}
+
+bool PointMask::hasFeature(const std::string& name) const
+{
+    return mMessage && std::any_of(mMessage->fields.begin(), mMessage->fields.end(), [&](const pcl::PCLPointField& f) { return f.name == name; });
+}
+
+bool PointMask::getFeatureRange(const std::string& name, float& min, float& max)
+{
+    if (!hasFeature(name))
+        return false;
+
+    const auto& sorted = getSortedFeature(name);
+    if (sorted.mValues.empty())
+        return false;
+
+    min = sorted.mValues.front();
+    max = sorted.mValues.back();
+    return true;
+}
+
+std::vector<size_t> PointMask::getVisibleDisplayIndices() const
+{
+    std::vector<size_t> indices;
+    indices.reserve(mNbHidingFilters.size());
+
+    size_t displayIdx = 0;
+    for (size_t i = 0; i < mNbHidingFilters.size(); ++i)
+    {
+        if (!mIsDisplayed[i])
+            continue;
+        if (mNbHidingFilters[i] == 0)
+            indices.push_back(displayIdx);
+        ++displayIdx;
+    }
+
+    return indices;
+}
+
+const PointMask::SortedFeature& PointMask::getSortedFeature(const std::string& name)
+{
+    auto it = mSortedFeatures.find(name);
+    if (it != mSortedFeatures.end())
+        return it->second;
+
+    const auto values = readFeatureValues(*mMessage, name);
+    std::vector<std::pair<float, uint32_t>> pairs;
+    pairs.reserve(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        if (!std::isnan(values[i]))
+            pairs.emplace_back(values[i], static_cast<uint32_t>(i));
+
+    std::sort(pairs.begin(), pairs.end());
+
+    auto& sorted = mSortedFeatures[name];
+    sorted.mValues.reserve(pairs.size());
+    sorted.mPointIndices.reserve(pairs.size());
+    for (const auto& pair : pairs)
+    {
+        sorted.mValues.push_back(pair.first);
+        sorted.mPointIndices.push_back(pair.second);
+    }
+
+    return sorted;
+}
+
+void PointMask::addFilter(const FeatureFilter& filter, int increment)
+{
+    const auto values = readFeatureValues(*mMessage, filter.mFeatureName);
+    const float min = filter.mMin, max = filter.mMax;
+    const uint8_t delta = static_cast<uint8_t>(increment); // -1 wraps, the count goes back down
+    uint8_t* counts = mNbHidingFilters.data();
+    for (size_t i = 0; i < values.size(); ++i)
+        counts[i] += (values[i] >= min && values[i] <= max) ? 0 : delta; // NaN is outside
+}
+
+void PointMask::moveFilter(const FeatureFilter& from, const FeatureFilter& to)
+{
+    // Points inside a range are a contiguous part of the sorted values; NaN values are outside of both ranges.
+    const auto& sorted = getSortedFeature(from.mFeatureName);
+    auto getInside = [&](const FeatureFilter& filter)
+    {
+        const size_t first = std::lower_bound(sorted.mValues.begin(), sorted.mValues.end(), filter.mMin) - sorted.mValues.begin();
+        const size_t last = std::upper_bound(sorted.mValues.begin(), sorted.mValues.end(), filter.mMax) - sorted.mValues.begin();
+        return std::make_pair(first, std::max(first, last));
+    };
+
+    const auto before = getInside(from);
+    const auto after = getInside(to);
+
+    // Add increment to the points inside a, but not inside b.
+    auto update = [&](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b, uint8_t increment)
+    {
+        for (size_t k = a.first; k < std::min(a.second, b.first); ++k)
+            mNbHidingFilters[sorted.mPointIndices[k]] += increment;
+        for (size_t k = std::max(a.first, b.second); k < a.second; ++k)
+            mNbHidingFilters[sorted.mPointIndices[k]] += increment;
+    };
+
+    update(before, after, 1); // now hidden
+    update(after, before, static_cast<uint8_t>(-1)); // now visible
+}
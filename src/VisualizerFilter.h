@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pcl/PCLPointCloud2.h>
+
+namespace pcv
+{
+    /// A range of values of a feature; the points outside of it (or without a value) are hidden.
+    struct FeatureFilter
+    {
+        std::string mFeatureName;
+        float mMin{ 0.0f };
+        float mMax{ 0.0f };
+    };
+
+    /// Visible points of a cloud, given feature filters: a point is hidden if any filter hides it.
+    /// Adding or removing a filter is one pass over the feature values. Moving the range of a filter only
+    /// visits the points whose value is between the old and new thresholds, found in the sorted feature values.
+    class PointMask
+    {
+    public:
+        PointMask() = default;
+
+        /// The displayed points are those with valid x, y, z, in all spaces (see PointCloudGeometryHandlerSpace).
+        explicit PointMask(pcl::PCLPointCloud2::ConstPtr message);
+
+        /// Apply the filters; those on features that the cloud does not have are ignored.
+        /// Returns true if the filters of the cloud changed, so the visible points may have changed.
+        bool setFilters(const std::vector<FeatureFilter>& filters);
+
+        bool isVisible(size_t pointIdx) const { return mNbHidingFilters[pointIdx] == 0; }
+        size_t getNbVisible() const;
+        size_t getNbPoints() const { return mNbHidingFilters.size(); }
+        bool hasFeature(const std::string& name) const;
+
+        /// Smallest and largest values of a feature; false if it has no valid value.
+        bool getFeatureRange(const std::string& name, float& min, float& max);
+
+        /// Indices of the visible points among the displayed points (those with valid coordinates), in order.
+        std::vector<size_t> getVisibleDisplayIndices() const;
+
+    private:
+        struct SortedFeature
+        {
+            std::vector<float> mValues; // valid values, in increasing order
+            std::vector<uint32_t> mPointIndices; // point of each value
+        };
+
+        const SortedFeature& getSortedFeature(const std::string& name); // sorted on first use
+        void addFilter(const FeatureFilter& filter, int increment); // one pass: +1 (add) or -1 (remove) to the points it hides
+        void moveFilter(const FeatureFilter& from, const FeatureFilter& to);
+
+        pcl::PCLPointCloud2::ConstPtr mMessage;
+        std::vector<uint8_t> mIsDisplayed; // valid coordinates
+        std::vector<uint8_t> mNbHidingFilters; // number of filters hiding each point, visible if 0
+        std::unordered_map<std::string, FeatureFilter> mFilters; // applied filters, by feature
+        std::unordered_map<std::string, SortedFeature> mSortedFeatures;
+    };
+}
@@ -0,0 +1,82 @@
+#include "VisualizerHistogram.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#include "VisualizerExpression.h"
+
+using namespace pcv;
+
+FeatureHistogram FeatureHistogram::compute(const pcl::PCLPointCloud2& message, const std::string& name, float percentile, int nbBins)
+{
+    FeatureHistogram histogram;
+    histogram.mPercentile = std::min(std::max(percentile, 0.0f), 50.0f);
+    histogram.mBins.assign(std::max(nbBins, 1), 0);
+
+    auto values = readFeatureValues(message, name);
+    values.erase(std::remove_if(values.begin(), values.end(), [](float v) { return std::isnan(v); }), values.end());
+    if (values.empty())
+        return histogram;
+
+    // Percentiles by selection (partial sorts): the k-th smallest value is put at index k.
+    const size_t n = values.size();
+    const size_t lowIdx = static_cast<size_t>(std::floor(histogram.mPercentile / 100.0 * (n - 1)));
+    const size_t highIdx = std::max(lowIdx, static_cast<size_t>(std::ceil((1.0 - histogram.mPercentile / 100.0) * (n - 1))));
+
+    std::nth_element(values.begin(), values.begin() + lowIdx, values.end());
+    histogram.mLow = values[lowIdx];
+    histogram.mMin = *std::min_element(values.begin(), values.begin() + lowIdx + 1); // smaller values are before
+
+    std::nth_element(values.begin() + lowIdx, values.begin() + highIdx, values.end());
+    histogram.mHigh = values[highIdx];
+    histogram.mMax = *std::max_element(values.begin() + highIdx, values.end()); // larger values are after
+
+    histogram.mNbValues = n;
+
+    // Histogram over [low, high], each thread counting its chunks in its own bins.
+    const size_t chunkSize = 65536;
+    const size_t nbThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), n / chunkSize + 1);
+    const size_t nbBinsTotal = histogram.mBins.size() + 2; // below, bins, above
+    const float low = histogram.mLow;
+    const float scale = (histogram.mHigh > low) ? histogram.mBins.size() / (histogram.mHigh - low) : 0.0f;
+    const size_t lastBin = histogram.mBins.size() - 1;
+
+    std::vector<std::vector<size_t>> threadBins(nbThreads, std::vector<size_t>(nbBinsTotal, 0));
+    std::atomic<size_t> nextChunk{ 0 };
+    auto countChunks = [&](size_t t)
+    {
+        auto& bins = threadBins[t];
+        for (size_t first = chunkSize * nextChunk++; first < n; first = chunkSize * nextChunk++)
+        {
+            for (size_t i = first; i < std::min(first + chunkSize, n); ++i)
+            {
+                const float v = values[i];
+                if (v < low)
+                    ++bins[0];
+                else if (v > histogram.mHigh)
+                    ++bins[nbBinsTotal - 1];
+                else
+                    ++bins[1 + std::min(static_cast<size_t>((v - low) * scale), lastBin)];
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nbThreads; ++t)
+        threads.emplace_back(countChunks, t);
+    countChunks(0);
+    for (auto& thread : threads)
+        thread.join();
+
+    for (const auto& bins : threadBins)
+    {
+        histogram.mNbBelow += bins[0];
+        histogram.mNbAbove += bins[nbBinsTotal - 1];
+        for (size_t b = 0; b < histogram.mBins.size(); ++b)
+            histogram.mBins[b] += bins[b + 1];
+    }
+
+    return histogram;
+}
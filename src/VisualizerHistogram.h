@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <pcl/PCLPointCloud2.h>
+
+namespace pcv
+{
+    /// Distribution of the values of a feature of a loaded cloud: robust range (percentiles) and histogram over that range.
+    /// Unlike FeatureStats, read from the file header, it is computed from the loaded message, so derived features have one too.
+    struct FeatureHistogram
+    {
+        /// Compute the percentiles by selection, then the histogram over them, by chunks of values in parallel. NaN values are not counted.
+        /// @param[in] message: point cloud message
+        /// @param[in] name: feature name
+        /// @param[in] percentile: the range goes from this percentile to 100 minus it (0 for the min and max values)
+        /// @param[in] nbBins: number of bins of equal width over the range
+        static FeatureHistogram compute(const pcl::PCLPointCloud2& message, const std::string& name, float percentile, int nbBins);
+
+        bool isValid() const { return mNbValues > 0; }
+
+        float mPercentile{ 0.0f };
+        float mLow{ 0.0f };  // value at mPercentile
+        float mHigh{ 0.0f }; // value at 100 - mPercentile
+        float mMin{ 0.0f };
+        float mMax{ 0.0f };
+        std::vector<size_t> mBins; // counts over [mLow, mHigh]
+        size_t mNbBelow{ 0 };      // values below mLow
+        size_t mNbAbove{ 0 };      // values above mHigh
+        size_t mNbValues{ 0 };     // values that are not NaN
+    };
+}
@@ -0,0 +1,395 @@
+#include "VisualizerJournal.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+using namespace pcv;
+
+namespace
+{
+    const char sMagic[8] = { 'P', 'C', 'V', 'J', 'R', 'N', 'L', '1' };
+    const size_t sInitialCapacity = 1 << 20; // grows by doubling
+
+    std::mutex sInProcessMutex;
+    std::unordered_set<std::string> sInProcessJournals; // see Journal::InProcessLock
+
+    // Same key whatever the path used for a journal: its canonical folder, and its name.
+    std::string getJournalKey(const std::string& filename)
+    {
+        namespace fs = boost::filesystem;
+        const fs::path path(filename);
+        boost::system::error_code ec;
+        const auto folder = fs::canonical(path.has_parent_path() ? path.parent_path() : fs::current_path(), ec);
+        return ec ? filename : (folder / path.filename()).string();
+    }
+}
+
+/// Excludes the other users of a journal in this process, which file locks do not: they belong to the process (fcntl),
+/// and closing any handle on the lock file, even one opened only to test the lock, releases them.
+class Journal::InProcessLock
+{
+public:
+    explicit InProcessLock(const std::string& filename) : mKey(getJournalKey(filename))
+    {
+        std::lock_guard<std::mutex> lock(sInProcessMutex);
+        mIsLocked = sInProcessJournals.insert(mKey).second;
+    }
+
+    ~InProcessLock()
+    {
+        std::lock_guard<std::mutex> lock(sInProcessMutex);
+        if (mIsLocked)
+            sInProcessJournals.erase(mKey);
+    }
+
+    bool isLocked() const { return mIsLocked; }
+
+private:
+    std::string mKey;
+    bool mIsLocked{ false };
+};
+
+const std::string Journal::sExtension = ".pcdj";
+
+std::string Journal::getLockFilename(const std::string& filename)
+{
+    return filename + ".lock";
+}
+
+std::unique_ptr<boost::interprocess::file_lock> Journal::openLock(const std::string& filename)
+{
+    // The lock file is created if needed, but never truncated: another process may hold its lock.
+    const std::string lockFilename = getLockFilename(filename);
+    boost::system::error_code ec;
+    if (!boost::filesystem::exists(lockFilename, ec))
+        std::ofstream(lockFilename, std::ios::binary | std::ios::app);
+    return std::unique_ptr<boost::interprocess::file_lock>(new boost::interprocess::file_lock(lockFilename.c_str()));
+}
+
+Journal::Journal(const std::string& filename) : mFilename(filename)
+{
+    namespace bip = boost::interprocess;
+
+    // Lock first, so that neither a recovery nor another journal touches the file while it is written. The lock is a
+    // separate file: on POSIX, closing any handle on a locked file releases its lock, and on Windows, a locked file
+    // cannot be read through another handle.
+    mInProcessLock.reset(new InProcessLock(mFilename));
+    if (!mInProcessLock->isLocked())
+    {
+        logError("[Journal] journal file " + mFilename + " is already open in this process.");
+        mInProcessLock.reset();
+        return;
+    }
+
+    try
+    {
+        mLock = openLock(mFilename);
+        mLock->lock();
+
+        std::ofstream(mFilename, std::ios::binary | std::ios::trunc).write(sMagic, sizeof(sMagic));
+
+        mFile.reset(new bip::file_mapping(mFilename.c_str(), bip::read_write));
+        mSize = sizeof(sMagic);
+        reserve(sInitialCapacity);
+    }
+    catch (const bip::interprocess_exception& e)
+    {
+        logError("[Journal] could not map journal file " + mFilename + ": " + e.what());
+        mRegion.reset();
+        mFile.reset();
+        mLock.reset();
+        mInProcessLock.reset();
+    }
+}
+
+Journal::~Journal()
+{
+    // Unmapping does not need any flush: the OS writes back the pages by itself.
+    mRegion.reset();
+    mFile.reset();
+    mLock.reset();
+    mInProcessLock.reset();
+}
+
+void Journal::remove()
+{
+    mRegion.reset();
+    mFile.reset();
+
+    boost::system::error_code ec;
+    boost::filesystem::remove(mFilename, ec);
+
+    mLock.reset(); // must be released before deleting the lock file on Windows
+    boost::filesystem::remove(getLockFilename(mFilename), ec);
+    mInProcessLock.reset();
+}
+
+void Journal::map()
+{
+    namespace bip = boost::interprocess;
+    mRegion.reset(new bip::mapped_region(*mFile, bip::read_write, 0, mCapacity));
+}
+
+void Journal::reserve(size_t size)
+{
+    if (!mFile || size <= mCapacity)
+        return;
+
+    size_t capacity = std::max(mCapacity, sInitialCapacity);
+    while (capacity < size)
+        capacity *= 2;
+
+    // New pages are zero filled, which reads as the end record.
+    mRegion.reset();
+    boost::filesystem::resize_file(mFilename, capacity);
+    mCapacity = capacity;
+    map();
+}
+
+void Journal::writeRecord(ERecord type, const std::string& name, const void* data, size_t dataSize)
+{
+    const size_t align = sizeof(uint64_t);
+    const size_t recordSize = (sizeof(RecordHeader) + name.size() + dataSize + align - 1) / align * align;
+
+    reserve(mSize + recordSize + sizeof(RecordHeader)); // keep room for a zeroed header after the record
+    if (!mRegion)
+        return;
+
+    auto* record = static_cast<char*>(mRegion->get_address()) + mSize;
+
+    RecordHeader header{ static_cast<uint32_t>(ERecord::eEnd), static_cast<uint32_t>(name.size()), dataSize };
+    std::memcpy(record, &header, sizeof(header));
+    std::memcpy(record + sizeof(header), name.data(), name.size());
+    if (dataSize > 0)
+        std::memcpy(record + sizeof(header) + name.size(), data, dataSize);
+
+    // Publish the record by writing its type last; a crash in the middle leaves an end record.
+    std::atomic_thread_fence(std::memory_order_release);
+    *reinterpret_cast<volatile uint32_t*>(record) = static_cast<uint32_t>(type);
+
+    mSize += recordSize;
+}
+
+void Journal::writeFeature(const FeatureName& name, const FeatureData& data)
+{
+    writeRecord(ERecord::eFeature, name, data.data(), data.size() * sizeof(float));
+}
+
+void Journal::writeFeatureValues(const FeatureName& name, const float* values, size_t nbValues)
+{
+    writeRecord(ERecord::eFeatureValues, name, values, nbValues * sizeof(float));
+}
+
+void Journal::writeSpace(const Space& space)
+{
+    writeRecord(ERecord::eSpace, space.u1 + '\n' + space.u2 + '\n' + space.u3, nullptr, 0);
+}
+
+void Journal::writeProperties(const Cloud& cloud)
+{
+    PropertiesRecord props{};
+    props.mType = static_cast<int32_t>(cloud.mType);
+    props.mViewport = cloud.mViewport;
+    props.mSize = cloud.mSize;
+    props.mOpacity = cloud.mOpacity;
+    props.mNbColormapRange = static_cast<int32_t>(std::min<size_t>(cloud.mColormapRange.size(), 2));
+    for (int i = 0; i < props.mNbColormapRange; ++i)
+        props.mColormapRange[i] = cloud.mColormapRange[i];
+
+    writeRecord(ERecord::eProperties, "", &props, sizeof(props));
+}
+
+void Journal::writeSnapshot(const Cloud& cloud)
+{
+    writeRecord(ERecord::eClear, "", nullptr, 0);
+
+    for (const auto& feature : cloud.mFeatures)
+        writeFeature(feature.first, feature.second);
+
+    for (const auto& space : cloud.mSpaces)
+        writeSpace(space);
+
+    writeProperties(cloud);
+}
+
+std::string Journal::getRecoveredFilename(const std::string& filename)
+{
+    return boost::filesystem::path(filename).replace_extension(".pcd").string();
+}
+
+bool Journal::recover(const std::string& filename)
+{
+    namespace bip = boost::interprocess;
+
+    // Journals of this process first: their file lock does not exclude this process, and testing it would release it.
+    InProcessLock inProcessLock(filename);
+    if (!inProcessLock.isLocked())
+        return false; // still being written by this process
+
+    std::unique_ptr<bip::file_lock> lock;
+    std::unique_ptr<bip::file_mapping> file;
+    std::unique_ptr<bip::mapped_region> region;
+    try
+    {
+        lock = openLock(filename);
+        if (!lock->try_lock())
+            return false; // still being written by a running process
+
+        file.reset(new bip::file_mapping(filename.c_str(), bip::read_only));
+        region.reset(new bip::mapped_region(*file, bip::read_only));
+    }
+    catch (const bip::interprocess_exception& e)
+    {
+        logError("[Journal] could not read journal file " + filename + ": " + e.what());
+        return false;
+    }
+
+    // Read in place: the journal is not written anymore.
+    const char* buffer = static_cast<const char*>(region->get_address());
+    const size_t bufferSize = region->get_size();
+
+    if (bufferSize < sizeof(sMagic) || std::memcmp(buffer, sMagic, sizeof(sMagic)) != 0)
+    {
+        logError("[Journal] " + filename + " is not a valid journal file.");
+        return false;
+    }
+
+    Cloud cloud;
+    std::vector<std::array<FeatureName, 3>> spaces;
+
+    // Replay records until the end record, or until a truncated record.
+    size_t pos = sizeof(sMagic);
+    while (pos + sizeof(RecordHeader) <= bufferSize)
+    {
+        RecordHeader header;
+        std::memcpy(&header, buffer + pos, sizeof(header));
+
+        const size_t dataPos = pos + sizeof(header) + header.mNameSize;
+        if ((header.mType == static_cast<uint32_t>(ERecord::eEnd)) || (dataPos + header.mDataSize > bufferSize))
+            break;
+
+        const std::string name(buffer + pos + sizeof(header), header.mNameSize);
+        const char* data = buffer + dataPos;
+        const size_t nbValues = header.mDataSize / sizeof(float);
+
+        switch (static_cast<ERecord>(header.mType))
+        {
+        case ERecord::eFeature:
+        {
+            FeatureData values(nbValues);
+            std::memcpy(values.data(), data, nbValues * sizeof(float));
+            if (cloud.hasFeature(name)) cloud.getFeatureData(name) = std::move(values);
+            else cloud.mFeatures.emplace_back(name, std::move(values));
+            break;
+        }
+        case ERecord::eFeatureValues:
+        {
+            if (!cloud.hasFeature(name)) cloud.mFeatures.emplace_back(name, FeatureData());
+            auto& values = cloud.getFeatureData(name);
+            const size_t offset = values.size();
+            values.resize(offset + nbValues);
+            std::memcpy(values.data() + offset, data, nbValues * sizeof(float));
+            break;
+        }
+        case ERecord::eSpace:
+        {
+            std::stringstream ss(name);
+            std::array<FeatureName, 3> space;
+            std::getline(ss, space[0]);
+            std::getline(ss, space[1]);
+            std::getline(ss, space[2]);
+            spaces.push_back(space);
+            break;
+        }
+        case ERecord::eProperties:
+        {
+            PropertiesRecord props;
+            std::memcpy(&props, data, std::min<size_t>(sizeof(props), header.mDataSize));
+            cloud.mType = static_cast<Cloud::EType>(props.mType);
+            cloud.mViewport = props.mViewport;
+            cloud.mSize = props.mSize;
+            cloud.mOpacity = props.mOpacity;
+            cloud.mColormapRange.assign(props.mColormapRange, props.mColormapRange + props.mNbColormapRange);
+            break;
+        }
+        case ERecord::eClear:
+        {
+            cloud.mFeatures.clear();
+            spaces.clear();
+            break;
+        }
+        default:
+            break;
+        }
+
+        const size_t align = sizeof(uint64_t);
+        pos += (sizeof(header) + header.mNameSize + header.mDataSize + align - 1) / align * align;
+    }
+
+    region.reset();
+    file.reset(); // must be unmapped before deleting the file on Windows
+
+    // Spaces are built at the end, once the features are complete.
+    for (const auto& space : spaces)
+        cloud.addSpace(space[0], space[1], space[2]);
+
+    // A process may crash before its first space (e.g. between its features): use the usual one.
+    if (cloud.mSpaces.empty() && cloud.hasFeature("x") && cloud.hasFeature("y") && cloud.hasFeature("z"))
+        cloud.addSpace("x", "y", "z");
+
+    if (cloud.getNbFeatures() > 0 && cloud.mSpaces.empty())
+    {
+        logWarning("[Journal] " + filename + " has features but no space, keeping it.");
+        return false;
+    }
+
+    bool isRecovered = false;
+    if (cloud.getNbFeatures() > 0)
+    {
+        cloud.save(getRecoveredFilename(filename));
+        isRecovered = true;
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::remove(filename, ec);
+
+    lock.reset(); // must be released before deleting the lock file on Windows
+    boost::filesystem::remove(getLockFilename(filename), ec);
+
+    return isRecovered;
+}
+
+int Journal::recoverFolder(const std::string& folder)
+{
+    namespace fs = boost::filesystem;
+
+    if (!fs::is_directory(folder))
+        return 0;
+
+    std::vector<std::string> journals;
+    for (const auto& file : fs::directory_iterator(folder))
+        if (file.path().extension() == sExtension)
+            journals.push_back(file.path().string());
+
+    int nbRecovered = 0;
+    for (const auto& journal : journals)
+    {
+        if (recover(journal))
+        {
+            std::cout << "[VISUALIZER] Recovered " << getRecoveredFilename(journal) << " from its journal." << std::endl;
+            ++nbRecovered;
+        }
+    }
+
+    return nbRecovered;
+}
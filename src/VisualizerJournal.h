@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+
+#include "VisualizerData.h"
+
+namespace pcv
+{
+    /// Append-only journal of the modifications made to a cloud, written in a memory-mapped file.
+    /// Since the pages belong to the OS page cache, the data survives a crash of the process without
+    /// having to flush anything. A journal is turned back into a regular PCD file with recover().
+    class Journal
+    {
+    public:
+        /// Lock a journal file for as long as this instance lives (see getLockFilename), then create (overwrite) it.
+        /// Nothing is written if the journal is already open in this process.
+        /// @param[in] filename: journal file name, with extension sExtension
+        Journal(const std::string& filename);
+        ~Journal();
+
+        /// Record the full content of a feature (replaces the previous content of the feature, if any).
+        void writeFeature(const FeatureName& name, const FeatureData& data);
+
+        /// Record values appended at the end of a feature.
+        void writeFeatureValues(const FeatureName& name, const float* values, size_t nbValues);
+
+        /// Record a space definition (see Cloud::addSpace).
+        void writeSpace(const Space& space);
+
+        /// Record the rendering properties and type of a cloud.
+        void writeProperties(const Cloud& cloud);
+
+        /// Record the complete state of a cloud (clears what was previously recorded).
+        void writeSnapshot(const Cloud& cloud);
+
+        /// Unmap, unlock and delete the journal file.
+        void remove();
+
+        const std::string& getFilename() const { return mFilename; }
+
+        /// Rebuild the cloud recorded in a journal and save it as a PCD file next to it, then delete the journal.
+        /// Journals still locked by a running process (this one included) are left untouched, as are those with features but no space to
+        /// display them (unless x, y and z features, used as the space).
+        /// @param[in] filename: journal file name
+        /// @return true if a PCD file was written
+        static bool recover(const std::string& filename);
+
+        /// Recover all journals of a folder (see recover()).
+        /// @param[in] folder: folder containing the journals
+        /// @return number of PCD files written
+        static int recoverFolder(const std::string& folder);
+
+        /// Get the PCD file name in which the cloud of a journal is recovered.
+        static std::string getRecoveredFilename(const std::string& filename);
+
+        /// Get the file locked while a journal is written, next to it.
+        static std::string getLockFilename(const std::string& filename);
+
+        static const std::string sExtension;
+
+    private:
+        enum class ERecord : uint32_t { eEnd = 0, eFeature, eFeatureValues, eSpace, eProperties, eClear };
+
+        struct RecordHeader
+        {
+            uint32_t mType;
+            uint32_t mNameSize;
+            uint64_t mDataSize;
+        };
+
+        struct PropertiesRecord
+        {
+            int32_t mType;
+            int32_t mViewport;
+            int32_t mSize;
+            int32_t mNbColormapRange;
+            double mOpacity;
+            double mColormapRange[2];
+        };
+
+        class InProcessLock;
+
+        void writeRecord(ERecord type, const std::string& name, const void* data, size_t dataSize);
+        void reserve(size_t size);
+        void map();
+        static std::unique_ptr<boost::interprocess::file_lock> openLock(const std::string& filename); // not locked yet; the journal must be locked in this process first
+
+        std::string mFilename;
+        size_t mSize{ 0 };
+        size_t mCapacity{ 0 };
+
+        std::unique_ptr<InProcessLock> mInProcessLock;
+        std::unique_ptr<boost::interprocess::file_lock> mLock;
+        std::unique_ptr<boost::interprocess::file_mapping> mFile;
+        std::unique_ptr<boost::interprocess::mapped_region> mRegion;
+    };
+}
@@ -0,0 +1,363 @@
+#include "VisualizerLive.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <random>
+#include <thread>
+
+#include <boost/interprocess/shared_memory_object.hpp>
+
+using namespace pcv;
+
+namespace bip = boost::interprocess;
+
+const std::string LiveRing::sDefaultName = "PointCloudVisualizerLive";
+
+namespace
+{
+    const uint32_t sVersion = 2;
+    const uint64_t sNbSlots = 1024; // records in the ring, at most
+    const uint64_t sComplete = uint64_t(1) << 63; // slot state flag: the record is written
+    const uint64_t sNbWriters = 64; // records written at once, at most
+    const auto sLockTimeout = std::chrono::seconds(1); // the reserve lock is held for a few instructions
+    const auto sWriteTimeout = std::chrono::seconds(5); // a record written for longer than that lost its writer
+
+    // Shared between processes, unlike the steady clock.
+    uint64_t getNowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    bool isTimedOut(uint64_t startMs)
+    {
+        const uint64_t nowMs = getNowMs();
+        return (nowMs > startMs) && (nowMs - startMs > static_cast<uint64_t>(std::chrono::milliseconds(sWriteTimeout).count()));
+    }
+}
+
+// A record being written, so that the writers of the next lap wait for it before writing over it.
+struct LiveRing::Writer
+{
+    std::atomic<uint64_t> mEnd{ 0 }; // of the record data, in the stream of all the data written; 0 if no record
+    uint64_t mBegin{ 0 };
+    uint64_t mStartMs{ 0 }; // a writer that takes too long is considered dead
+};
+
+// Layout of the shared memory: header, slots (one per record), data (records content, one after the other).
+struct LiveRing::Header
+{
+    std::atomic<uint32_t> mIsInitialized{ 0 }; // set last by the creator
+    uint32_t mVersion{ sVersion };
+    uint64_t mId{ 0 }; // of this ring, among the rings created with the same name
+    uint64_t mCapacity{ 0 }; // bytes of data
+    uint64_t mNbSlots{ sNbSlots };
+    std::atomic<uint32_t> mReserveLock{ 0 }; // between writers, only while reserving a record
+    uint64_t mNextOffset{ 0 }; // where the next record goes, in the stream of all the data written (under the lock)
+    std::atomic<uint64_t> mNbRecords{ 0 }; // reserved
+    std::atomic<uint64_t> mWriteEnd{ 0 }; // end of the data reserved: the data before it, minus the capacity, is overwritten
+    Writer mWriters[sNbWriters]; // claimed under the lock
+};
+
+struct LiveRing::Slot
+{
+    std::atomic<uint64_t> mState{ 0 }; // index + 1 of the record, with sComplete once written
+    uint64_t mOffset{ 0 };
+    uint64_t mSize{ 0 };
+    char mName[512];
+};
+
+// A spin lock in the shared memory, which a killed writer cannot leave locked for good:
+// it is only held for a few instructions, so after a while its holder is considered dead and it is taken over.
+class LiveRing::ReserveLock
+{
+public:
+    explicit ReserveLock(std::atomic<uint32_t>& lock) : mLock(lock)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + sLockTimeout;
+        uint32_t expected = 0;
+        while (!mLock.compare_exchange_weak(expected, 1, std::memory_order_acquire) && (std::chrono::steady_clock::now() < deadline))
+        {
+            expected = 0;
+            std::this_thread::yield();
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire); // also when taken over
+    }
+
+    ~ReserveLock() { mLock.store(0, std::memory_order_release); }
+
+private:
+    std::atomic<uint32_t>& mLock;
+};
+
+size_t LiveRing::getDataOffset(uint64_t nbSlots)
+{
+    const size_t align = 64;
+    const size_t headerSize = (sizeof(Header) + align - 1) / align * align;
+    return headerSize + nbSlots * sizeof(Slot);
+}
+
+std::shared_ptr<LiveRing> LiveRing::create(const std::string& name, size_t capacity)
+{
+    std::shared_ptr<LiveRing> ring(new LiveRing());
+    if (ring->map(name, true, capacity) || ring->map(name, false, capacity))
+        return ring;
+
+    // Left by a process that crashed while creating it, or by another version: replace it (readers keep their mapping).
+    bip::shared_memory_object::remove(name.c_str());
+    return ring->map(name, true, capacity) ? ring : nullptr;
+}
+
+std::shared_ptr<LiveRing> LiveRing::open(const std::string& name)
+{
+    std::shared_ptr<LiveRing> ring(new LiveRing());
+    if (!ring->map(name, false, 0))
+        return nullptr;
+
+    // Start with the oldest record still in the ring, written or being written.
+    const uint64_t nbRecords = ring->mHeader->mNbRecords.load(std::memory_order_acquire);
+    ring->mNextIdx = (nbRecords > ring->mHeader->mNbSlots) ? nbRecords - ring->mHeader->mNbSlots : 0;
+    for (; ring->mNextIdx < nbRecords; ++ring->mNextIdx)
+    {
+        const Slot& slot = ring->getSlot(ring->mNextIdx);
+        const bool isSameRecord = ((slot.mState.load(std::memory_order_acquire) & ~sComplete) == ring->mNextIdx + 1);
+        if (isSameRecord && (ring->mHeader->mWriteEnd.load(std::memory_order_acquire) <= slot.mOffset + ring->mHeader->mCapacity))
+            break;
+    }
+
+    return ring;
+}
+
+bool LiveRing::map(const std::string& name, bool isCreator, size_t capacity)
+{
+    mName = name;
+
+    try
+    {
+        if (isCreator)
+        {
+            bip::shared_memory_object shm(bip::create_only, name.c_str(), bip::read_write);
+            shm.truncate(getDataOffset(sNbSlots) + capacity);
+            bip::mapped_region region(shm, bip::read_write);
+            mRegion.swap(region);
+
+            char* pBegin = static_cast<char*>(mRegion.get_address());
+            mHeader = new (pBegin) Header();
+            mHeader->mId = (static_cast<uint64_t>(std::random_device()()) << 32) ^ static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count());
+            mHeader->mCapacity = capacity;
+            mSlots = reinterpret_cast<Slot*>(pBegin + getDataOffset(0));
+            for (uint64_t i = 0; i < sNbSlots; ++i)
+                new (&mSlots[i]) Slot();
+            mData = pBegin + getDataOffset(sNbSlots);
+
+            mHeader->mIsInitialized.store(1, std::memory_order_release);
+            return true;
+        }
+
+        bip::shared_memory_object shm(bip::open_only, name.c_str(), bip::read_write);
+        bip::mapped_region region(shm, bip::read_write);
+        mRegion.swap(region);
+
+        if (mRegion.get_size() < getDataOffset(0))
+            return false;
+
+        // The creator may still be initializing it.
+        char* pBegin = static_cast<char*>(mRegion.get_address());
+        mHeader = reinterpret_cast<Header*>(pBegin);
+        for (int i = 0; (i < 100) && (mHeader->mIsInitialized.load(std::memory_order_acquire) == 0); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        if ((mHeader->mIsInitialized.load(std::memory_order_acquire) == 0) || (mHeader->mVersion != sVersion) ||
+            (mRegion.get_size() < getDataOffset(mHeader->mNbSlots) + mHeader->mCapacity))
+            return false;
+
+        mSlots = reinterpret_cast<Slot*>(pBegin + getDataOffset(0));
+        mData = pBegin + getDataOffset(mHeader->mNbSlots);
+        return true;
+    }
+    catch (const bip::interprocess_exception&)
+    {
+        return false; // does not exist (open), or already exists (create)
+    }
+}
+
+LiveRing::Slot& LiveRing::getSlot(uint64_t idx) const
+{
+    return mSlots[idx % mHeader->mNbSlots];
+}
+
+bool LiveRing::publish(const std::string& name, size_t size, const std::function<void(char*)>& write)
+{
+    const uint64_t capacity = mHeader->mCapacity;
+    if ((size > capacity) || (name.size() >= sizeof(Slot::mName)))
+        return false;
+
+    uint64_t idx = 0, offset = 0;
+    Writer* writer = nullptr;
+    {
+        ReserveLock lock(mHeader->mReserveLock);
+
+        for (auto& candidate : mHeader->mWriters) // free, or left by a dead writer
+        {
+            if ((candidate.mEnd.load(std::memory_order_acquire) == 0) || isTimedOut(candidate.mStartMs))
+            {
+                writer = &candidate;
+                break;
+            }
+        }
+
+        if (!writer)
+            return false; // too many records written at once
+
+        // A record is contiguous: skip the end of the data if it does not fit before.
+        offset = mHeader->mNextOffset;
+        if (offset % capacity + size > capacity)
+            offset += capacity - offset % capacity;
+
+        idx = mHeader->mNbRecords.load(std::memory_order_relaxed);
+        Slot& slot = getSlot(idx);
+
+        // Invalidate what is overwritten (the slot, the data up to the end of this record) before writing it.
+        slot.mState.store(idx + 1, std::memory_order_relaxed);
+        mHeader->mWriteEnd.store(offset + size, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.mOffset = offset;
+        slot.mSize = size;
+        std::memcpy(slot.mName, name.c_str(), name.size() + 1);
+
+        writer->mBegin = offset;
+        writer->mStartMs = getNowMs();
+        writer->mEnd.store(offset + size, std::memory_order_release);
+
+        mHeader->mNextOffset = offset + size;
+        mHeader->mNbRecords.store(idx + 1, std::memory_order_release);
+    }
+
+    // Not under the lock: the other writers reserve and write their records meanwhile,
+    // except where the records of the previous lap are still written.
+    waitForWriters(offset, offset + size);
+    write(mData + offset % capacity);
+
+    // Unless a writer reused the slot meanwhile: then this record is overwritten anyway.
+    uint64_t state = idx + 1;
+    getSlot(idx).mState.compare_exchange_strong(state, (idx + 1) | sComplete, std::memory_order_release);
+
+    uint64_t end = offset + size; // unless it was considered dead and reclaimed
+    writer->mEnd.compare_exchange_strong(end, 0, std::memory_order_release);
+
+    return true;
+}
+
+void LiveRing::waitForWriters(uint64_t begin, uint64_t end) const
+{
+    const uint64_t capacity = mHeader->mCapacity;
+    for (const auto& writer : mHeader->mWriters)
+    {
+        while (true)
+        {
+            // Older records, written where this record goes, a lap before.
+            const uint64_t writerEnd = writer.mEnd.load(std::memory_order_acquire);
+            const uint64_t writerBegin = writer.mBegin;
+            const bool isOverlapping = (writerEnd != 0) && (writerBegin < begin) && (writerBegin + capacity < end) && (writerEnd + capacity > begin);
+            if (!isOverlapping || isTimedOut(writer.mStartMs))
+                break;
+
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool LiveRing::next(Record& record)
+{
+    const uint64_t nbRecords = mHeader->mNbRecords.load(std::memory_order_acquire);
+    const uint64_t nbSlots = mHeader->mNbSlots;
+    const uint64_t capacity = mHeader->mCapacity;
+
+    if (nbRecords > mNextIdx + nbSlots) // their slots were reused
+    {
+        mNbMissed += nbRecords - nbSlots - mNextIdx;
+        mNextIdx = nbRecords - nbSlots;
+        mWaitStart = std::chrono::steady_clock::time_point();
+    }
+
+    for (; mNextIdx < nbRecords; ++mNextIdx)
+    {
+        const Slot& slot = getSlot(mNextIdx);
+        const uint64_t state = slot.mState.load(std::memory_order_acquire);
+        if (state == mNextIdx + 1) // being written: wait for it, unless its writer died
+        {
+            const auto now = std::chrono::steady_clock::now();
+            if (mWaitStart == std::chrono::steady_clock::time_point())
+                mWaitStart = now;
+            if (now - mWaitStart < sWriteTimeout)
+                return false;
+        }
+
+        mWaitStart = std::chrono::steady_clock::time_point();
+        if (state != ((mNextIdx + 1) | sComplete))
+        {
+            ++mNbMissed;
+            continue;
+        }
+
+        record.mIdx = mNextIdx;
+        record.mOffset = slot.mOffset;
+        record.mSize = slot.mSize;
+        record.mName.assign(slot.mName, std::find(slot.mName, slot.mName + sizeof(slot.mName), '\0'));
+        record.mData = mData + record.mOffset % capacity;
+
+        // Fields read from a slot being rewritten may be anything: check them before the caller reads the data.
+        if (!isIntact(record) || (record.mOffset % capacity + record.mSize > capacity))
+        {
+            ++mNbMissed;
+            continue;
+        }
+
+        ++mNextIdx;
+        return true;
+    }
+
+    return false;
+}
+
+bool LiveRing::isIntact(const Record& record) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire); // what was read before is checked by the loads below
+    return (getSlot(record.mIdx).mState.load(std::memory_order_relaxed) == ((record.mIdx + 1) | sComplete)) &&
+        (mHeader->mWriteEnd.load(std::memory_order_relaxed) <= record.mOffset + mHeader->mCapacity);
+}
+
+size_t LiveRing::takeNbMissed()
+{
+    const size_t nbMissed = mNbMissed;
+    mNbMissed = 0;
+    return nbMissed;
+}
+
+size_t LiveRing::getCapacity() const
+{
+    return mHeader->mCapacity;
+}
+
+bool LiveRing::isReplaced() const
+{
+    try
+    {
+        bip::shared_memory_object shm(bip::open_only, mName.c_str(), bip::read_only);
+        bip::offset_t size = 0;
+        if (!shm.get_size(size) || (static_cast<size_t>(size) < sizeof(Header)))
+            return false; // being created
+
+        bip::mapped_region region(shm, bip::read_only, 0, sizeof(Header));
+        const auto* header = static_cast<const Header*>(region.get_address());
+        return (header->mIsInitialized.load(std::memory_order_acquire) != 0) && (header->mId != mHeader->mId);
+    }
+    catch (const bip::interprocess_exception&)
+    {
+        return false; // removed, not replaced yet
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace pcv
+{
+    /// Clouds published by running processes (VisualizerData) to the viewers of the same machine, through a ring buffer in shared memory.
+    /// A record is a cloud as it would be saved to its file: its file name and its PCD content. Writers never wait for readers:
+    /// a reader that falls behind by more than the ring misses the oldest records. Readers read the records in place, without copy,
+    /// then check that the record was not overwritten meanwhile (what was read from an overwritten record must be discarded).
+    /// Writers only lock the ring to reserve their record, then write it while the others write theirs; a writer killed
+    /// meanwhile delays the others by a few seconds, at most.
+    class LiveRing
+    {
+    public:
+        static const std::string sDefaultName;
+
+        struct Record
+        {
+            uint64_t mIdx{ 0 };
+            std::string mName;
+            const char* mData{ nullptr }; // in the shared memory
+            size_t mSize{ 0 };
+            uint64_t mOffset{ 0 }; // in the stream of all the data written to the ring
+        };
+
+        /// Create the shared memory, or open it if another process created it, to publish records.
+        /// Returns null if it cannot be created.
+        /// @param[in] name: shared memory name
+        /// @param[in] capacity: bytes of record data the ring holds (the size of an existing ring is kept)
+        static std::shared_ptr<LiveRing> create(const std::string& name, size_t capacity);
+
+        /// Open an existing ring to read its records; null if no process created it yet.
+        /// The first records read are the oldest ones still in the ring.
+        /// @param[in] name: shared memory name
+        static std::shared_ptr<LiveRing> open(const std::string& name);
+
+        /// Publish a record; returns false if it does not fit in the ring, or if too many records are written at once. Thread and process safe.
+        /// @param[in] name: record name (the file name of the cloud)
+        /// @param[in] size: size of the content, in bytes
+        /// @param[in] write: writes exactly size bytes of content at the given address
+        bool publish(const std::string& name, size_t size, const std::function<void(char*)>& write);
+
+        /// Get the next record to read, skipping those already overwritten; false if there is none.
+        /// Records are read in order: one being written is waited for (a few seconds, then skipped, if its writer died).
+        bool next(Record& record);
+
+        /// Whether a record was not overwritten since next() returned it, so that what was read from it is valid.
+        bool isIntact(const Record& record) const;
+
+        /// Number of records overwritten before they were read, since the last call.
+        size_t takeNbMissed();
+
+        size_t getCapacity() const;
+
+        /// Whether the shared memory of this name was replaced by another ring (e.g. a publisher replaced a corrupted one),
+        /// so that nothing will be published to this one anymore: open the name again.
+        bool isReplaced() const;
+
+    private:
+        struct Header;
+        struct Slot;
+        struct Writer;
+
+        class ReserveLock;
+
+        LiveRing() = default;
+        bool map(const std::string& name, bool isCreator, size_t capacity);
+        static size_t getDataOffset(uint64_t nbSlots); // header, then the slots
+        Slot& getSlot(uint64_t idx) const;
+        void waitForWriters(uint64_t begin, uint64_t end) const; // those still writing the previous lap of this data
+
+        boost::interprocess::mapped_region mRegion;
+        Header* mHeader{ nullptr };
+        Slot* mSlots{ nullptr };
+        char* mData{ nullptr };
+
+        std::string mName;
+        uint64_t mNextIdx{ 0 }; // reader: next record to read
+        size_t mNbMissed{ 0 };
+        std::chrono::steady_clock::time_point mWaitStart; // reader: since when the next record is being written
+    };
+}
@@ -0,0 +1,224 @@
+#include "VisualizerLoader.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace pcv;
+
+CloudLoader::CloudLoader()
+{
+    mThread = std::thread(&CloudLoader::run, this);
+}
+
+CloudLoader::~CloudLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mIsStopped = true;
+        mQueue.clear();
+    }
+
+    mCondition.notify_all();
+    mThread.join();
+}
+
+CloudLoader::Message CloudLoader::get(const std::string& key, const LoadFunction& load)
+{
+    std::shared_future<Message> future;
+    std::shared_ptr<std::packaged_task<Message()>> task;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto queueIt = std::find_if(mQueue.begin(), mQueue.end(), [&](const std::pair<std::string, std::shared_ptr<std::packaged_task<Message()>>>& item) { return item.first == key; });
+        auto cacheIt = mCache.find(key);
+
+        if (queueIt != mQueue.end()) // requested but not started: run it here rather than waiting for the queue
+        {
+            task = queueIt->second;
+            future = cacheIt->second.mFuture;
+            mQueue.erase(queueIt);
+        }
+        else if (cacheIt != mCache.end()) // loaded or being loaded
+        {
+            future = cacheIt->second.mFuture;
+        }
+        else
+        {
+            task = std::make_shared<std::packaged_task<Message()>>(timeLoad(key, load));
+            future = task->get_future().share();
+            mCache[key].mFuture = future;
+        }
+
+        mCache[key].mLastUse = ++mUseCount;
+        mProtectedKeys.insert(key);
+    }
+
+    if (task)
+        (*task)();
+
+    const Message message = future.get();
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        evict();
+    }
+
+    return message;
+}
+
+void CloudLoader::prefetch(const std::vector<Request>& requests, const std::unordered_set<std::string>& keep)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        mProtectedKeys = keep;
+        for (const auto& request : requests)
+            mProtectedKeys.insert(request.first);
+
+        // Tasks that are not started are dropped with their future (and queued again below if still requested).
+        for (const auto& item : mQueue)
+            mCache.erase(item.first);
+        mQueue.clear();
+
+        // Queue the requests in order of importance.
+        for (const auto& request : requests)
+        {
+            if (mCache.count(request.first) > 0)
+                continue;
+
+            auto task = std::make_shared<std::packaged_task<Message()>>(timeLoad(request.first, request.second));
+            mCache[request.first].mFuture = task->get_future().share();
+            mQueue.emplace_back(request.first, task);
+        }
+
+        evict();
+    }
+
+    mCondition.notify_all();
+}
+
+CloudLoader::Message CloudLoader::find(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto cacheIt = mCache.find(key);
+    if ((cacheIt == mCache.end()) || (getMessageSize(cacheIt->second.mFuture) == 0))
+        return Message();
+
+    cacheIt->second.mLastUse = ++mUseCount;
+    mProtectedKeys.insert(key);
+    return cacheIt->second.mFuture.get();
+}
+
+void CloudLoader::put(const std::string& key, const Message& message)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mQueue.erase(std::remove_if(mQueue.begin(), mQueue.end(), [&](const std::pair<std::string, std::shared_ptr<std::packaged_task<Message()>>>& item) { return item.first == key; }), mQueue.end());
+
+    std::promise<Message> promise;
+    promise.set_value(message);
+    mCache[key].mFuture = promise.get_future().share();
+    mCache[key].mLoadMs = 0.0;
+    mCache[key].mLastUse = ++mUseCount;
+    mProtectedKeys.insert(key);
+
+    evict();
+}
+
+void CloudLoader::setMemoryBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMemoryBudget = bytes;
+    evict();
+}
+
+size_t CloudLoader::getMemoryUsage() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    size_t usage = 0;
+    for (const auto& item : mCache)
+        usage += getMessageSize(item.second.mFuture);
+
+    return usage;
+}
+
+double CloudLoader::getLoadTime(const std::string& key) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto cacheIt = mCache.find(key);
+    return (cacheIt != mCache.end()) ? cacheIt->second.mLoadMs : 0.0;
+}
+
+CloudLoader::LoadFunction CloudLoader::timeLoad(const std::string& key, const LoadFunction& load)
+{
+    // Tasks run without the lock, in the loader thread or in get().
+    return [this, key, load]()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const Message message = load();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto cacheIt = mCache.find(key);
+        if (cacheIt != mCache.end())
+            cacheIt->second.mLoadMs = ms;
+
+        return message;
+    };
+}
+
+void CloudLoader::evict()
+{
+    // Only loaded messages that are not needed anymore can be dropped. A message being loaded is counted when done.
+    size_t usage = 0;
+    std::vector<std::pair<uint64_t, std::string>> candidates; // last use, key
+    for (const auto& item : mCache)
+    {
+        const size_t size = getMessageSize(item.second.mFuture);
+        usage += size;
+        if ((size > 0) && (mProtectedKeys.count(item.first) == 0))
+            candidates.emplace_back(item.second.mLastUse, item.first);
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+    for (const auto& candidate : candidates)
+    {
+        if (usage <= mMemoryBudget)
+            break;
+
+        usage -= getMessageSize(mCache[candidate.second].mFuture);
+        mCache.erase(candidate.second);
+    }
+}
+
+size_t CloudLoader::getMessageSize(const std::shared_future<Message>& future)
+{
+    if (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return 0;
+
+    const auto& message = future.get();
+    return message ? message->data.size() : 0;
+}
+
+void CloudLoader::run()
+{
+    while (true)
+    {
+        std::shared_ptr<std::packaged_task<Message()>> task;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this]() { return mIsStopped || !mQueue.empty(); });
+
+            if (mIsStopped)
+                return;
+
+            task = mQueue.front().second;
+            mQueue.pop_front();
+        }
+
+        (*task)();
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <pcl/PCLPointCloud2.h>
+
+namespace pcv
+{
+    /// Loads point cloud messages in a background thread, so that they are ready when needed.
+    /// Messages are identified by a key (the file name); a message is loaded only once while it is cached.
+    /// Loaded messages stay cached, least recently used first out, as long as they fit in the memory budget.
+    /// get() and prefetch() are meant to be called from a single thread (the UI thread).
+    class CloudLoader
+    {
+    public:
+        using Message = pcl::PCLPointCloud2::Ptr;
+        using LoadFunction = std::function<Message()>;
+        using Request = std::pair<std::string, LoadFunction>; // key, how to load it
+
+        CloudLoader();
+        ~CloudLoader();
+
+        /// Get a message, waiting for it if it is being loaded, or loading it now if it was not requested.
+        /// @param[in] key: message key
+        /// @param[in] load: how to load the message, if not already loaded or requested
+        Message get(const std::string& key, const LoadFunction& load);
+
+        /// Replace the queue of messages to load in background, most important first.
+        /// Cached messages that are neither in the requests nor in the keys to keep are dropped when over budget.
+        /// @param[in] requests: messages to load
+        /// @param[in] keep: keys of other messages to keep in the cache (typically, the messages currently used)
+        void prefetch(const std::vector<Request>& requests, const std::unordered_set<std::string>& keep);
+
+        /// Get a message if it is cached and loaded, without loading it; null otherwise.
+        /// @param[in] key: message key
+        Message find(const std::string& key);
+
+        /// Cache a message computed by the caller (e.g. with derived features), like the loaded ones.
+        /// @param[in] key: message key, replacing the message cached with this key if any
+        /// @param[in] message: the message
+        void put(const std::string& key, const Message& message);
+
+        /// Memory that loaded messages may use; the messages that are in use or requested are never dropped.
+        void setMemoryBudget(size_t bytes);
+
+        /// Memory used by the loaded messages.
+        size_t getMemoryUsage() const;
+
+        /// Time it took to load a message (reading and decoding the file), in ms; 0 if not loaded yet, or put by the caller.
+        /// @param[in] key: message key
+        double getLoadTime(const std::string& key) const;
+
+    private:
+        struct CacheEntry
+        {
+            std::shared_future<Message> mFuture;
+            uint64_t mLastUse{ 0 }; // to drop the least recently used first
+            double mLoadMs{ 0.0 };
+        };
+
+        void run();
+        void evict(); // mMutex must be locked
+        LoadFunction timeLoad(const std::string& key, const LoadFunction& load); // records the load time in the cache entry
+        static size_t getMessageSize(const std::shared_future<Message>& future); // 0 if not loaded yet
+
+        mutable std::mutex mMutex;
+        std::condition_variable mCondition;
+        bool mIsStopped{ false };
+
+        std::deque<std::pair<std::string, std::shared_ptr<std::packaged_task<Message()>>>> mQueue;
+        std::unordered_map<std::string, CacheEntry> mCache;
+        std::unordered_set<std::string> mProtectedKeys; // in use or requested
+        size_t mMemoryBudget{ 512 * 1024 * 1024 };
+        uint64_t mUseCount{ 0 };
+
+        std::thread mThread;
+    };
+}
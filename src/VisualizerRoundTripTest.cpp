@@ -0,0 +1,484 @@
+#include "stdafx.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <pcl/pcl_base.h>
+#include <pcl/point_types.h>
+#include <pcl/correspondence.h>
+
+#include "Visualizer.h"
+#include "VisualizerData.h"
+
+// Headless round-trip test: writes clouds with every capture API, reloads them with the viewer
+// loader (Visualizer::Cloud::parseFileHeader and load) and checks that the data is bit-exact and
+// that the header properties are preserved. Also reports the time spent in each capture API.
+//
+// Usage: VisualizerRoundTripTest [--keep]  (--keep: do not delete the written files)
+//
+// Returns 0 if all checks pass.
+
+using namespace pcv;
+
+namespace
+{
+    int sNbChecks = 0;
+    int sNbFailures = 0;
+
+    void check(bool condition, const std::string& msg)
+    {
+        ++sNbChecks;
+        if (!condition)
+        {
+            ++sNbFailures;
+            std::cout << "[FAILED] " << msg << std::endl;
+        }
+    }
+
+    std::vector<std::pair<std::string, double>> sTimings; // api name, total ms (in order of first call)
+
+    template<typename F>
+    auto timed(const std::string& api, F func) -> decltype(func())
+    {
+        const auto start = std::chrono::steady_clock::now();
+        auto&& result = func();
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        auto it = std::find_if(sTimings.begin(), sTimings.end(), [&](const std::pair<std::string, double>& t) { return t.first == api; });
+        if (it == sTimings.end()) sTimings.emplace_back(api, ms);
+        else it->second += ms;
+
+        return result;
+    }
+
+    template<typename T>
+    pcl::PointCloud<T> makeCloud(int nbPoints, unsigned int seed)
+    {
+        srand(seed);
+        auto randf = []() { return rand() / static_cast<float>(RAND_MAX) - 0.5f; };
+
+        pcl::PointCloud<T> cloud;
+        cloud.resize(nbPoints);
+        for (auto& p : cloud)
+        {
+            float* data = reinterpret_cast<float*>(&p);
+            for (size_t i = 0; i < sizeof(T) / sizeof(float); ++i)
+                data[i] = randf();
+        }
+
+        return cloud;
+    }
+
+    // Expected value of a feature once reloaded, considering its encoding.
+    bool isSameValue(float expected, float actual, const FeatureEncoding* encoding)
+    {
+        if (encoding)
+        {
+            const float decoded = (encoding->mType == EEncoding::eFloat16) ?
+                halfToFloat(floatToHalf(expected)) :
+                fixed16ToFloat(floatToFixed16(expected, *encoding), *encoding);
+
+            if (std::isnan(decoded)) return std::isnan(actual);
+            expected = decoded;
+        }
+
+        return std::memcmp(&expected, &actual, sizeof(float)) == 0; // bit-exact
+    }
+
+    // Lines are displayed as one polydata (PclVisualizer::addLines): 2 points, a segment and a color per line.
+    void checkLines(const std::string& prefix, const Cloud& cloud, const pcl::PCLPointCloud2& message)
+    {
+        const auto polydata = PclVisualizer::createLinesPolyData(message);
+        check(polydata != nullptr, prefix + "lines polydata");
+        if (!polydata)
+            return;
+
+        const int nbLines = cloud.getNbPoints();
+        auto* colors = polydata->GetCellData()->GetScalars();
+        check(polydata->GetNumberOfPoints() == 2 * nbLines, prefix + "lines points");
+        check(polydata->GetLines()->GetNumberOfCells() == nbLines, prefix + "lines segments");
+        check(colors && (colors->GetNumberOfTuples() == nbLines) && (colors->GetNumberOfComponents() == 3), prefix + "lines colors");
+        if ((polydata->GetNumberOfPoints() != 2 * nbLines) || !colors || (colors->GetNumberOfTuples() != nbLines))
+            return;
+
+        const auto& x = cloud.getFeatureData("x"), &y = cloud.getFeatureData("y"), &z = cloud.getFeatureData("z");
+        const auto& x2 = cloud.getFeatureData("x2"), &y2 = cloud.getFeatureData("y2"), &z2 = cloud.getFeatureData("z2");
+        const auto& rgb = cloud.getFeatureData("rgb");
+
+        int nbMismatches = 0;
+        for (int i = 0; i < nbLines; ++i)
+        {
+            double p1[3], p2[3];
+            polydata->GetPoint(2 * i, p1);
+            polydata->GetPoint(2 * i + 1, p2);
+            nbMismatches += (p1[0] != x[i]) || (p1[1] != y[i]) || (p1[2] != z[i]) || (p2[0] != x2[i]) || (p2[1] != y2[i]) || (p2[2] != z2[i]);
+
+            const auto color = static_cast<uint32_t>(rgb[i]);
+            nbMismatches += (colors->GetComponent(i, 0) != ((color >> 16) & 0xFF)) || (colors->GetComponent(i, 1) != ((color >> 8) & 0xFF)) || (colors->GetComponent(i, 2) != (color & 0xFF));
+        }
+        check(nbMismatches == 0, prefix + "lines polydata has " + std::to_string(nbMismatches) + " different lines");
+
+        pcl::PCLPointCloud2 truncated = message;
+        truncated.data.pop_back();
+        check(PclVisualizer::createLinesPolyData(truncated) == nullptr, prefix + "lines polydata of a truncated message");
+    }
+
+    // Spaces are displayed with the points that the color handlers color (valid x, y, z), coordinates not valid in the space being 0.
+    void checkSpaces(const std::string& prefix, const Visualizer::Cloud& loaded)
+    {
+        const auto& message = loaded.mPointCloudMessage;
+        if (message->fields.empty())
+            return;
+
+        const auto x = readFeatureValues(*message, "x"), y = readFeatureValues(*message, "y"), z = readFeatureValues(*message, "z");
+        pcl::visualization::PointCloudColorHandlerGenericField<pcl::PCLPointCloud2> colorHandler(message, message->fields.back().name);
+        vtkSmartPointer<vtkDataArray> scalars;
+        colorHandler.getColor(scalars);
+
+        for (const auto& space : loaded.mSpaces)
+        {
+            const std::string spacePrefix = prefix + "space " + space[0] + space[1] + space[2] + " ";
+            vtkSmartPointer<vtkPoints> points;
+            PointCloudGeometryHandlerSpace(message, space).getGeometry(points);
+            check(points && scalars && (points->GetNumberOfPoints() == scalars->GetNumberOfTuples()), spacePrefix + "points and colors do not match");
+            if (!points)
+                continue;
+
+            const std::array<std::vector<float>, 3> coordinates = { { readFeatureValues(*message, space[0]), readFeatureValues(*message, space[1]), readFeatureValues(*message, space[2]) } };
+            vtkIdType j = 0;
+            int nbMismatches = 0;
+            for (size_t i = 0; i < x.size(); ++i)
+            {
+                if (!message->is_dense && !(std::isfinite(x[i]) && std::isfinite(y[i]) && std::isfinite(z[i])))
+                    continue;
+
+                double p[3] = { 0.0, 0.0, 0.0 };
+                if (j < points->GetNumberOfPoints())
+                    points->GetPoint(j, p);
+                for (size_t k = 0; k < 3; ++k)
+                    nbMismatches += (p[k] != (std::isfinite(coordinates[k][i]) ? coordinates[k][i] : 0.0f)) ? 1 : 0;
+                ++j;
+            }
+            check((j == points->GetNumberOfPoints()) && (nbMismatches == 0), spacePrefix + "has " + std::to_string(nbMismatches) + " different coordinates");
+        }
+    }
+
+    void checkRoundTrip(const std::string& name, const Cloud& cloud, const std::string& filename)
+    {
+        const std::string prefix = "[" + name + "] ";
+
+        check(boost::filesystem::exists(filename), prefix + "file not written: " + filename);
+        if (!boost::filesystem::exists(filename))
+            return;
+
+        Visualizer::Cloud loaded;
+        loaded.mFullName = filename;
+        timed("parseFileHeader", [&]() { loaded.parseFileHeader(); return 0; });
+        timed("load", [&]() { loaded.load(); return 0; });
+
+        // Header.
+        check(static_cast<int>(loaded.mType) == static_cast<int>(cloud.mType), prefix + "type");
+        check(loaded.mViewport == cloud.mViewport, prefix + "viewport");
+        check(loaded.mRenderingProperties.mSize == cloud.mSize, prefix + "size");
+        check(loaded.mRenderingProperties.mOpacity == cloud.mOpacity, prefix + "opacity");
+        check(loaded.mRenderingProperties.mColormapRange == cloud.mColormapRange, prefix + "colormap range");
+
+        bool isSameSpaces = (loaded.mSpaces.size() == cloud.mSpaces.size());
+        for (size_t i = 0; isSameSpaces && (i < cloud.mSpaces.size()); ++i)
+        {
+            const auto& space = cloud.mSpaces[i];
+            isSameSpaces = (loaded.mSpaces[i] == std::array<FeatureName, 3>{ { space.u1, space.u2, space.u3 } });
+        }
+        check(isSameSpaces, prefix + "spaces");
+
+        // Data.
+        const auto& message = *loaded.mPointCloudMessage;
+        check(static_cast<int>(message.width * message.height) == cloud.getNbPoints(), prefix + "number of points");
+        check(static_cast<int>(message.fields.size()) == cloud.getNbFeatures(), prefix + "number of features");
+        if (static_cast<int>(message.fields.size()) != cloud.getNbFeatures() || static_cast<int>(message.width * message.height) != cloud.getNbPoints())
+            return;
+
+        for (int j = 0; j < cloud.getNbFeatures(); ++j)
+        {
+            const auto& feature = cloud.mFeatures[j];
+            const auto& field = message.fields[j];
+            check(field.name == feature.first, prefix + "feature name " + feature.first);
+
+            const bool isRgb = (feature.first == "rgb");
+            check(field.datatype == (isRgb ? pcl::PCLPointField::UINT32 : pcl::PCLPointField::FLOAT32), prefix + "feature type " + feature.first);
+
+            auto it = loaded.mEncodings.find(feature.first);
+            const FeatureEncoding* encoding = (it != loaded.mEncodings.end()) ? &it->second : nullptr;
+
+            int nbMismatches = 0;
+            for (int i = 0; i < cloud.getNbPoints(); ++i)
+            {
+                const auto* pData = &message.data[i * message.point_step + field.offset];
+                if (isRgb)
+                {
+                    uint32_t v;
+                    std::memcpy(&v, pData, sizeof(v));
+                    nbMismatches += (v != static_cast<uint32_t>(feature.second[i]));
+                }
+                else
+                {
+                    float v;
+                    std::memcpy(&v, pData, sizeof(v));
+                    nbMismatches += !isSameValue(feature.second[i], v, encoding);
+                }
+            }
+
+            check(nbMismatches == 0, prefix + "feature " + feature.first + " has " + std::to_string(nbMismatches) + " different values");
+
+            // Statistics written in the header.
+            if (!isRgb)
+            {
+                size_t count = 0;
+                float min = std::numeric_limits<float>::max(), max = std::numeric_limits<float>::lowest();
+                for (const auto v : feature.second)
+                {
+                    if (std::isnan(v)) continue;
+                    min = std::min(min, v);
+                    max = std::max(max, v);
+                    ++count;
+                }
+
+                auto statsIt = loaded.mFeatureStats.find(feature.first);
+                if (count == 0)
+                    check(statsIt == loaded.mFeatureStats.end(), prefix + "feature " + feature.first + " has stats but no values");
+                else if (statsIt == loaded.mFeatureStats.end())
+                    check(false, prefix + "feature " + feature.first + " has no stats");
+                else
+                {
+                    const auto& stats = statsIt->second;
+                    size_t histogramCount = 0;
+                    for (const auto c : stats.mHistogram)
+                        histogramCount += c;
+
+                    check(stats.mCount == count && stats.mMin == min && stats.mMax == max, prefix + "feature " + feature.first + " stats");
+                    check(histogramCount == count, prefix + "feature " + feature.first + " histogram");
+                }
+            }
+        }
+
+        if (cloud.mType == Cloud::EType::eLines)
+            checkLines(prefix, cloud, message);
+        else if (cloud.mType == Cloud::EType::ePoints)
+            checkSpaces(prefix, loaded);
+
+        // Live records are the file content, read from memory.
+        std::ifstream file(filename, std::ios::binary);
+        const std::vector<char> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        pcl::PCLPointCloud2 parsed, truncated;
+        const bool isParsed = loaded.parseMessage(content.data(), content.data() + content.size(), parsed);
+        check(isParsed && (parsed.data == message.data) && (parsed.point_step == message.point_step), prefix + "parsed from memory");
+        check(!loaded.parseMessage(content.data(), content.data() + content.size() - 1, truncated) || message.data.empty(), prefix + "truncated content parsed");
+    }
+
+    // Feature expressions: parsing, operator precedence, errors, and NaN propagation over chunks of points.
+    void checkExpressions()
+    {
+        const size_t nbPoints = 10000; // several chunks
+        pcl::PCLPointCloud2 message;
+        message.width = static_cast<uint32_t>(nbPoints);
+        message.height = 1;
+        message.point_step = sizeof(float);
+        message.row_step = message.point_step * message.width;
+        pcl::PCLPointField field;
+        field.name = "x";
+        field.offset = 0;
+        field.datatype = pcl::PCLPointField::FLOAT32;
+        field.count = 1;
+        message.fields.push_back(field);
+        message.data.resize(nbPoints * sizeof(float));
+
+        std::vector<float> a(nbPoints), x(nbPoints);
+        for (size_t i = 0; i < nbPoints; ++i)
+        {
+            a[i] = (i % 10 == 0) ? NAN : static_cast<float>(i);
+            x[i] = 0.5f * i;
+        }
+        std::memcpy(message.data.data(), x.data(), message.data.size());
+        const FeatureExpression::Features features = { { "a", a } };
+
+        auto evaluate = [&](const std::string& definition, std::vector<float>& values)
+        {
+            FeatureExpression expression;
+            std::string error;
+            const bool isParsed = expression.parse(definition, error);
+            check(isParsed, "[expression] " + definition + " not parsed: " + error);
+            values = isParsed ? expression.evaluate(message, features) : std::vector<float>();
+            return isParsed && (values.size() == nbPoints);
+        };
+
+        auto checkConstant = [&](const std::string& definition, float expected)
+        {
+            std::vector<float> values;
+            if (evaluate(definition, values))
+                check(std::all_of(values.begin(), values.end(), [&](float v) { return v == expected; }), "[expression] " + definition + " is not " + std::to_string(expected));
+        };
+
+        checkConstant("r = 1 + 2 * 3", 7.0f);
+        checkConstant("r = (1 + 2) * 3", 9.0f);
+        checkConstant("r = 10 - 4 - 3", 3.0f);
+        checkConstant("r = 8 / 4 / 2", 1.0f);
+        checkConstant("r = 2 ^ 3 ^ 2", 512.0f);
+        checkConstant("r = -2 ^ 2", -4.0f);
+        checkConstant("r = 2 * -3", -6.0f);
+        checkConstant("r = 1 + 2 < 4", 1.0f);
+        checkConstant("r = 3 >= 2 + 2", 0.0f);
+        checkConstant("r = 1 == 1", 1.0f);
+        checkConstant("r = |1 - 3| + abs(-1)", 3.0f);
+        checkConstant("r = max(1, 2) * min(3, 4) + sqrt(4)", 8.0f);
+        checkConstant("r = log(exp(0)) + 1", 1.0f);
+
+        // Features of the message and given features, quoted or not; NaN values and missing features give NaN.
+        std::vector<float> values;
+        if (evaluate("r = 'x' * 2 + a", values))
+        {
+            size_t nbMismatches = 0;
+            for (size_t i = 0; i < nbPoints; ++i)
+                nbMismatches += (std::isnan(a[i]) ? !std::isnan(values[i]) : (values[i] != 2 * x[i] + a[i])) ? 1 : 0;
+            check(nbMismatches == 0, "[expression] features have " + std::to_string(nbMismatches) + " different values");
+        }
+        if (evaluate("r = missing + 1", values))
+            check(std::all_of(values.begin(), values.end(), [](float v) { return std::isnan(v); }), "[expression] missing feature is not NaN");
+        if (evaluate("r = sqrt(-1) * 0", values))
+            check(std::all_of(values.begin(), values.end(), [](float v) { return std::isnan(v); }), "[expression] NaN is not propagated");
+
+        FeatureExpression expression;
+        std::string error;
+        check(expression.parse("  r2 =  a+1 ", error) && (expression.getName() == "r2") && (expression.getDefinition() == "r2 = a+1"), "[expression] name and definition");
+
+        const std::vector<std::string> invalid = { "r 1 + 2", "r == 1", "= 1", "r = ", "r = 1 +", "r = (1", "r = |1", "r = 'x",
+            "r = max(1)", "r = sqrt(1", "r = foo(1)", "r = 1 2", "r = 1 + * 2" };
+        for (const auto& definition : invalid)
+        {
+            error.clear();
+            check(!expression.parse(definition, error) && !error.empty() && expression.getName().empty(), "[expression] invalid " + definition + " parsed");
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const bool keepFiles = (argc > 1) && (std::string(argv[1]) == "--keep");
+
+    const int N = 5000;
+    const auto points = makeCloud<pcl::PointXYZ>(N, 1);
+    const auto points2 = makeCloud<pcl::PointXYZ>(N, 2);
+    const auto pointNormals = makeCloud<pcl::PointNormal>(N, 3);
+
+    std::vector<int> indices;
+    for (int i = 0; i < N; i += 3)
+        indices.push_back(i);
+
+    pcl::Correspondences correspondences;
+    for (int i = 0; i < N; i += 7)
+        correspondences.emplace_back(i, (i * 13) % N, 0.0f);
+
+    std::vector<std::string> filenames;
+    {
+        VisualizerData viz("roundtrip");
+
+        timed("addCloud", [&]() -> Cloud& { return viz.addCloud(points, "points").setSize(3).setOpacity(0.25).setColor(0.2f, 0.4f, 0.6f); });
+        timed("addCloud(PointNormal)", [&]() -> Cloud& { return viz.addCloud(pointNormals, "point-normals", 1); });
+        timed("addCloud(indices)", [&]() -> Cloud& { return viz.addCloud(points, indices, "points-indices", 2); });
+        timed("addCloudCorrespondences", [&]() -> Cloud& { return viz.addCloudCorrespondences(points, points2, correspondences, true, "correspondences-cloud"); });
+
+        timed("addFeature", [&]() -> Cloud&
+        {
+            FeatureData values(N);
+            for (int i = 0; i < N; ++i)
+                values[i] = (i % 11 == 0) ? NAN : std::sin(0.01f * i) * 1e3f;
+            return viz.addFeature(values, "wave", "points").setColormapRange(-1.5, 2.5);
+        });
+        timed("addFeature(lambda)", [&]() -> Cloud& { return viz.addFeature(points, "distance", "points", [](const pcl::PointXYZ& p) { return p.getVector3fMap().norm(); }); });
+        timed("addLabelsFeature", [&]() -> Cloud& { return viz.addLabelsFeature({ indices }, "labels", "points"); });
+        timed("setDefaultFeature", [&]() -> Cloud& { return viz.getCloud("points").setDefaultFeature("distance"); });
+        timed("addSpace", [&]() -> Cloud& { return viz.addSpace("x", "y", "distance", "points"); });
+
+        timed("setFeatureEncoding", [&]() -> Cloud&
+        {
+            auto& cloud = viz.addCloud(points2, "encoded");
+            cloud.addFeature(viz.getCloud("points").getFeatureData("wave"), "wave");
+            return cloud.setFeatureEncoding("x", EEncoding::eFixed16).setFeatureEncoding("y", EEncoding::eFloat16).setFeatureEncoding("wave", EEncoding::eFixed16);
+        });
+
+        timed("addSpace(NaN)", [&]() -> Cloud&
+        {
+            // Points with invalid x, y, z, and with coordinates that are not valid in the space only.
+            auto invalid = points2;
+            for (int i = 0; i < N; i += 13)
+                invalid[i].x = NAN;
+            FeatureData u(N);
+            for (int i = 0; i < N; ++i)
+                u[i] = (i % 7 == 0) ? NAN : 0.1f * i;
+            auto& cloud = viz.addCloud(invalid, "space-nan");
+            cloud.addFeature(u, "u");
+            return cloud.addSpace("x", "u", "z");
+        });
+
+        timed("addPlot", [&]() -> Cloud& { return viz.addPlot(std::vector<double>(100, 0.5), "plot", 1.0f); });
+        timed("addCloudIndexed", [&]() -> Cloud& { return viz.addCloudIndexed(points2, "points", 10, "points-indexed"); });
+
+        timed("addLine", [&]() -> Cloud&
+        {
+            for (int i = 0; i + 1 < 100; ++i)
+                viz.addLine(points[i].getVector3fMap(), points[i + 1].getVector3fMap(), "lines");
+            return viz.getCloud("lines");
+        });
+        timed("addCorrespondences", [&]() -> Cloud& { return viz.addCorrespondences(points, points2, correspondences, "correspondences"); });
+        timed("addCube", [&]() -> Cloud& { return viz.addCube(Eigen::Vector3f(1, 2, 3), Eigen::Quaternionf::Identity(), 1, 2, 3, "cube"); });
+        timed("addPlane", [&]() -> Cloud& { return viz.addPlane(Eigen::Vector3f(0, 0, 1), { 0, 0, 1, -1 }, 2.0, 3.0, Eigen::Vector3f::UnitY(), "plane", 1); });
+        timed("addSphere", [&]() -> Cloud& { return viz.addSphere(Eigen::Vector3f(1, 1, 1), 0.5, "sphere"); });
+        timed("addCylinder", [&]() -> Cloud& { return viz.addCylinder(Eigen::Vector3f::Zero(), Eigen::Vector3f::UnitZ(), 0.5, 2.0, "cylinder"); });
+
+        filenames = timed("render", [&]() { return viz.render(); });
+
+        const std::vector<std::string> names = {
+            "points", "point-normals", "points-indices", "correspondences-cloud", "encoded", "space-nan", "plot",
+            "points-indexed", "lines", "correspondences", "cube", "plane", "sphere", "cylinder" };
+
+        for (const auto& name : names)
+        {
+            const auto& cloud = viz.getCloud(name);
+            const auto filename = viz.getCloudFilename(cloud, name);
+            check(std::find(filenames.begin(), filenames.end(), filename) != filenames.end(), "[" + name + "] not rendered");
+            checkRoundTrip(name, cloud, filename);
+        }
+    }
+
+    checkExpressions();
+
+    if (!keepFiles)
+    {
+        boost::system::error_code ec;
+        for (const auto& filename : filenames)
+            boost::filesystem::remove(filename, ec);
+    }
+
+    // Timing per API, to compare serializers.
+    std::cout << std::endl << "Timing per API:" << std::endl;
+    for (const auto& timing : sTimings)
+        std::cout << "  " << std::left << std::setw(28) << timing.first << std::right << std::fixed << std::setprecision(3) << std::setw(10) << timing.second << " ms" << std::endl;
+
+    std::cout << std::endl << (sNbChecks - sNbFailures) << "/" << sNbChecks << " checks passed." << std::endl;
+
+    return (sNbFailures == 0) ? 0 : 1;
+}